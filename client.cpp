@@ -11,6 +11,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sstream>
+#include <fstream>
 #include <algorithm>
 #include <iomanip>      
 #include <openssl/evp.h>
@@ -19,11 +20,71 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif
 
 using namespace std;
 
 #define BUFFER_SIZE 4096
-#define CHUNK_SIZE (512 * 1024) 
+#define DIGEST_SIZE 20 // Raw SHA1 length
+#define DEFAULT_CHUNK_SIZE (512 * 1024)
+#define MIN_CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+#define PARITY_SUFFIX ".p2p_parity" // Sidecar holding the parity chunks of an erasure-coded share
+#define PACKED_SUFFIX ".p2p_packed" // Packed space of a directory download, removed once unpacked
+#define MIN_CHUNK_COUNT 8    // Small files are split into at least this many chunks when possible
+#define MAX_CHUNK_COUNT 2048 // Large files use bigger chunks to stay under this many chunks
+#define RATE_SLICE (16 * 1024) // Bytes sent/received per token bucket request
+#define SHAPER_IDLE_MS 60000   // Per-peer shaping state unused for this long is freed
+#define MAX_SHAPED_SENDERS 32  // Rate-limited chunk sends running on their own threads
+#define COMPRESS_SAMPLE_SIZE 4096 // Bytes trial-compressed to detect incompressible chunks
+#define COMPRESS_MIN_SAVING 0.9   // Send compressed only if it is below 90% of the raw size
+#define PEER_LISTEN_BACKLOG 128
+#define IO_BATCH_SIZE 32                   // Requests served or written per I/O batch
+#define IO_RING_ENTRIES 64
+#define IO_FIXED_BUFFERS 8                 // Registered buffers per ring
+#define IO_FIXED_BUFFER_SIZE (512 * 1024)
+#define MAX_INFLIGHT_TRANSFERS 64          // Concurrent chunk transfers in the download engine
+#define DEFAULT_CONNECT_TIMEOUT_MS 3000    // Connect must complete within this time
+#define DEFAULT_FIRST_BYTE_TIMEOUT_MS 5000 // First reply byte must arrive within this time after connecting
+#define DEFAULT_STALL_TIMEOUT_MS 5000      // Longest gap allowed between received bytes
+#define MAX_CHUNK_RETRIES 8                // Backoff rounds before a chunk with no working peer fails
+#define RETRY_BASE_DELAY_MS 500
+#define RETRY_MAX_DELAY_MS 30000
+#define PEER_REFRESH_MIN_GAP_MS 2000       // Minimum time between tracker refreshes
+#define PEER_REFRESH_INTERVAL_MS 30000     // Periodic refresh for long downloads
+#define STREAM_WINDOW_CHUNKS 16            // Streaming downloads fetch these chunks past the contiguous prefix first
+#define BITFIELD_POLL_INTERVAL_MS 1000     // How often a download asks its peers for have-updates
+#define BITFIELD_TIMEOUT_MS 1000           // Deadline for one get_bitfield exchange
+#define PEX_MAX_PEERS 50                   // Known peers kept per file, and the most sent in one get_peers reply
+#define PEX_MAX_FILES 16                   // Files whose known peers are kept
+#define PEX_INTERVAL_MS 5000               // How often a download gossips peers with its bitfield peers
+#define PEX_FANOUT 3                       // Peers asked per gossip round
+#define DEFAULT_UPLOAD_SLOTS 4             // Downloaders unchoked at once, one of them optimistically
+#define CHOKE_ROUND_MS 10000               // How often the unchoked downloaders are re-ranked
+#define OPTIMISTIC_UNCHOKE_ROUNDS 3        // Rounds between rotations of the optimistic unchoke
+#define UPLOAD_IDLE_MS 3000                // An unchoked downloader that stops asking frees its slot after this
+#define CHOKE_RETRY_MS 2000                // Choked downloaders are told to try again after this
+#define MAX_CHOKE_WAIT_MS 60000            // After this long choked, further choke waits of a chunk use up retries
+#define SUPERSEED_HOLD_MS 10000            // A super-seeded chunk may be sent again this long after its last send
+#define HEALTH_REPORT_INTERVAL_MS 30000    // Peer outcomes and upload load are reported to the tracker at most this often
 
 // --- Custom Functions ---
 void alertPrompt(const string& errorMsg, bool usePerror = false);
@@ -31,6 +92,7 @@ int myAtoi(const string& s);
 long myAtol(const string& s);
 int locate(const string& str, char delimiter);
 string substring(const string& str, int start, int length);
+string formatRate(double bytesPerSec);
 
 // --- Custom ArrayList Class ---
 template <typename T>
@@ -190,6 +252,22 @@ enum class CommandType {
     LIST_FILES,
     UPLOAD_FILE,
     DOWNLOAD_FILE,
+    DOWNLOAD_RANGE,
+    UPLOAD_DIR,
+    UPDATE_FILE,
+    DOWNLOAD_DIR,
+    SET_RATE,
+    SHOW_RATES,
+    SET_COMPRESSION,
+    SET_IO,
+    SET_TIMEOUTS,
+    SHOW_TIMEOUTS,
+    SET_SLOTS,
+    SHOW_SLOTS,
+    SUPER_SEED,
+    SET_VERIFY,
+    SET_MANIFEST,
+    BENCH_ERASURE,
     LOGOUT,
     QUIT,
     SHUTDOWN,
@@ -209,6 +287,22 @@ CommandType getCommandType(const string& command) {
     if (command == "list_files") return CommandType::LIST_FILES;
     if (command == "upload_file") return CommandType::UPLOAD_FILE;
     if (command == "download_file") return CommandType::DOWNLOAD_FILE;
+    if (command == "download_range") return CommandType::DOWNLOAD_RANGE;
+    if (command == "upload_dir") return CommandType::UPLOAD_DIR;
+    if (command == "update_file") return CommandType::UPDATE_FILE;
+    if (command == "download_dir") return CommandType::DOWNLOAD_DIR;
+    if (command == "set_rate") return CommandType::SET_RATE;
+    if (command == "show_rates") return CommandType::SHOW_RATES;
+    if (command == "set_compression") return CommandType::SET_COMPRESSION;
+    if (command == "set_io") return CommandType::SET_IO;
+    if (command == "set_timeouts") return CommandType::SET_TIMEOUTS;
+    if (command == "show_timeouts") return CommandType::SHOW_TIMEOUTS;
+    if (command == "set_slots") return CommandType::SET_SLOTS;
+    if (command == "show_slots") return CommandType::SHOW_SLOTS;
+    if (command == "super_seed") return CommandType::SUPER_SEED;
+    if (command == "set_verify") return CommandType::SET_VERIFY;
+    if (command == "set_manifest") return CommandType::SET_MANIFEST;
+    if (command == "bench_erasure") return CommandType::BENCH_ERASURE;
     if (command == "logout") return CommandType::LOGOUT;
     if (command == "quit") return CommandType::QUIT;
     if (command == "shutdown") return CommandType::SHUTDOWN;
@@ -227,32 +321,727 @@ struct ChunkInfo {
     int availability; // Number of peers who have this chunk
     ArrayList<PeerInfo> peersWithChunk;
     string expectedSha1; // Expected SHA1 hash of the chunk
+    long offset;         // Position of the chunk in the file; -1 for parity chunks
+    long length;         // Chunk length; varies for content-defined chunks
+    bool parity;         // Erasure-coded parity chunk, not part of the file bytes
+};
+
+// Erasure-coded files: after the data chunks come parityShards parity chunks for every
+// stripe of dataShards consecutive data chunks
+struct ErasureLayout {
+    int dataShards;   // 0 when the file has no parity chunks
+    int parityShards;
+    int dataChunks;
+};
+
+// Chunks of the current or last download_file that this client serves to other downloaders,
+// advertised with get_bitfield. Guarded by downloadMutex.
+struct SwarmFile {
+    string fileName;
+    string fileSha1;
+    string outputPath;
+    ArrayList<bool> have;    // Indexed by chunk index
+    ArrayList<int> haveLog;  // Chunk indices in arrival order; have-update sequence numbers are positions here
+    ArrayList<long> offsets; // Per chunk index; -1 for parity chunks
+    ArrayList<long> lengths;
+    bool downloading;        // Chunk bytes are still in chunkData, localChunkSources or below the watermark
+    bool complete;           // Verified: every data chunk is in outputPath
+};
+
+// What a peer of the current download reported having
+struct PeerBitfield {
+    PeerInfo peer;
+    ArrayList<bool> have;
+    int seq;         // Have-update sequence number to ask for next
+    bool responsive; // Answered get_bitfield; other peers keep the chunks the tracker listed
+    bool failed;     // Did not answer; not asked again during this download
+    bool complete;   // Has every chunk; nothing more to poll
+    bool querying;   // A get_bitfield exchange with the peer is in flight
+};
+
+// A short control request to a peer (get_bitfield, get_peers), run as a non-blocking exchange
+// on the download engine's poll loop; the peer answers and closes the connection
+struct ControlExchange {
+    PeerInfo peer;
+    bool getPeers;      // Peer exchange gossip rather than a bitfield request
+    int sock;
+    bool connecting;
+    string request;
+    size_t requestSent;
+    string reply;
+    long long deadline; // The whole exchange must finish by then
+    int pollIndex;      // Slot in this round's pollfd array, -1 if not polled
+};
+
+// A file inside a directory share, at `offset` in the packed chunk space
+struct PackedMember {
+    string path;
+    long offset;
+    long size;
 };
 
 struct OwnedFileInfo {
     string filePath;
+    string ownerId;
+    string groupId;
+    long fileSize;
+    int64_t mtimeNs; // Modification time and inode when hashed, to validate the share registry
+    uint64_t inode;
     string fileSHA1;
     ArrayList<string> chunkSHA1s;
     int totalChunks;
+    long chunkSize; // 0 for content-defined chunks
+    long cdcAverage = 0; // Content-defined chunks: average size the boundaries were cut for, reused by update_file
+    ArrayList<long> chunkOffsets;
+    ArrayList<long> chunkLengths;
+    ArrayList<string> merkleLayers; // Empty unless shared with a Merkle manifest
+    string packedHeader;            // Directory shares: file table at the start of the chunk space
+    ArrayList<PackedMember> members; // Directory shares: files packed after the header, in path order
+    int dataShards = 0;             // Erasure-coded shares: parity chunks are served from <filePath>.p2p_parity
+    int parityShards = 0;
+};
+
+// Number of chunk transfers from one peer that hit each deadline
+struct PeerTimeouts {
+    int connect;
+    int firstByte;
+    int stall;
+};
+
+// Chunk transfer outcomes from one peer since the last health report to the tracker
+struct PeerHealth {
+    int succeeded;
+    int failed;     // Refused, broken or corrupt transfers (choking does not count)
+    int timedOut;
+    long long bytes;
+    long long micros; // Time spent on the successful transfers
+};
+
+// Upload slot state of one downloader, kept by the peer server
+struct UploadSlot {
+    bool unchoked;
+    long long lastRequest;     // Interested while it keeps asking for chunks
+    double roundRareBytes;     // Bytes asked for this round, each chunk weighted by 1 / its availability
+    long long receivedAtRound; // Bytes we had downloaded from it when the round started
+    double reciprocation;      // Bytes per second it sent us in the last round
+    long long servedBytes;
+    int chokedRequests;
+};
+
+// Chunks a super-seeding uploader has sent for one of its files
+struct SuperSeedState {
+    ArrayList<int> sends;             // Times each chunk was sent
+    ArrayList<long long> lastSent;    // When each chunk was last sent
+    long long sentBytes;
+    int sentChunks;                   // Chunks sent at least once
+    int withheld;                     // Requests answered "choked" to save the uplink
+};
+
+// Where a chunk's bytes can be found on local disk
+struct ChunkLocation {
+    string filePath;
+    off_t offset;
+    size_t length;
+};
+
+// Monotonic clock in microseconds
+long long nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// --- Token Bucket Class ---
+// Refills at `rate` bytes per second up to `burst` bytes. A rate of 0 means unlimited.
+class TokenBucket {
+private:
+    long rate;
+    long burst;
+    double tokens;
+    long long lastRefill;
+    pthread_mutex_t mutex;
+
+    void refill(long long now) {
+        tokens += (now - lastRefill) * (double)rate / 1000000.0;
+        if (tokens > burst) tokens = burst;
+        lastRefill = now;
+    }
+
+public:
+    TokenBucket() : rate(0), burst(0), tokens(0), lastRefill(nowMicros()) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~TokenBucket() {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void setRate(long bytesPerSec) {
+        pthread_mutex_lock(&mutex);
+        rate = bytesPerSec > 0 ? bytesPerSec : 0;
+        burst = rate > RATE_SLICE ? rate : RATE_SLICE; // Allow up to one second of burst
+        tokens = burst;
+        lastRefill = nowMicros();
+        pthread_mutex_unlock(&mutex);
+    }
+
+    long getRate() {
+        pthread_mutex_lock(&mutex);
+        long r = rate;
+        pthread_mutex_unlock(&mutex);
+        return r;
+    }
+
+    // Takes `bytes` tokens and returns how long the caller must wait (in microseconds)
+    // before using them. Tokens may go negative so concurrent callers queue up fairly.
+    long long reserve(long bytes) {
+        pthread_mutex_lock(&mutex);
+        if (rate == 0) {
+            pthread_mutex_unlock(&mutex);
+            return 0;
+        }
+        refill(nowMicros());
+        tokens -= bytes;
+        long long waitMicros = 0;
+        if (tokens < 0) {
+            waitMicros = static_cast<long long>(-tokens * 1000000.0 / rate);
+        }
+        pthread_mutex_unlock(&mutex);
+        return waitMicros;
+    }
+};
+
+// --- Transfer Meter Class ---
+// Counts transferred bytes and measures the achieved rate over roughly one-second windows
+class TransferMeter {
+private:
+    long long totalBytes;
+    long long windowBytes;
+    long long windowStart;
+    long long startTime;
+    double lastRate;
+    pthread_mutex_t mutex;
+
+public:
+    TransferMeter() : totalBytes(0), windowBytes(0), lastRate(0) {
+        windowStart = startTime = nowMicros();
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~TransferMeter() {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void add(long bytes) {
+        pthread_mutex_lock(&mutex);
+        long long now = nowMicros();
+        totalBytes += bytes;
+        windowBytes += bytes;
+        if (now - windowStart >= 1000000LL) {
+            lastRate = windowBytes * 1000000.0 / (now - windowStart);
+            windowBytes = 0;
+            windowStart = now;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    long long total() {
+        pthread_mutex_lock(&mutex);
+        long long t = totalBytes;
+        pthread_mutex_unlock(&mutex);
+        return t;
+    }
+
+    // Rate of the last completed window, or 0 if the meter has been idle since
+    double currentRate() {
+        pthread_mutex_lock(&mutex);
+        double r = (nowMicros() - windowStart > 2000000LL) ? 0 : lastRate;
+        pthread_mutex_unlock(&mutex);
+        return r;
+    }
+
+    double averageRate() {
+        pthread_mutex_lock(&mutex);
+        long long elapsed = nowMicros() - startTime;
+        double r = elapsed > 0 ? totalBytes * 1000000.0 / elapsed : 0;
+        pthread_mutex_unlock(&mutex);
+        return r;
+    }
+};
+
+// Per-peer shaping state for one direction
+struct PeerShaper {
+    TokenBucket bucket;
+    TransferMeter meter;
+    int users;          // Holders from acquirePeerShaper; an unused shaper may be freed once idle
+    long long lastUsed;
+
+    PeerShaper() : users(0), lastUsed(0) {}
+};
+
+// --- I/O Engine ---
+enum class IoOp {
+    READ,
+    WRITE,
+    SEND
+};
+
+// One file read, file write or socket send, performed completely unless it fails
+struct IoRequest {
+    IoOp op;
+    int fd;
+    char* buffer;
+    size_t length;
+    off_t offset;    // File position (ignored for SEND)
+    int bufferIndex; // Registered buffer holding `buffer`, or -1
+    size_t done;     // Bytes completed so far
+    ssize_t result;  // Bytes completed, or -errno on failure
+
+    IoRequest() : op(IoOp::READ), fd(-1), buffer(NULL), length(0), offset(0), bufferIndex(-1), done(0), result(0) {}
+};
+
+// Runs batches of I/O requests. With io_uring (built with -DUSE_IO_URING) a whole batch
+// is submitted per io_uring_enter call, using registered buffers and a fixed file
+// table; otherwise, or if the ring cannot be created, it falls back to pread/pwrite/send.
+// Each thread doing I/O uses its own engine.
+class IoEngine {
+private:
+    bool ringReady;
+    char* fixedBuffers;
+    bool fixedBufferUsed[IO_FIXED_BUFFERS];
+#ifdef USE_IO_URING
+    int ringFd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned ringEntries;
+    bool fixedFiles;
+    bool ringBroken; // io_uring_enter failed once; the engine keeps to blocking syscalls
+    char* sqRing;
+    char* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    // Map the batch's descriptors into fixed file slots; returns false if that is not possible
+    bool registerBatchFiles(ArrayList<IoRequest>& requests, ArrayList<int>& slotFds) {
+        if (!fixedFiles) return false;
+        for (int i = 0; i < requests.size(); ++i) {
+            bool found = false;
+            for (int j = 0; j < slotFds.size(); ++j) {
+                if (slotFds.get(j) == requests.get(i).fd) found = true;
+            }
+            if (!found) {
+                if (slotFds.size() == IO_BATCH_SIZE * 2) return false;
+                slotFds.add(requests.get(i).fd);
+            }
+        }
+        return updateFileSlots(slotFds);
+    }
+
+    bool updateFileSlots(ArrayList<int>& slotFds) {
+        int fds[IO_BATCH_SIZE * 2];
+        for (int i = 0; i < slotFds.size(); ++i) {
+            fds[i] = slotFds.get(i);
+        }
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = 0;
+        update.fds = (unsigned long)fds;
+        return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES_UPDATE, &update, slotFds.size()) == slotFds.size();
+    }
+
+    int fixedSlot(ArrayList<int>& slotFds, int fd) {
+        for (int j = 0; j < slotFds.size(); ++j) {
+            if (slotFds.get(j) == fd) return j;
+        }
+        return -1;
+    }
+
+    // Reap the completions in the ring; short transfers are queued again for the remainder
+    void reapCompletions(ArrayList<IoRequest>& requests, ArrayList<bool>& complete, ArrayList<int>& queue, int& finished, int& inFlight) {
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+            int i = (int)cqe->user_data;
+            IoRequest& request = requests.get(i);
+            inFlight--;
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                queue.add(i);
+            } else if (cqe->res < 0) {
+                request.result = cqe->res;
+                complete.get(i) = true;
+                finished++;
+            } else {
+                request.done += cqe->res;
+                if (cqe->res == 0 || request.done == request.length) {
+                    request.result = request.done;
+                    complete.get(i) = true;
+                    finished++;
+                } else {
+                    queue.add(i);
+                }
+            }
+            head++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Unmap and close the ring; the kernel drops its fixed file and buffer registrations with it
+    void teardownRing() {
+        munmap(sqes, sqesSize);
+        if (cqRing != sqRing) munmap(cqRing, cqRingSize);
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+        ringReady = false;
+    }
+
+    void runRingBatch(ArrayList<IoRequest>& requests) {
+        ArrayList<int> slotFds;
+        bool useFixedFiles = registerBatchFiles(requests, slotFds);
+
+        ArrayList<int> queue;
+        ArrayList<bool> complete;
+        for (int i = 0; i < requests.size(); ++i) {
+            queue.add(i);
+            complete.add(false);
+        }
+        int finished = 0, inFlight = 0;
+        bool enterFailed = false;
+        while (finished < requests.size()) {
+            // Queue as many pending requests as the ring holds
+            unsigned tail = *sqTail;
+            int toSubmit = 0;
+            while (!queue.isEmpty() && inFlight < (int)ringEntries) {
+                int i = queue.get(queue.size() - 1);
+                queue.removeAt(queue.size() - 1);
+                IoRequest& request = requests.get(i);
+                unsigned index = tail & *sqMask;
+                struct io_uring_sqe* sqe = &sqes[index];
+                memset(sqe, 0, sizeof(*sqe));
+                bool fixedBuffer = request.bufferIndex >= 0 && request.op != IoOp::SEND;
+                if (request.op == IoOp::READ) {
+                    sqe->opcode = fixedBuffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                } else if (request.op == IoOp::WRITE) {
+                    sqe->opcode = fixedBuffer ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                } else {
+                    sqe->opcode = IORING_OP_SEND;
+                }
+                if (useFixedFiles) {
+                    sqe->fd = fixedSlot(slotFds, request.fd);
+                    sqe->flags = IOSQE_FIXED_FILE;
+                } else {
+                    sqe->fd = request.fd;
+                }
+                sqe->addr = (unsigned long)(request.buffer + request.done);
+                sqe->len = request.length - request.done;
+                sqe->off = request.op == IoOp::SEND ? 0 : request.offset + request.done;
+                if (fixedBuffer) {
+                    sqe->buf_index = request.bufferIndex;
+                }
+                sqe->user_data = i;
+                sqArray[index] = index;
+                tail++;
+                toSubmit++;
+                inFlight++;
+            }
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+            int entered = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (entered < 0 && errno != EINTR) {
+                alertPrompt("io_uring_enter failed, falling back to blocking syscalls", true);
+                enterFailed = true;
+                break;
+            }
+            reapCompletions(requests, complete, queue, finished, inFlight);
+        }
+
+        if (enterFailed) {
+            // Withdraw the entries the kernel has not taken and wait for the ones it has, so no buffer
+            // of the batch is still in use by the kernel once the caller releases it; then drop the
+            // ring and finish the remaining requests with blocking syscalls
+            unsigned consumed = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            inFlight -= *sqTail - consumed;
+            __atomic_store_n(sqTail, consumed, __ATOMIC_RELEASE);
+            while (inFlight > 0) {
+                if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    break;
+                }
+                reapCompletions(requests, complete, queue, finished, inFlight);
+            }
+            teardownRing();
+            ringBroken = true;
+
+            ArrayList<IoRequest> rest;
+            ArrayList<int> restIndex;
+            for (int i = 0; i < requests.size(); ++i) {
+                if (!complete.get(i)) {
+                    rest.add(requests.get(i));
+                    restIndex.add(i);
+                }
+            }
+            runSyncBatch(rest);
+            for (int i = 0; i < rest.size(); ++i) {
+                requests.get(restIndex.get(i)) = rest.get(i);
+            }
+            return;
+        }
+
+        // Release the fixed file slots so closed descriptors are not kept alive by the ring
+        if (useFixedFiles) {
+            for (int j = 0; j < slotFds.size(); ++j) {
+                slotFds.get(j) = -1;
+            }
+            updateFileSlots(slotFds);
+        }
+    }
+
+    bool setupRing() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+        if (ringFd < 0) return false;
+
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+            sqSize = cqSize = max(sqSize, cqSize);
+        }
+        char* sqPtr = (char*)mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        char* cqPtr = singleMmap ? sqPtr
+                                 : (char*)mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqPtr == MAP_FAILED || cqPtr == MAP_FAILED || sqes == MAP_FAILED) {
+            close(ringFd);
+            return false;
+        }
+        sqRing = sqPtr;
+        cqRing = cqPtr;
+        sqRingSize = sqSize;
+        cqRingSize = cqSize;
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqHead = (unsigned*)(sqPtr + params.sq_off.head);
+        sqTail = (unsigned*)(sqPtr + params.sq_off.tail);
+        sqMask = (unsigned*)(sqPtr + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sqPtr + params.sq_off.array);
+        cqHead = (unsigned*)(cqPtr + params.cq_off.head);
+        cqTail = (unsigned*)(cqPtr + params.cq_off.tail);
+        cqMask = (unsigned*)(cqPtr + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cqPtr + params.cq_off.cqes);
+        ringEntries = params.sq_entries;
+
+        // Registered buffers avoid per-I/O page pinning; a sparse fixed file table
+        // avoids per-I/O file reference counting
+        fixedBuffers = new char[IO_FIXED_BUFFERS * IO_FIXED_BUFFER_SIZE];
+        struct iovec iovecs[IO_FIXED_BUFFERS];
+        for (int i = 0; i < IO_FIXED_BUFFERS; ++i) {
+            iovecs[i].iov_base = fixedBuffers + i * IO_FIXED_BUFFER_SIZE;
+            iovecs[i].iov_len = IO_FIXED_BUFFER_SIZE;
+        }
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovecs, IO_FIXED_BUFFERS) != 0) {
+            delete[] fixedBuffers;
+            fixedBuffers = NULL;
+        }
+        int fds[IO_BATCH_SIZE * 2];
+        for (int i = 0; i < IO_BATCH_SIZE * 2; ++i) {
+            fds[i] = -1;
+        }
+        fixedFiles = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, fds, IO_BATCH_SIZE * 2) == 0;
+        return true;
+    }
+#endif
+
+    void runSyncBatch(ArrayList<IoRequest>& requests) {
+        for (int i = 0; i < requests.size(); ++i) {
+            IoRequest& request = requests.get(i);
+            while (request.done < request.length) {
+                ssize_t n;
+                if (request.op == IoOp::READ) {
+                    n = pread(request.fd, request.buffer + request.done, request.length - request.done, request.offset + request.done);
+                } else if (request.op == IoOp::WRITE) {
+                    n = pwrite(request.fd, request.buffer + request.done, request.length - request.done, request.offset + request.done);
+                } else {
+                    n = send(request.fd, request.buffer + request.done, request.length - request.done, 0);
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    request.result = n < 0 ? -errno : request.done;
+                    break;
+                }
+                request.done += n;
+            }
+            if (request.done == request.length) {
+                request.result = request.done;
+            }
+        }
+    }
+
+public:
+    IoEngine() : ringReady(false), fixedBuffers(NULL) {
+        for (int i = 0; i < IO_FIXED_BUFFERS; ++i) {
+            fixedBufferUsed[i] = false;
+        }
+#ifdef USE_IO_URING
+        ringBroken = false;
+#endif
+    }
+
+    // Create the ring on first use; returns whether io_uring is in use
+    bool start() {
+#ifdef USE_IO_URING
+        if (!ringReady && !ringBroken) {
+            ringReady = setupRing();
+        }
+#endif
+        return ringReady;
+    }
+
+    // Hand out a registered buffer when one is free and large enough, else a heap buffer
+    char* acquireBuffer(size_t length, int& bufferIndex) {
+        bufferIndex = -1;
+        if (fixedBuffers != NULL && length <= IO_FIXED_BUFFER_SIZE) {
+            for (int i = 0; i < IO_FIXED_BUFFERS; ++i) {
+                if (!fixedBufferUsed[i]) {
+                    fixedBufferUsed[i] = true;
+                    bufferIndex = i;
+                    return fixedBuffers + i * IO_FIXED_BUFFER_SIZE;
+                }
+            }
+        }
+        return new char[length];
+    }
+
+    void releaseBuffer(char* buffer, int bufferIndex) {
+        if (bufferIndex >= 0) {
+            fixedBufferUsed[bufferIndex] = false;
+        } else {
+            delete[] buffer;
+        }
+    }
+
+    // Perform every request in the batch; check each request's result afterwards
+    void run(ArrayList<IoRequest>& requests, bool useRing) {
+#ifdef USE_IO_URING
+        if (useRing && start()) {
+            runRingBatch(requests);
+            return;
+        }
+#else
+        (void)useRing;
+#endif
+        runSyncBatch(requests);
+    }
 };
 
 // --- Global Variables ---
 volatile bool clientRunning = true;
 int clientListenPort = 0;
+string clientListenIp;
 
+string downloadGroupId;
 string downloadFileName;
 string downloadFilePath;
 long downloadFileSize;
 int totalChunks;
+long downloadChunkSize;
 string downloadFileSha1;
+string downloadMerkleRoot; // Set when the file has a Merkle manifest; chunks are then checked by proof
+ErasureLayout downloadErasure; // Parity layout of the current download
 ArrayList<ChunkInfo> chunkInfoList;
 map<int, string> chunkData; // Map from chunk index to data
+map<int, ChunkLocation> localChunkSources; // Chunks of the current download found in local files
+ArrayList<PeerInfo> downloadSwarmPeers;  // Other downloaders from download_info, asked for bitfields
+map<string, PeerBitfield> peerBitfields; // Peer userId -> reported chunks for the current download
+ArrayList<ControlExchange*> controlExchanges; // Control requests in flight for the current download
+SwarmFile swarmFile;
+map<string, ArrayList<PeerInfo>> knownSwarmPeers; // File SHA1 -> peers holding or fetching it, most recent first
+long downloadWatermark = 0; // Streaming downloads: bytes from the start of the file already written in place
 
 // Map to store files owned by the client
 map<string, OwnedFileInfo> ownedFilesInfo;
 
+// Content-addressed index of every chunk in owned and downloaded files: chunk SHA1 -> location
+map<string, ChunkLocation> localChunkIndex;
+
+// Bandwidth shaping: global buckets plus one bucket per peer for each direction
+TokenBucket uploadBucket;
+TokenBucket downloadBucket;
+TransferMeter uploadMeter;
+TransferMeter downloadMeter;
+long perPeerUploadRate = 0;   // Bytes per second, 0 = unlimited; both rates are guarded by shapingMutex
+long perPeerDownloadRate = 0;
+int shapedSenders = 0;        // Rate-limited sends in flight on their own threads, guarded by shapingMutex
+map<string, PeerShaper*> uploadPeers;   // Peer IP -> shaper (serving path)
+map<string, PeerShaper*> downloadPeers; // Peer IP -> shaper (fetching path)
+
+// Request compressed chunks from peers (only possible when built with zlib)
+#ifdef USE_ZLIB
+volatile bool compressionEnabled = true;
+#else
+volatile bool compressionEnabled = false;
+#endif
+
+// I/O backend for serving and writing chunks: io_uring when available, blocking syscalls otherwise
+#ifdef USE_IO_URING
+volatile bool ioUringEnabled = true;
+#else
+volatile bool ioUringEnabled = false;
+#endif
+IoEngine serveIo; // Used only by the peer server thread
+IoEngine writeIo; // Used only by the download assembly
+
+// Download deadlines in milliseconds; an expired transfer fails over to the next peer
+long connectTimeoutMs = DEFAULT_CONNECT_TIMEOUT_MS;
+long firstByteTimeoutMs = DEFAULT_FIRST_BYTE_TIMEOUT_MS;
+long stallTimeoutMs = DEFAULT_STALL_TIMEOUT_MS;
+map<string, PeerTimeouts> peerTimeouts; // Peer userId -> timeout counts
+
+// Upload slot scheduling of the peer server (0 slots = serve every downloader in arrival order)
+int uploadSlotCount = DEFAULT_UPLOAD_SLOTS;
+map<string, UploadSlot> uploadSlots; // Downloader IP -> choke state
+string optimisticPeer;               // Downloader holding the optimistic unchoke
+long long lastChokeRound = 0;
+int chokeRounds = 0;
+
+// Owned files being super-seeded: file name -> chunks sent so far
+map<string, SuperSeedState> superSeeds;
+
+// Health reporting: peer userId -> outcomes not yet reported to the tracker
+map<string, PeerHealth> peerHealth;
+long long lastHealthReport = 0;
+int lastReportedLoad = 0;
+
+// How a finished download is checked against the file SHA1: "stream" hashes chunks in file order
+// as they become contiguous during the download, "full" re-reads the output file afterwards
+string verifyMode = "stream";
+
+// Send upload_file chunk hashes as raw binary digests instead of hex text
+bool binaryManifest = true;
+
+// User logged in on this client; their registered shares are re-announced on login.
+// Written by the command loop under userMutex, which other threads take to read it.
+string currentUserId;
+
 // Mutex for thread safety
 pthread_mutex_t downloadMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ownedFilesMutex = PTHREAD_MUTEX_INITIALIZER; // Held by the peer server to read ownedFilesInfo and by commands to change it
+pthread_mutex_t shapingMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t chunkIndexMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t pexMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t slotMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t superSeedMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t healthMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t userMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t trackerMutex = PTHREAD_MUTEX_INITIALIZER; // One request/response on the tracker socket at a time
 
 // Tracker connection socket
 int trackerSocket = -1;
@@ -371,6 +1160,48 @@ string computeFileSHA1(const string& filename) {
     return ss.str();
 }
 
+// Incremental SHA1 for data that arrives piece by piece in file order
+class StreamingSha1 {
+private:
+    EVP_MD_CTX* mdctx;
+
+public:
+    StreamingSha1() {
+        mdctx = EVP_MD_CTX_new();
+        if (mdctx == NULL || EVP_DigestInit_ex(mdctx, EVP_sha1(), NULL) != 1) {
+            alertPrompt("EVP_DigestInit_ex failed", false);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~StreamingSha1() {
+        EVP_MD_CTX_free(mdctx);
+    }
+
+    void update(const char* data, size_t len) {
+        if (EVP_DigestUpdate(mdctx, data, len) != 1) {
+            alertPrompt("EVP_DigestUpdate failed", false);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    string finish() {
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLen;
+        if (EVP_DigestFinal_ex(mdctx, hash, &hashLen) != 1) {
+            alertPrompt("EVP_DigestFinal_ex failed", false);
+            exit(EXIT_FAILURE);
+        }
+
+        stringstream ss;
+        ss << hex << setw(2) << setfill('0');
+        for (unsigned int i = 0; i < hashLen; ++i) {
+            ss << setw(2) << (static_cast<unsigned int>(hash[i]) & 0xFF);
+        }
+        return ss.str();
+    }
+};
+
 // --- Utility Functions ---
 // Function to extract base filename
 string getBaseName(const string& filePath) {
@@ -392,342 +1223,4060 @@ bool sendAll(int socket, const char* buffer, size_t length) {
     return true;
 }
 
-// --- Peer Server Function ---
-// Function to handle incoming connections from peers requesting chunks
-void* peerServer(void* arg) {
-    int listenPort = *(int*)arg;
-    delete (int*)arg;
+// Function to read exactly `length` bytes unless EOF is reached first
+ssize_t readFully(int fd, char* buffer, size_t length) {
+    size_t totalRead = 0;
+    while (totalRead < length) {
+        ssize_t bytesRead = read(fd, buffer + totalRead, length - totalRead);
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytesRead == 0) break;
+        totalRead += bytesRead;
+    }
+    return totalRead;
+}
 
-    int serverSocket, clientSocket, c;
-    sockaddr_in serverAddr, clientAddr;
+// Receive one tracker response. Responses always end with a newline, and large
+// ones such as download_info span several recv calls.
+int recvTrackerResponse(string& response) {
     char buffer[BUFFER_SIZE];
+    response.clear();
+    while (response.empty() || response[response.length() - 1] != '\n') {
+        int readSize = recv(trackerSocket, buffer, BUFFER_SIZE, 0);
+        if (readSize <= 0) return readSize;
+        response.append(buffer, readSize);
+    }
+    return response.length();
+}
 
-    // Create socket
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == -1) {
-        alertPrompt("Could not create peer server socket", true);
-        pthread_exit(NULL);
+// Size-based chunk size policy: DEFAULT_CHUNK_SIZE for most files, halved (down to
+// MIN_CHUNK_SIZE) so small files still split for parallelism, and doubled (up to
+// MAX_CHUNK_SIZE) so huge files keep short chunk lists
+long chooseChunkSize(long fileSize) {
+    long chunkSize = DEFAULT_CHUNK_SIZE;
+    while (chunkSize > MIN_CHUNK_SIZE && chunkSize * MIN_CHUNK_COUNT > fileSize) {
+        chunkSize /= 2;
     }
+    while (chunkSize < MAX_CHUNK_SIZE && chunkSize * MAX_CHUNK_COUNT < fileSize) {
+        chunkSize *= 2;
+    }
+    return chunkSize;
+}
 
-    // Prepare sockaddr_in structure
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY; // Listen on all interfaces
-    serverAddr.sin_port = htons(listenPort);
+// Length of chunk `chunkIndex` in a file split into fixed-size chunks
+size_t chunkLength(long fileSize, long chunkSize, int chunkIndex) {
+    long offset = static_cast<long>(chunkIndex) * chunkSize;
+    return static_cast<size_t>(min(chunkSize, fileSize - offset));
+}
 
-    // Bind
-    if (::bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        alertPrompt("Peer server bind failed", true);
-        close(serverSocket);
-        pthread_exit(NULL);
+// --- Merkle Tree Functions ---
+// Leaves are the raw chunk SHA1s. A parent is SHA1(left || right); an odd node at the end of a
+// level is carried up unchanged. layers[0] holds the leaves and the last layer the root, each
+// layer stored as its 20-byte digests concatenated.
+string hexToBytes(const string& hex) {
+    string bytes(hex.length() / 2, '\0');
+    for (size_t i = 0; i < bytes.length(); ++i) {
+        bytes[i] = static_cast<char>(strtol(hex.substr(2 * i, 2).c_str(), NULL, 16));
     }
+    return bytes;
+}
 
-    // Listen
-    if (listen(serverSocket, 10) < 0) {
-        alertPrompt("Peer server listen failed", true);
-        close(serverSocket);
-        pthread_exit(NULL);
+string bytesToHex(const string& bytes) {
+    stringstream ss;
+    ss << hex << setfill('0');
+    for (size_t i = 0; i < bytes.length(); ++i) {
+        ss << setw(2) << (static_cast<unsigned int>(bytes[i]) & 0xFF);
     }
+    return ss.str();
+}
 
-    cout << "Peer server listening on port " << listenPort << endl;
+string hashPair(const string& left, const string& right) {
+    string joined = left + right;
+    return hexToBytes(computeSHA1(joined.data(), joined.length()));
+}
 
-    c = sizeof(sockaddr_in);
+void buildMerkleLayers(const ArrayList<string>& chunkSha1s, ArrayList<string>& layers) {
+    layers.clear();
+    string level;
+    for (int i = 0; i < chunkSha1s.size(); ++i) {
+        level += hexToBytes(chunkSha1s.get(i));
+    }
+    if (level.empty()) {
+        level = hexToBytes(computeSHA1("", 0)); // Root of an empty file
+    }
+    layers.add(level);
+    while (level.length() > DIGEST_SIZE) {
+        string parent;
+        for (size_t pos = 0; pos < level.length(); pos += 2 * DIGEST_SIZE) {
+            if (pos + DIGEST_SIZE < level.length()) {
+                parent += hashPair(level.substr(pos, DIGEST_SIZE), level.substr(pos + DIGEST_SIZE, DIGEST_SIZE));
+            } else {
+                parent += level.substr(pos, DIGEST_SIZE);
+            }
+        }
+        layers.add(parent);
+        level = parent;
+    }
+}
 
-    // Accept incoming connections
-    while (clientRunning && (clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, (socklen_t*)&c)) >= 0) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int readSize = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-        if (readSize > 0) {
-            buffer[readSize] = '\0';
-            string request(buffer);
-            // Parse request
-            istringstream iss(request);
-            string command, fileName;
-            int chunkIndex;
-            iss >> command >> fileName >> chunkIndex;
-
-            if (command == "get_chunk") {
-                // Check if the client has the requested file
-                if (ownedFilesInfo.find(fileName) == ownedFilesInfo.end()) {
-                    string errorMsg = "Error: File not found.\n";
-                    sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
-                    close(clientSocket);
-                    continue;
-                }
+string merkleRoot(const ArrayList<string>& layers) {
+    return bytesToHex(layers.get(layers.size() - 1));
+}
 
-                OwnedFileInfo fileInfo = ownedFilesInfo.at(fileName);
+// Sibling digests from leaf `index` up to the root, as one hex string
+string merkleProof(const ArrayList<string>& layers, int index) {
+    string proof;
+    for (int level = 0; level < layers.size() - 1; ++level) {
+        size_t sibling = static_cast<size_t>(index ^ 1) * DIGEST_SIZE;
+        if (sibling < layers.get(level).length()) {
+            proof += layers.get(level).substr(sibling, DIGEST_SIZE);
+        }
+        index >>= 1;
+    }
+    return bytesToHex(proof);
+}
 
-                // Get file size using stat
-                struct stat st;
-                if (stat(fileInfo.filePath.c_str(), &st) != 0) {
-                    alertPrompt("Failed to get file size: " + fileInfo.filePath, true);
-                    string errorMsg = "Error: Cannot get file size.\n";
-                    sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
-                    close(clientSocket);
-                    continue;
-                }
-                off_t fileSize = st.st_size;
+// Recompute the root from a chunk SHA1 and its proof; returns "" if the proof has the wrong shape
+string merkleRootFromProof(const string& chunkSha1, int index, int leafCount, const string& proofHex) {
+    string node = hexToBytes(chunkSha1);
+    string proof = hexToBytes(proofHex);
+    size_t used = 0;
+    for (int levelSize = leafCount; levelSize > 1; levelSize = (levelSize + 1) / 2) {
+        if ((index ^ 1) < levelSize) {
+            if (used + DIGEST_SIZE > proof.length()) return "";
+            string sibling = proof.substr(used, DIGEST_SIZE);
+            used += DIGEST_SIZE;
+            node = (index & 1) ? hashPair(sibling, node) : hashPair(node, sibling);
+        }
+        index >>= 1;
+    }
+    return used == proof.length() ? bytesToHex(node) : "";
+}
 
-                // Calculate offset and expected chunk size
-                off_t offset = static_cast<off_t>(chunkIndex) * CHUNK_SIZE;
-                size_t expectedChunkSize = CHUNK_SIZE;
-                if (chunkIndex == fileInfo.totalChunks - 1) {
-                    expectedChunkSize = fileSize - (fileInfo.totalChunks - 1) * CHUNK_SIZE;
-                }
+// --- Erasure Coding (Reed-Solomon over GF(2^8)) ---
+// Systematic code: each stripe of k data chunks gets m parity chunks. Parity row i uses the
+// Cauchy coefficients 1 / (x_i ^ y_j) with x_i = k + i and y_j = j, so any k of the k + m
+// chunks of a stripe determine it. Chunks are zero-padded to the chunk size for coding.
+unsigned char gfExp[512];
+unsigned char gfLog[256];
+unsigned char gfMulTable[256][256];
+bool erasureSimd = false; // Use the SSSE3 kernel; set when the CPU supports it
+
+void initErasureCoding() {
+    int x = 1;
+    for (int i = 0; i < 255; ++i) {
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; ++i) {
+        gfExp[i] = gfExp[i - 255];
+    }
+    for (int a = 0; a < 256; ++a) {
+        for (int b = 0; b < 256; ++b) {
+            gfMulTable[a][b] = (a && b) ? gfExp[gfLog[a] + gfLog[b]] : 0;
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    erasureSimd = __builtin_cpu_supports("ssse3");
+#endif
+}
 
-                if (offset >= fileSize) {
-                    string errorMsg = "Error: Invalid chunk index.\n";
-                    sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
-                    close(clientSocket);
-                    continue;
-                }
+unsigned char gfInverse(unsigned char a) {
+    return gfExp[255 - gfLog[a]];
+}
 
-                // Open the file
-                int fd = open(fileInfo.filePath.c_str(), O_RDONLY);
-                if (fd < 0) {
-                    alertPrompt("Failed to open file for chunk transfer: " + fileInfo.filePath, true);
-                    string errorMsg = "Error: Cannot open file.\n";
-                    sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
-                    close(clientSocket);
-                    continue;
-                }
+// Coefficient of data chunk `column` in parity chunk `row` of a stripe with k data chunks
+unsigned char cauchyCoefficient(int k, int row, int column) {
+    return gfInverse((k + row) ^ column);
+}
 
-                // Seek to the chunk's position
-                if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
-                    alertPrompt("Failed to seek to chunk position", true);
-                    string errorMsg = "Error: Cannot seek to chunk.\n";
-                    sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
-                    close(fd);
-                    close(clientSocket);
-                    continue;
-                }
+// dst ^= c * src, one multiplication table row lookup per byte
+void gfMulAddScalar(unsigned char c, const unsigned char* src, unsigned char* dst, size_t len) {
+    const unsigned char* row = gfMulTable[c];
+    for (size_t i = 0; i < len; ++i) {
+        dst[i] ^= row[src[i]];
+    }
+}
 
-                // Read the chunk in a loop to ensure all data is read
-                char* chunkBuffer = new char[expectedChunkSize];
-                size_t totalBytesRead = 0;
-                bool readError = false;
-                while (totalBytesRead < expectedChunkSize) {
-                    ssize_t bytesRead = read(fd, chunkBuffer + totalBytesRead, expectedChunkSize - totalBytesRead);
-                    if (bytesRead < 0) {
-                        alertPrompt("Failed to read chunk from file", true);
-                        string errorMsg = "Error: Cannot read chunk.\n";
-                        sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
-                        readError = true;
-                        break;
-                    } else if (bytesRead == 0) {
-                        // End of file reached unexpectedly
-                        break;
-                    }
-                    totalBytesRead += bytesRead;
-                }
+#if defined(__x86_64__) || defined(__i386__)
+// dst ^= c * src, 16 bytes at a time: c * b = c * (b & 0x0f) ^ c * (b & 0xf0), and pshufb looks
+// up both products in 16-entry tables
+__attribute__((target("ssse3")))
+void gfMulAddSsse3(unsigned char c, const unsigned char* src, unsigned char* dst, size_t len) {
+    unsigned char lowProducts[16], highProducts[16];
+    for (int n = 0; n < 16; ++n) {
+        lowProducts[n] = gfMulTable[c][n];
+        highProducts[n] = gfMulTable[c][n << 4];
+    }
+    __m128i lowTable = _mm_loadu_si128((const __m128i*)lowProducts);
+    __m128i highTable = _mm_loadu_si128((const __m128i*)highProducts);
+    __m128i nibbleMask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i low = _mm_shuffle_epi8(lowTable, _mm_and_si128(in, nibbleMask));
+        __m128i high = _mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(in, 4), nibbleMask));
+        __m128i out = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(out, _mm_xor_si128(low, high)));
+    }
+    gfMulAddScalar(c, src + i, dst + i, len - i);
+}
+#endif
+
+void gfMulAdd(unsigned char c, const unsigned char* src, unsigned char* dst, size_t len) {
+    if (c == 0) return;
+#if defined(__x86_64__) || defined(__i386__)
+    if (erasureSimd) {
+        gfMulAddSsse3(c, src, dst, len);
+        return;
+    }
+#endif
+    gfMulAddScalar(c, src, dst, len);
+}
 
-                if (!readError) {
-                    // Debugging statements
-                    cout << "Peer Server: Serving chunk " << chunkIndex << " of file " << fileName << endl;
-                    cout << "Chunk offset: " << offset << ", Expected chunk size: " << expectedChunkSize << endl;
-                    cout << "Bytes read from file: " << totalBytesRead << endl;
+// Compute the m parity chunks of a stripe from its k zero-padded data chunks
+void encodeStripe(int k, int m, const unsigned char* const* data, unsigned char* const* parity, size_t len) {
+    for (int row = 0; row < m; ++row) {
+        memset(parity[row], 0, len);
+        for (int column = 0; column < k; ++column) {
+            gfMulAdd(cauchyCoefficient(k, row, column), data[column], parity[row], len);
+        }
+    }
+}
 
-                    // Send the chunk data
-                    if (!sendAll(clientSocket, chunkBuffer, totalBytesRead)) {
-                        alertPrompt("Failed to send chunk data to peer.", false);
-                    }
+// Rebuild data chunks from any k chunks of a stripe. present[i] is the stripe position of shards[i]
+// (below k for data, k + row for parity); missing lists the data positions to write into out.
+bool decodeStripe(int k, const int* present, const unsigned char* const* shards, const int* missing, int missingCount,
+                  unsigned char* const* out, size_t len) {
+    // Rows of the generator matrix for the chunks we have, inverted by Gauss-Jordan elimination
+    string matrix(k * k, '\0');
+    string inverse(k * k, '\0');
+    for (int r = 0; r < k; ++r) {
+        for (int c = 0; c < k; ++c) {
+            matrix[r * k + c] = present[r] < k ? (present[r] == c) : cauchyCoefficient(k, present[r] - k, c);
+        }
+        inverse[r * k + r] = 1;
+    }
+    for (int c = 0; c < k; ++c) {
+        int pivot = c;
+        while (pivot < k && matrix[pivot * k + c] == 0) pivot++;
+        if (pivot == k) return false;
+        for (int j = 0; j < k; ++j) {
+            swap(matrix[c * k + j], matrix[pivot * k + j]);
+            swap(inverse[c * k + j], inverse[pivot * k + j]);
+        }
+        unsigned char scale = gfInverse(matrix[c * k + c]);
+        for (int j = 0; j < k; ++j) {
+            matrix[c * k + j] = gfMulTable[scale][(unsigned char)matrix[c * k + j]];
+            inverse[c * k + j] = gfMulTable[scale][(unsigned char)inverse[c * k + j]];
+        }
+        for (int r = 0; r < k; ++r) {
+            unsigned char factor = matrix[r * k + c];
+            if (r == c || factor == 0) continue;
+            for (int j = 0; j < k; ++j) {
+                matrix[r * k + j] ^= gfMulTable[factor][(unsigned char)matrix[c * k + j]];
+                inverse[r * k + j] ^= gfMulTable[factor][(unsigned char)inverse[c * k + j]];
+            }
+        }
+    }
+    for (int i = 0; i < missingCount; ++i) {
+        memset(out[i], 0, len);
+        for (int j = 0; j < k; ++j) {
+            gfMulAdd(inverse[missing[i] * k + j], shards[j], out[i], len);
+        }
+    }
+    return true;
+}
 
-                    cout << "Served chunk " << chunkIndex << " of file " << fileName << " to peer." << endl;
-                }
+// Time encoding and decoding one stripe of 1 MB shards with the scalar and, when available,
+// the SSSE3 kernel. Decoding rebuilds min(k, m) lost data chunks from parity.
+void benchErasure(int k, int m) {
+    const size_t shardSize = 1024 * 1024;
+    string data(k * shardSize, '\0');
+    string parity(m * shardSize, '\0');
+    string rebuilt(k * shardSize, '\0');
+    for (size_t i = 0; i < data.length(); ++i) {
+        data[i] = rand() & 0xff;
+    }
+    const unsigned char* dataPtrs[255];
+    unsigned char* parityPtrs[255];
+    unsigned char* rebuiltPtrs[255];
+    for (int j = 0; j < k; ++j) {
+        dataPtrs[j] = (const unsigned char*)&data[j * shardSize];
+        rebuiltPtrs[j] = (unsigned char*)&rebuilt[j * shardSize];
+    }
+    for (int r = 0; r < m; ++r) {
+        parityPtrs[r] = (unsigned char*)&parity[r * shardSize];
+    }
+
+    // Lose the first min(k, m) data chunks and decode from the remaining data plus parity
+    int lost = min(k, m);
+    int present[255], missing[255];
+    const unsigned char* presentPtrs[255];
+    for (int i = 0; i < lost; ++i) missing[i] = i;
+    for (int i = 0; i < k; ++i) {
+        present[i] = i + lost < k ? i + lost : k + (i + lost - k);
+        presentPtrs[i] = present[i] < k ? dataPtrs[present[i]] : parityPtrs[present[i] - k];
+    }
+
+    bool simdAvailable = erasureSimd;
+    for (int pass = simdAvailable ? 0 : 1; pass < 2; ++pass) {
+        erasureSimd = pass == 0;
+        int rounds = 0;
+        long long start = nowMicros();
+        while (nowMicros() - start < 200000) {
+            encodeStripe(k, m, dataPtrs, parityPtrs, shardSize);
+            rounds++;
+        }
+        double encodeRate = (double)rounds * k * shardSize * 1e6 / (nowMicros() - start);
+        rounds = 0;
+        start = nowMicros();
+        while (nowMicros() - start < 200000) {
+            decodeStripe(k, present, presentPtrs, missing, lost, rebuiltPtrs, shardSize);
+            rounds++;
+        }
+        double decodeRate = (double)rounds * k * shardSize * 1e6 / (nowMicros() - start);
+        bool correct = memcmp(rebuilt.data(), data.data(), lost * shardSize) == 0;
+        cout << "rs " << k << "+" << m << " " << (pass == 0 ? "ssse3 " : "scalar") << ": encode " << formatRate(encodeRate)
+             << ", decode " << lost << " lost chunks " << formatRate(decodeRate) << (correct ? "" : " (MISMATCH)") << endl;
+    }
+    erasureSimd = simdAvailable;
+}
+
+// Index of the first parity chunk of a share; totalChunks when it is not erasure-coded
+int firstParityChunk(const OwnedFileInfo& info) {
+    return info.dataShards > 0 ? (info.fileSize + info.chunkSize - 1) / info.chunkSize : info.totalChunks;
+}
+
+// Encode every stripe of a file into filePath + PARITY_SUFFIX and append the parity chunks'
+// hashes and sidecar offsets after the data chunks
+bool writeParityFile(const string& filePath, long chunkSize, int k, int m, ArrayList<string>& chunkSha1s,
+                     ArrayList<long>& chunkOffsets, ArrayList<long>& chunkLengths) {
+    string parityPath = filePath + PARITY_SUFFIX;
+    int inFd = open(filePath.c_str(), O_RDONLY);
+    int outFd = open(parityPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (inFd < 0 || outFd < 0) {
+        alertPrompt("Failed to open " + (inFd < 0 ? filePath : parityPath) + " for erasure coding", true);
+        if (inFd >= 0) close(inFd);
+        if (outFd >= 0) close(outFd);
+        return false;
+    }
+
+    int dataChunks = chunkSha1s.size();
+    string data(k * chunkSize, '\0');
+    string parity(m * chunkSize, '\0');
+    unsigned char* dataShards[255];
+    unsigned char* parityShards[255];
+    for (int j = 0; j < k; ++j) dataShards[j] = (unsigned char*)&data[j * chunkSize];
+    for (int r = 0; r < m; ++r) parityShards[r] = (unsigned char*)&parity[r * chunkSize];
+
+    bool ok = true;
+    long parityOffset = 0;
+    for (int first = 0; first < dataChunks && ok; first += k) {
+        memset(&data[0], 0, data.length());
+        for (int j = 0; j < k && first + j < dataChunks; ++j) {
+            long length = chunkLengths.get(first + j);
+            ok = ok && pread(inFd, dataShards[j], length, chunkOffsets.get(first + j)) == length;
+        }
+        encodeStripe(k, m, dataShards, parityShards, chunkSize);
+        for (int r = 0; r < m && ok; ++r) {
+            ok = pwrite(outFd, parityShards[r], chunkSize, parityOffset) == chunkSize;
+            chunkSha1s.add(computeSHA1((const char*)parityShards[r], chunkSize));
+            chunkOffsets.add(parityOffset);
+            chunkLengths.add(chunkSize);
+            parityOffset += chunkSize;
+        }
+    }
+    close(inFd);
+    close(outFd);
+    if (!ok) {
+        alertPrompt("Failed to write parity chunks to " + parityPath, true);
+        unlink(parityPath.c_str());
+    }
+    return ok;
+}
+
+// Binary manifest: 20 raw bytes per chunk SHA1, plus a 4-byte big-endian length for cdc
+string packChunkDigests(const ArrayList<string>& chunkSha1s, long chunkSize, const ArrayList<long>& chunkLengths) {
+    string payload;
+    payload.reserve(chunkSha1s.size() * (DIGEST_SIZE + 4));
+    for (int i = 0; i < chunkSha1s.size(); ++i) {
+        payload += hexToBytes(chunkSha1s.get(i));
+        if (chunkSize == 0) {
+            uint32_t length = chunkLengths.get(i);
+            char lengthBytes[4] = {(char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length};
+            payload.append(lengthBytes, 4);
+        }
+    }
+    return payload;
+}
+
+// --- Content-Defined Chunking (FastCDC) ---
+uint64_t gearTable[256];
+
+// Fill the gear table from a fixed seed so every client cuts identical content identically
+void initGearTable() {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 256; ++i) {
+        // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gearTable[i] = z ^ (z >> 31);
+    }
+}
+
+// Mask over the top `bits` bits of the gear hash; the high bits mix the whole window
+uint64_t cdcMask(int bits) {
+    return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+// Length of the next content-defined chunk at the start of `data`. Uses normalized
+// chunking: a stricter mask before `avgSize` and a looser one after it.
+size_t cdcNextCut(const unsigned char* data, size_t length, size_t minSize, size_t avgSize, size_t maxSize) {
+    if (length <= minSize) return length;
+    int bits = 0;
+    while ((1UL << (bits + 1)) <= avgSize) bits++;
+    uint64_t maskS = cdcMask(bits + 1);
+    uint64_t maskL = cdcMask(bits - 1);
+
+    size_t end = min(length, maxSize);
+    size_t normal = min(end, avgSize);
+    uint64_t fingerprint = 0;
+    size_t i = minSize;
+    for (; i < normal; ++i) {
+        fingerprint = (fingerprint << 1) + gearTable[data[i]];
+        if (!(fingerprint & maskS)) return i + 1;
+    }
+    for (; i < end; ++i) {
+        fingerprint = (fingerprint << 1) + gearTable[data[i]];
+        if (!(fingerprint & maskL)) return i + 1;
+    }
+    return end;
+}
+
+// Offsets and lengths of a file split into fixed-size chunks
+void fixedChunkLayout(long fileSize, long chunkSize, ArrayList<long>& offsets, ArrayList<long>& lengths) {
+    for (long offset = 0; offset < fileSize; offset += chunkSize) {
+        offsets.add(offset);
+        lengths.add(min(chunkSize, fileSize - offset));
+    }
+}
+
+// Split a file into fixed-size chunks (chunkSize > 0) or content-defined chunks averaging
+// `avgSize` (chunkSize == 0), computing the SHA1 and extent of each chunk
+bool hashFileChunks(const string& filePath, long chunkSize, long avgSize,
+                    ArrayList<string>& chunkSha1s, ArrayList<long>& offsets, ArrayList<long>& lengths) {
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        alertPrompt("Failed to open file for reading: " + filePath, true);
+        return false;
+    }
 
-                delete[] chunkBuffer;
+    size_t minSize = chunkSize > 0 ? chunkSize : avgSize / 4;
+    size_t maxSize = chunkSize > 0 ? chunkSize : avgSize * 4;
+    size_t bufferSize = chunkSize > 0 ? chunkSize : 2 * maxSize;
+    char* buffer = new char[bufferSize];
+    size_t start = 0, end = 0;
+    long offset = 0;
+    bool eof = false;
+    while (true) {
+        // Keep at least one maximum-size chunk buffered until EOF
+        if (!eof && end - start < maxSize) {
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            ssize_t bytesRead = readFully(fd, buffer + end, bufferSize - end);
+            if (bytesRead < 0) {
+                alertPrompt("Failed to read file: " + filePath, true);
+                delete[] buffer;
                 close(fd);
-            } else {
-                string errorMsg = "Error: Invalid command.\n";
-                sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+                return false;
             }
+            eof = (size_t)bytesRead < bufferSize - end;
+            end += bytesRead;
+        }
+        if (start == end) break;
+
+        size_t cut = chunkSize > 0 ? min((size_t)chunkSize, end - start)
+                                   : cdcNextCut((const unsigned char*)buffer + start, end - start, minSize, avgSize, maxSize);
+        chunkSha1s.add(computeSHA1(buffer + start, cut));
+        offsets.add(offset);
+        lengths.add(cut);
+        offset += cut;
+        start += cut;
+    }
 
-            close(clientSocket);
+    delete[] buffer;
+    close(fd);
+    return true;
+}
+
+// --- Directory Share Functions ---
+// A directory is shared as one file: a header "P2PDIR <file_count> <list_bytes>\n" followed by a
+// list of "<size> <relative_path>\n" lines, then the contents of every regular file in path order.
+// Chunks are cut across this packed space, so small files share chunks instead of each costing
+// a tracker entry and a download of its own.
+void listDirectoryFiles(const string& root, const string& relative, ArrayList<string>& relativePaths) {
+    string dirPath = relative.empty() ? root : root + "/" + relative;
+    DIR* dir = opendir(dirPath.c_str());
+    if (dir == NULL) {
+        alertPrompt("Failed to open directory: " + dirPath, true);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        string childRelative = relative.empty() ? name : relative + "/" + name;
+        struct stat st;
+        if (lstat((root + "/" + childRelative).c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            listDirectoryFiles(root, childRelative, relativePaths);
+        } else if (S_ISREG(st.st_mode) && name.find('\n') == string::npos) {
+            relativePaths.add(childRelative);
         }
     }
+    closedir(dir);
+}
 
-    close(serverSocket);
-    pthread_exit(NULL);
+// Lay out the packed chunk space of a directory: its header and the offset of every file
+bool buildPackedDirectory(const string& dirPath, OwnedFileInfo& info) {
+    ArrayList<string> relativePaths;
+    listDirectoryFiles(dirPath, "", relativePaths);
+    if (!relativePaths.isEmpty()) {
+        std::sort(&relativePaths.get(0), &relativePaths.get(0) + relativePaths.size());
+    }
+
+    string fileList;
+    info.members.clear();
+    for (int i = 0; i < relativePaths.size(); ++i) {
+        struct stat st;
+        if (stat((dirPath + "/" + relativePaths.get(i)).c_str(), &st) != 0) {
+            alertPrompt("Failed to stat " + relativePaths.get(i), true);
+            return false;
+        }
+        PackedMember member;
+        member.path = relativePaths.get(i);
+        member.size = st.st_size;
+        info.members.add(member);
+        fileList += to_string(member.size) + " " + member.path + "\n";
+    }
+    info.packedHeader = "P2PDIR " + to_string(info.members.size()) + " " + to_string(fileList.length()) + "\n" + fileList;
+
+    long offset = info.packedHeader.length();
+    for (int i = 0; i < info.members.size(); ++i) {
+        info.members.get(i).offset = offset;
+        offset += info.members.get(i).size;
+    }
+    info.filePath = dirPath;
+    info.fileSize = offset;
+    return true;
 }
 
-// --- Download Chunk Function ---
-void* downloadChunk(void* arg) {
-    int listIndex = *(int*)arg;
-    delete (int*)arg;
+// Read `length` bytes at `offset` of a directory's packed space; returns the bytes read or -1
+ssize_t readPacked(const OwnedFileInfo& info, char* out, size_t length, off_t offset) {
+    size_t done = 0;
+    if ((size_t)offset < info.packedHeader.length()) {
+        done = min(length, info.packedHeader.length() - offset);
+        memcpy(out, info.packedHeader.data() + offset, done);
+    }
+    // First member that ends after the current position
+    int lo = 0, hi = info.members.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const PackedMember& member = info.members.get(mid);
+        if (member.offset + member.size <= offset + (off_t)done) lo = mid + 1; else hi = mid;
+    }
+    for (int i = lo; i < info.members.size() && done < length; ++i) {
+        const PackedMember& member = info.members.get(i);
+        off_t position = offset + done;
+        size_t piece = min((long)(length - done), member.offset + member.size - position);
+        if (piece == 0) continue;
+        int fd = open((info.filePath + "/" + member.path).c_str(), O_RDONLY);
+        if (fd < 0) return -1;
+        ssize_t bytesRead = pread(fd, out + done, piece, position - member.offset);
+        close(fd);
+        if (bytesRead != (ssize_t)piece) return -1;
+        done += piece;
+    }
+    return done;
+}
 
-    // Get the chunk info
-    pthread_mutex_lock(&downloadMutex);
-    if (listIndex >= chunkInfoList.size()) {
-        alertPrompt("List index out of range: " + to_string(listIndex), false);
-        pthread_mutex_unlock(&downloadMutex);
-        pthread_exit(NULL);
+// Hash a directory's packed space in fixed-size chunks, along with the SHA1 of the whole space
+bool hashPackedChunks(const OwnedFileInfo& info, long chunkSize, ArrayList<string>& chunkSha1s,
+                      ArrayList<long>& offsets, ArrayList<long>& lengths, string& fileSha1) {
+    StreamingSha1 fileHash;
+    char* buffer = new char[chunkSize];
+    for (long offset = 0; offset < info.fileSize; offset += chunkSize) {
+        size_t length = min(chunkSize, info.fileSize - offset);
+        if (readPacked(info, buffer, length, offset) != (ssize_t)length) {
+            alertPrompt("Failed to read directory contents at offset " + to_string(offset), true);
+            delete[] buffer;
+            return false;
+        }
+        chunkSha1s.add(computeSHA1(buffer, length));
+        offsets.add(offset);
+        lengths.add(length);
+        fileHash.update(buffer, length);
     }
-    ChunkInfo chunkInfo = chunkInfoList.get(listIndex);
-    pthread_mutex_unlock(&downloadMutex);
+    delete[] buffer;
+    fileSha1 = fileHash.finish();
+    return true;
+}
 
-    int chunkIndex = chunkInfo.chunkIndex;
+// Create every missing directory on the way to `path`
+bool makeParentDirectories(const string& path) {
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1)) {
+        if (mkdir(path.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // Calculate expected chunk size
-    size_t expectedChunkSize = CHUNK_SIZE;
-    if (chunkIndex == totalChunks - 1) {
-        expectedChunkSize = downloadFileSize - (totalChunks - 1) * CHUNK_SIZE;
+// Read exactly `length` bytes at `offset` of a downloaded packed space
+bool readDownloadedPacked(int packedFd, long offset, size_t length, char* out) {
+    while (length > 0) {
+        ssize_t bytesRead = pread(packedFd, out, length, offset);
+        if (bytesRead < 0 && errno == EINTR) continue;
+        if (bytesRead <= 0) return false;
+        out += bytesRead;
+        offset += bytesRead;
+        length -= bytesRead;
     }
+    return true;
+}
 
-    // Try to download from the peers who have this chunk
-    bool success = false;
-    for (int i = 0; i < chunkInfo.peersWithChunk.size(); ++i) {
-        PeerInfo peer = chunkInfo.peersWithChunk.get(i);
+// Recreate the files of a downloaded directory share under `root` from its packed space in
+// packedFd, copying at most chunkSize bytes at a time
+bool unpackDirectory(const string& root, int packedFd, long chunkSize, long packedSize, int& fileCount) {
+    string firstLine(min(packedSize, 256L), '\0');
+    if (chunkSize <= 0 || !readDownloadedPacked(packedFd, 0, firstLine.length(), &firstLine[0])) {
+        alertPrompt("Not a directory share: " + root, false);
+        return false;
+    }
+    istringstream headerStream(firstLine.substr(0, firstLine.find('\n')));
+    string magic;
+    long listBytes = -1;
+    fileCount = -1;
+    headerStream >> magic >> fileCount >> listBytes;
+    long listStart = firstLine.find('\n') + 1;
+    if (magic != "P2PDIR" || fileCount < 0 || listBytes < 0 || listStart + listBytes > packedSize) {
+        alertPrompt("Not a directory share: " + root, false);
+        return false;
+    }
+    string fileList(listBytes, '\0');
+    if (!readDownloadedPacked(packedFd, listStart, listBytes, &fileList[0])) {
+        alertPrompt("Failed to read the file list of directory share: " + root, true);
+        return false;
+    }
 
-        // Create socket
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            alertPrompt("Could not create socket to peer", true);
-            continue;
+    // Lay out the members and refuse paths that would escape the destination
+    ArrayList<PackedMember> members;
+    istringstream listStream(fileList);
+    long offset = listStart + listBytes;
+    string line;
+    while (getline(listStream, line)) {
+        size_t space = line.find(' ');
+        PackedMember member;
+        member.size = space == string::npos ? -1 : myAtol(line.substr(0, space));
+        member.path = space == string::npos ? "" : line.substr(space + 1);
+        member.offset = offset;
+        string wrapped = "/" + member.path + "/";
+        if (member.size < 0 || member.path.empty() || member.path[0] == '/' || wrapped.find("/../") != string::npos) {
+            alertPrompt("Invalid path in directory share: " + member.path, false);
+            return false;
         }
+        offset += member.size;
+        members.add(member);
+    }
+    if (members.size() != fileCount || offset != packedSize) {
+        alertPrompt("Directory share file list does not match its size.", false);
+        return false;
+    }
 
-        sockaddr_in peerAddr;
-        peerAddr.sin_family = AF_INET;
-        peerAddr.sin_port = htons(peer.port);
-        if (inet_pton(AF_INET, peer.ip.c_str(), &peerAddr.sin_addr) <= 0) {
-            alertPrompt("Invalid peer IP address: " + peer.ip, false);
-            close(sock);
-            continue;
+    mkdir(root.c_str(), 0755);
+    char* buffer = new char[chunkSize];
+    for (int i = 0; i < members.size(); ++i) {
+        const PackedMember& member = members.get(i);
+        string path = root + "/" + member.path;
+        int fd = makeParentDirectories(path) ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+        if (fd < 0) {
+            alertPrompt("Could not create output file: " + path, true);
+            delete[] buffer;
+            return false;
         }
+        for (long done = 0; done < member.size;) {
+            size_t piece = min(chunkSize, member.size - done);
+            if (!readDownloadedPacked(packedFd, member.offset + done, piece, buffer) ||
+                pwrite(fd, buffer, piece, done) != (ssize_t)piece) {
+                alertPrompt("Failed to write to output file: " + path, true);
+                close(fd);
+                delete[] buffer;
+                return false;
+            }
+            done += piece;
+        }
+        close(fd);
+    }
+    delete[] buffer;
+    return true;
+}
 
-        // Connect to peer
-        if (connect(sock, (sockaddr*)&peerAddr, sizeof(peerAddr)) < 0) {
-            alertPrompt("Could not connect to peer " + peer.userId, true);
-            close(sock);
-            continue;
+// --- Local Chunk Store Functions ---
+// Add every chunk of a local file to the content-addressed index; chunks from parityFrom on
+// live in the file's parity sidecar
+void indexFileChunks(const string& filePath, const ArrayList<string>& chunkSha1s,
+                     const ArrayList<long>& offsets, const ArrayList<long>& lengths, int parityFrom = -1) {
+    pthread_mutex_lock(&chunkIndexMutex);
+    for (int i = 0; i < chunkSha1s.size(); ++i) {
+        ChunkLocation location;
+        location.filePath = parityFrom >= 0 && i >= parityFrom ? filePath + PARITY_SUFFIX : filePath;
+        location.offset = offsets.get(i);
+        location.length = lengths.get(i);
+        localChunkIndex[chunkSha1s.get(i)] = location;
+    }
+    pthread_mutex_unlock(&chunkIndexMutex);
+}
+
+bool lookupLocalChunk(const string& sha1, ChunkLocation& location) {
+    pthread_mutex_lock(&chunkIndexMutex);
+    auto it = localChunkIndex.find(sha1);
+    bool found = it != localChunkIndex.end();
+    if (found) {
+        location = it->second;
+    }
+    pthread_mutex_unlock(&chunkIndexMutex);
+    return found;
+}
+
+void forgetLocalChunk(const string& sha1) {
+    pthread_mutex_lock(&chunkIndexMutex);
+    localChunkIndex.erase(sha1);
+    pthread_mutex_unlock(&chunkIndexMutex);
+}
+
+// Read a chunk from its indexed location and check it still has the expected hash
+bool readLocalChunk(const ChunkLocation& location, const string& expectedSha1, string& data) {
+    int fd = open(location.filePath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    data.resize(location.length);
+    ssize_t bytesRead = location.length == 0 ? 0 : pread(fd, &data[0], location.length, location.offset);
+    close(fd);
+    return bytesRead == (ssize_t)location.length && computeSHA1(data.data(), data.length()) == expectedSha1;
+}
+
+// Place `length` bytes from a local file into the output file, sharing the extents with
+// a reflink when the filesystem supports it. Returns 1 if cloned, 0 if copied, -1 on error.
+int cloneOrCopyRange(const ChunkLocation& source, int destFd, off_t destOffset) {
+    int srcFd = open(source.filePath.c_str(), O_RDONLY);
+    if (srcFd < 0) return -1;
+
+#ifdef FICLONERANGE
+    struct file_clone_range range;
+    range.src_fd = srcFd;
+    range.src_offset = source.offset;
+    range.src_length = source.length;
+    range.dest_offset = destOffset;
+    if (ioctl(destFd, FICLONERANGE, &range) == 0) {
+        close(srcFd);
+        return 1;
+    }
+#endif
+
+    char* copyBuffer = new char[source.length];
+    ssize_t bytesRead = pread(srcFd, copyBuffer, source.length, source.offset);
+    bool copied = bytesRead == (ssize_t)source.length &&
+                  pwrite(destFd, copyBuffer, source.length, destOffset) == (ssize_t)source.length;
+    delete[] copyBuffer;
+    close(srcFd);
+    return copied ? 0 : -1;
+}
+
+// --- Bandwidth Shaping Functions ---
+// Read a per-peer rate under shapingMutex
+long peerRateLimit(const long& perPeerRate) {
+    pthread_mutex_lock(&shapingMutex);
+    long rate = perPeerRate;
+    pthread_mutex_unlock(&shapingMutex);
+    return rate;
+}
+
+// Returns the shaper for a peer, creating it with the current per-peer rate if needed, and frees
+// the peers' shapers that nobody has used for SHAPER_IDLE_MS. Pair with releasePeerShaper.
+PeerShaper* acquirePeerShaper(map<string, PeerShaper*>& peers, const string& peerKey, const long& perPeerRate) {
+    pthread_mutex_lock(&shapingMutex);
+    long long now = nowMicros();
+    for (auto it = peers.begin(); it != peers.end();) {
+        if (it->second->users == 0 && now - it->second->lastUsed > SHAPER_IDLE_MS * 1000LL) {
+            delete it->second;
+            it = peers.erase(it);
+        } else {
+            ++it;
         }
+    }
+    PeerShaper* shaper;
+    auto it = peers.find(peerKey);
+    if (it == peers.end()) {
+        shaper = new PeerShaper();
+        shaper->bucket.setRate(perPeerRate);
+        peers[peerKey] = shaper;
+    } else {
+        shaper = it->second;
+    }
+    shaper->users++;
+    pthread_mutex_unlock(&shapingMutex);
+    return shaper;
+}
 
-        // Send get_chunk command
-        string getChunkCommand = "get_chunk " + downloadFileName + " " + to_string(chunkIndex) + "\n";
-        if (!sendAll(sock, getChunkCommand.c_str(), getChunkCommand.length())) {
-            alertPrompt("Failed to send get_chunk command to peer " + peer.userId, false);
-            close(sock);
-            continue;
+void releasePeerShaper(PeerShaper* shaper) {
+    pthread_mutex_lock(&shapingMutex);
+    shaper->users--;
+    shaper->lastUsed = nowMicros();
+    pthread_mutex_unlock(&shapingMutex);
+}
+
+// Send all bytes while honoring the global and per-peer upload limits
+bool sendShaped(int socket, const char* buffer, size_t length, const string& peerKey) {
+    PeerShaper* shaper = acquirePeerShaper(uploadPeers, peerKey, perPeerUploadRate);
+    size_t totalSent = 0;
+    bool sent = true;
+    while (totalSent < length) {
+        size_t slice = min((size_t)RATE_SLICE, length - totalSent);
+        long long waitMicros = max(uploadBucket.reserve(slice), shaper->bucket.reserve(slice));
+        if (waitMicros > 0) {
+            usleep(waitMicros);
         }
+        if (!sendAll(socket, buffer + totalSent, slice)) {
+            sent = false;
+            break;
+        }
+        uploadMeter.add(slice);
+        shaper->meter.add(slice);
+        totalSent += slice;
+    }
+    releasePeerShaper(shaper);
+    return sent;
+}
 
-        // Receive chunk data
-        char* chunkBuffer = new char[expectedChunkSize];
-        size_t totalBytesReceived = 0;
-        bool errorOccurred = false;
+// Set a new per-peer rate and apply it to every known peer in one direction
+void setPeerRates(map<string, PeerShaper*>& peers, long& perPeerRate, long rate) {
+    pthread_mutex_lock(&shapingMutex);
+    perPeerRate = rate;
+    for (auto& entry : peers) {
+        entry.second->bucket.setRate(rate);
+    }
+    pthread_mutex_unlock(&shapingMutex);
+}
 
-        while (totalBytesReceived < expectedChunkSize) {
-            ssize_t bytesReceived = recv(sock, chunkBuffer + totalBytesReceived, expectedChunkSize - totalBytesReceived, 0);
-            if (bytesReceived < 0) {
-                alertPrompt("Failed to receive chunk from peer " + peer.userId, true);
-                errorOccurred = true;
-                break;
-            } else if (bytesReceived == 0) {
-                alertPrompt("Connection closed by peer " + peer.userId + " before receiving full chunk.", false);
-                errorOccurred = true;
-                break;
+string formatRate(double bytesPerSec) {
+    stringstream ss;
+    ss << fixed << setprecision(1) << bytesPerSec / 1024.0 << " KB/s";
+    return ss.str();
+}
+
+string formatLimit(long bytesPerSec) {
+    return bytesPerSec == 0 ? "unlimited" : formatRate(bytesPerSec);
+}
+
+void printRates() {
+    cout << "Upload:   limit " << formatLimit(uploadBucket.getRate()) << " (per peer " << formatLimit(peerRateLimit(perPeerUploadRate)) << ")"
+         << ", current " << formatRate(uploadMeter.currentRate()) << ", average " << formatRate(uploadMeter.averageRate())
+         << ", total " << uploadMeter.total() << " bytes" << endl;
+    cout << "Download: limit " << formatLimit(downloadBucket.getRate()) << " (per peer " << formatLimit(peerRateLimit(perPeerDownloadRate)) << ")"
+         << ", current " << formatRate(downloadMeter.currentRate()) << ", average " << formatRate(downloadMeter.averageRate())
+         << ", total " << downloadMeter.total() << " bytes" << endl;
+
+    pthread_mutex_lock(&shapingMutex);
+    for (auto& entry : uploadPeers) {
+        cout << "  to   " << entry.first << ": current " << formatRate(entry.second->meter.currentRate())
+             << ", total " << entry.second->meter.total() << " bytes" << endl;
+    }
+    for (auto& entry : downloadPeers) {
+        cout << "  from " << entry.first << ": current " << formatRate(entry.second->meter.currentRate())
+             << ", total " << entry.second->meter.total() << " bytes" << endl;
+    }
+    pthread_mutex_unlock(&shapingMutex);
+}
+
+// --- Upload Slot Functions ---
+// Choke/unchoke scheduling for the peer server. Downloaders opt in with from=<user_id> in
+// get_chunk, along with avail=<n>, the number of peers they know for that chunk. Slots belong to
+// the address the request comes from, not to the claimed user id, so one host cannot take several
+// slots or another peer's slot. At most uploadSlotCount downloaders are unchoked; the others are
+// answered "choked <retry_ms>".
+// Every CHOKE_ROUND_MS the regular slots go to the interested downloaders with the best score:
+// the bytes they sent us during the round, plus the bytes they asked us for weighted by
+// 1 / availability, which favours peers that will pass rare chunks on. The last slot is an
+// optimistic unchoke that rotates every OPTIMISTIC_UNCHOKE_ROUNDS rounds. Caller holds slotMutex.
+void rechokeLocked(long long now) {
+    double roundSeconds = lastChokeRound == 0 ? CHOKE_ROUND_MS / 1000.0 : max(0.001, (now - lastChokeRound) / 1000000.0);
+    ArrayList<pair<double, string>> ranked;
+    for (auto& entry : uploadSlots) {
+        UploadSlot& slot = entry.second;
+        long long received = 0;
+        pthread_mutex_lock(&shapingMutex);
+        auto it = downloadPeers.find(entry.first);
+        if (it != downloadPeers.end()) received = it->second->meter.total();
+        pthread_mutex_unlock(&shapingMutex);
+        if (received < slot.receivedAtRound) slot.receivedAtRound = 0; // Shaper was freed while idle and started over
+        slot.reciprocation = (received - slot.receivedAtRound) / roundSeconds;
+        double score = (received - slot.receivedAtRound) + slot.roundRareBytes;
+        slot.receivedAtRound = received;
+        slot.roundRareBytes = 0;
+        slot.unchoked = false;
+        if (now - slot.lastRequest <= CHOKE_ROUND_MS * 1000LL) {
+            ranked.add(make_pair(score, entry.first));
+        }
+    }
+    if (!ranked.isEmpty()) {
+        std::sort(&ranked.get(0), &ranked.get(0) + ranked.size(), [](const pair<double, string>& a, const pair<double, string>& b) {
+            return a.first > b.first;
+        });
+    }
+
+    int regularSlots = uploadSlotCount > 1 ? uploadSlotCount - 1 : uploadSlotCount;
+    for (int i = 0; i < ranked.size() && i < regularSlots; ++i) {
+        uploadSlots[ranked.get(i).second].unchoked = true;
+    }
+    // Keep the optimistic unchoke for a few rounds so it has time to reciprocate
+    bool keepOptimistic = chokeRounds % OPTIMISTIC_UNCHOKE_ROUNDS != 0 && uploadSlots.count(optimisticPeer) > 0 &&
+                          now - uploadSlots[optimisticPeer].lastRequest <= CHOKE_ROUND_MS * 1000LL;
+    if (!keepOptimistic || uploadSlots[optimisticPeer].unchoked) {
+        optimisticPeer.clear();
+        ArrayList<string> choked;
+        for (int i = regularSlots; i < ranked.size(); ++i) {
+            choked.add(ranked.get(i).second);
+        }
+        if (!choked.isEmpty() && uploadSlotCount > 1) {
+            optimisticPeer = choked.get(rand() % choked.size());
+        }
+    }
+    if (!optimisticPeer.empty()) {
+        uploadSlots[optimisticPeer].unchoked = true;
+    }
+    lastChokeRound = now;
+    chokeRounds++;
+    if (!ranked.isEmpty()) {
+        cout << "Upload slots: unchoked " << min(ranked.size(), regularSlots + (int)!optimisticPeer.empty()) << " of "
+             << ranked.size() << " interested downloaders"
+             << (optimisticPeer.empty() ? "" : " (" + optimisticPeer + " optimistically)") << "." << endl;
+    }
+}
+
+// Decide whether a downloader may be served now. A free slot is given away at once, including
+// slots held by unchoked downloaders that have stopped asking for chunks.
+bool admitUpload(const string& peerIp, size_t chunkBytes, int availability) {
+    pthread_mutex_lock(&slotMutex);
+    long long now = nowMicros();
+    if (uploadSlotCount > 0 && now - lastChokeRound >= CHOKE_ROUND_MS * 1000LL) {
+        rechokeLocked(now);
+    }
+    UploadSlot& slot = uploadSlots[peerIp];
+    slot.lastRequest = now;
+    slot.roundRareBytes += (double)chunkBytes / max(1, availability);
+    if (uploadSlotCount == 0) {
+        slot.unchoked = true;
+    } else if (!slot.unchoked) {
+        int busySlots = 0;
+        for (auto& entry : uploadSlots) {
+            if (!entry.second.unchoked) continue;
+            if (now - entry.second.lastRequest > UPLOAD_IDLE_MS * 1000LL) {
+                entry.second.unchoked = false;
+                if (entry.first == optimisticPeer) optimisticPeer.clear();
+            } else {
+                busySlots++;
             }
-            totalBytesReceived += bytesReceived;
         }
+        if (busySlots < uploadSlotCount) {
+            slot.unchoked = true;
+            cout << "Upload slots: unchoked " << peerIp << " (free slot)." << endl;
+        }
+    }
+    bool admitted = slot.unchoked;
+    if (!admitted) {
+        slot.chokedRequests++;
+    }
+    pthread_mutex_unlock(&slotMutex);
+    return admitted;
+}
 
-        // Debugging statements
-        cout << "Downloading chunk " << chunkIndex << " from peer " << peer.userId << endl;
-        cout << "Expected chunk size: " << expectedChunkSize << ", Total bytes received: " << totalBytesReceived << endl;
+void recordUploadServed(const string& peerIp, size_t bytes) {
+    pthread_mutex_lock(&slotMutex);
+    auto it = uploadSlots.find(peerIp);
+    if (it != uploadSlots.end()) it->second.servedBytes += bytes;
+    pthread_mutex_unlock(&slotMutex);
+}
 
-        if (errorOccurred || totalBytesReceived != expectedChunkSize) {
-            cout << "Warning: Expected " << expectedChunkSize << " bytes, but received " << totalBytesReceived << " bytes." << endl;
-            delete[] chunkBuffer;
-            close(sock);
-            continue;
+void printUploadSlots() {
+    pthread_mutex_lock(&slotMutex);
+    cout << "Upload slots: " << (uploadSlotCount == 0 ? "unlimited (first come, first served)" : to_string(uploadSlotCount))
+         << ", re-ranked every " << CHOKE_ROUND_MS << " ms" << endl;
+    for (auto& entry : uploadSlots) {
+        const UploadSlot& slot = entry.second;
+        cout << "  " << entry.first << ": " << (slot.unchoked ? "unchoked" : "choked")
+             << (entry.first == optimisticPeer ? " (optimistic)" : "") << ", reciprocates " << formatRate(slot.reciprocation)
+             << ", served " << slot.servedBytes << " bytes, " << slot.chokedRequests << " requests choked" << endl;
+    }
+    pthread_mutex_unlock(&slotMutex);
+}
+
+// --- Super-Seeding Functions ---
+// While a file is the only copy in the swarm, its uploader can super-seed it: each chunk is
+// sent to one downloader, and further requests for it are answered "choked", so unsent
+// chunks get the uplink. Downloaders take the withheld chunks from each other through the
+// bitfield exchange, and the uploader sends about one copy of the file. A chunk is sent
+// again once SUPERSEED_HOLD_MS have passed since its last send, in case the downloader
+// that got it went away.
+bool admitSuperSeed(const string& fileName, int chunkIndex, int totalChunks, size_t chunkBytes) {
+    pthread_mutex_lock(&superSeedMutex);
+    auto it = superSeeds.find(fileName);
+    if (it == superSeeds.end()) {
+        pthread_mutex_unlock(&superSeedMutex);
+        return true;
+    }
+    SuperSeedState& state = it->second;
+    if (state.sends.size() != totalChunks) {
+        state = SuperSeedState(); // The file was updated; start over
+        for (int i = 0; i < totalChunks; ++i) {
+            state.sends.add(0);
+            state.lastSent.add(0);
         }
+    }
+    long long now = nowMicros();
+    bool send = state.sends.get(chunkIndex) == 0 || now - state.lastSent.get(chunkIndex) >= SUPERSEED_HOLD_MS * 1000LL;
+    if (send) {
+        state.sentChunks += state.sends.get(chunkIndex) == 0;
+        state.sends.get(chunkIndex)++;
+        state.lastSent.get(chunkIndex) = now;
+        state.sentBytes += chunkBytes;
+    } else {
+        state.withheld++;
+    }
+    pthread_mutex_unlock(&superSeedMutex);
+    return send;
+}
+
+void printSuperSeed(const string& fileName) {
+    pthread_mutex_lock(&ownedFilesMutex);
+    long fileSize = ownedFilesInfo.count(fileName) > 0 ? ownedFilesInfo.at(fileName).fileSize : 0;
+    pthread_mutex_unlock(&ownedFilesMutex);
+
+    pthread_mutex_lock(&superSeedMutex);
+    auto it = superSeeds.find(fileName);
+    if (it == superSeeds.end()) {
+        cout << "Not super-seeding " << fileName << "." << endl;
+    } else {
+        const SuperSeedState& state = it->second;
+        stringstream ratio; // Formatted aside so cout keeps its default float format
+        ratio << fixed << setprecision(2) << (fileSize > 0 ? (double)state.sentBytes / fileSize : 0.0);
+        cout << "Super-seeding " << fileName << ": " << state.sentChunks << " of " << state.sends.size()
+             << " chunks sent, " << state.sentBytes << " bytes sent (" << ratio.str() << "x the file), "
+             << state.withheld << " requests withheld." << endl;
+    }
+    pthread_mutex_unlock(&superSeedMutex);
+}
 
-        // Compute SHA1 of received chunk
-        string receivedChunkSha1 = computeSHA1(chunkBuffer, totalBytesReceived);
+// --- Chunk Compression Functions ---
+// Codecs this build can encode and decode, in order of preference
+string localCodecs() {
+#ifdef USE_ZLIB
+    return "zlib";
+#else
+    return "";
+#endif
+}
 
-        cout << "Computed SHA1 of received chunk: " << receivedChunkSha1 << endl;
-        cout << "Expected SHA1 of chunk: " << chunkInfo.expectedSha1 << endl;
+// Check whether a comma separated codec list offered by a peer contains `codec`
+bool codecOffered(const string& offered, const string& codec) {
+    stringstream ss(offered);
+    string item;
+    while (getline(ss, item, ',')) {
+        if (item == codec) return true;
+    }
+    return false;
+}
 
-        if (receivedChunkSha1 != chunkInfo.expectedSha1) {
-            alertPrompt("SHA1 mismatch for chunk " + to_string(chunkIndex) + " from peer " + peer.userId, false);
-            delete[] chunkBuffer;
-            close(sock);
-            continue;
+// Compress a chunk for the wire. Returns the codec used ("raw" if the chunk is
+// incompressible or no common codec exists) and fills `out` for other codecs.
+string compressChunk(const char* data, size_t len, const string& offered, string& out) {
+#ifdef USE_ZLIB
+    if (codecOffered(offered, "zlib") && len > 0) {
+        // Trial-compress a sample first so incompressible chunks cost almost nothing
+        size_t sampleLen = min(len, (size_t)COMPRESS_SAMPLE_SIZE);
+        uLongf sampleOutLen = compressBound(sampleLen);
+        string sample(sampleOutLen, '\0');
+        if (compress2((Bytef*)&sample[0], &sampleOutLen, (const Bytef*)data, sampleLen, Z_BEST_SPEED) != Z_OK ||
+            sampleOutLen >= sampleLen * COMPRESS_MIN_SAVING) {
+            return "raw";
         }
 
-        
-        pthread_mutex_lock(&downloadMutex);
-        chunkData[chunkIndex] = string(chunkBuffer, totalBytesReceived);
-        pthread_mutex_unlock(&downloadMutex);
+        uLongf outLen = compressBound(len);
+        out.resize(outLen);
+        if (compress2((Bytef*)&out[0], &outLen, (const Bytef*)data, len, Z_BEST_SPEED) == Z_OK &&
+            outLen < len * COMPRESS_MIN_SAVING) {
+            out.resize(outLen);
+            return "zlib";
+        }
+    }
+#else
+    (void)data;
+    (void)len;
+    (void)offered;
+    (void)out;
+#endif
+    return "raw";
+}
 
-        cout << "Successfully downloaded chunk " << chunkIndex << " from peer " << peer.userId << endl;
+// Decompress a chunk received with `codec` into `out`, which must be exactly `expectedLen` bytes
+bool decompressChunk(const string& codec, const char* data, size_t len, char* out, size_t expectedLen) {
+    if (codec == "raw") {
+        if (len != expectedLen) return false;
+        memcpy(out, data, len);
+        return true;
+    }
+#ifdef USE_ZLIB
+    if (codec == "zlib") {
+        uLongf outLen = expectedLen;
+        return uncompress((Bytef*)out, &outLen, (const Bytef*)data, len) == Z_OK && outLen == expectedLen;
+    }
+#endif
+    return false;
+}
 
-        delete[] chunkBuffer;
-        close(sock);
-        success = true;
-        break; // Break after successful download
+// --- Bitfield Exchange Functions ---
+// Peers tell each other which chunks of a file they hold. A reply to
+// "get_bitfield <file_name> <file_sha1> [since=<seq>]" is either a full bitfield,
+// "bitfield <chunk_count> <seq> <payload_bytes>\n" followed by one bit per chunk (MSB first),
+// or, when `since` is still in the have log, the chunks gained since then as
+// "have <seq> <count> <chunk_index>...\n". The next poll asks for since=<seq>.
+string packBitfield(const ArrayList<bool>& have) {
+    string bits((have.size() + 7) / 8, '\0');
+    for (int i = 0; i < have.size(); ++i) {
+        if (have.get(i)) bits[i / 8] |= 0x80 >> (i % 8);
     }
+    return bits;
+}
 
-    if (!success) {
-        alertPrompt("Failed to download chunk " + to_string(chunkIndex), false);
+// Start advertising the chunks of a new download_file; also drops the previous download's state
+void beginSwarmFile(const string& fileName, const string& fileSha1, const string& outputPath) {
+    pthread_mutex_lock(&downloadMutex);
+    swarmFile = SwarmFile();
+    swarmFile.fileName = fileName;
+    swarmFile.fileSha1 = fileSha1;
+    swarmFile.outputPath = outputPath;
+    swarmFile.downloading = true;
+    for (int i = 0; i < totalChunks; ++i) {
+        swarmFile.have.add(false);
+        swarmFile.offsets.add(-1);
+        swarmFile.lengths.add(0);
     }
+    for (int i = 0; i < chunkInfoList.size(); ++i) {
+        const ChunkInfo& chunk = chunkInfoList.get(i);
+        swarmFile.offsets.get(chunk.chunkIndex) = chunk.parity ? -1 : chunk.offset;
+        swarmFile.lengths.get(chunk.chunkIndex) = chunk.length;
+    }
+    chunkData.clear();
+    localChunkSources.clear();
+    pthread_mutex_unlock(&downloadMutex);
+}
 
-    pthread_exit(NULL);
+// Stop advertising; used before downloads that do not produce a whole file
+void resetSwarmFile() {
+    pthread_mutex_lock(&downloadMutex);
+    swarmFile = SwarmFile();
+    pthread_mutex_unlock(&downloadMutex);
 }
 
-// --- Tracker Communication Function ---
-void* trackerCommunication(void* arg) {
-    char buffer[BUFFER_SIZE];
-    int readSize;
+// Record a chunk of the current download as available to peers; caller holds downloadMutex
+void markHaveLocked(int chunkIndex) {
+    if (swarmFile.downloading && chunkIndex >= 0 && chunkIndex < swarmFile.have.size() && !swarmFile.have.get(chunkIndex)) {
+        swarmFile.have.get(chunkIndex) = true;
+        swarmFile.haveLog.add(chunkIndex);
+    }
+}
 
-    while (clientRunning) {
-        cout << ">> ";
-        cout.flush(); 
-        string command;
-        if (!getline(cin, command)) {
-            // EOF detected (e.g., Ctrl+D)
-            clientRunning = false;
-            break;
+// Copy a chunk of the current or last download for a peer: from memory while downloading,
+// otherwise from the output file once it holds the chunk
+bool readSwarmChunk(const string& fileName, int chunkIndex, string& data) {
+    ChunkLocation location;
+    pthread_mutex_lock(&downloadMutex);
+    bool found = swarmFile.fileName == fileName && chunkIndex >= 0 && chunkIndex < swarmFile.have.size() && swarmFile.have.get(chunkIndex);
+    if (found) {
+        long offset = swarmFile.offsets.get(chunkIndex);
+        auto it = swarmFile.downloading ? chunkData.find(chunkIndex) : chunkData.end();
+        auto localIt = swarmFile.downloading ? localChunkSources.find(chunkIndex) : localChunkSources.end();
+        if (it != chunkData.end()) {
+            data = it->second;
+        } else if (localIt != localChunkSources.end()) {
+            location = localIt->second;
+        } else if (offset >= 0 && (swarmFile.complete || offset + swarmFile.lengths.get(chunkIndex) <= downloadWatermark)) {
+            location.filePath = swarmFile.outputPath;
+            location.offset = offset;
+            location.length = swarmFile.lengths.get(chunkIndex);
+        } else {
+            found = false; // Parity chunks are only kept while downloading
+        }
+    }
+    pthread_mutex_unlock(&downloadMutex);
+    if (!found || !data.empty()) return found;
+
+    data.assign(location.length, '\0');
+    int fd = open(location.filePath.c_str(), O_RDONLY);
+    ssize_t bytesRead = fd < 0 ? -1 : pread(fd, &data[0], data.length(), location.offset);
+    if (fd >= 0) close(fd);
+    return bytesRead == (ssize_t)data.length();
+}
+
+// Answer a get_bitfield request for a shared file or the current download
+void answerBitfield(int clientSocket, istringstream& request) {
+    string fileName, fileSha1, optionToken;
+    int since = -1;
+    request >> fileName >> fileSha1;
+    while (request >> optionToken) {
+        if (optionToken.compare(0, 6, "since=") == 0) since = myAtoi(optionToken.substr(6));
+    }
+
+    string reply;
+    int sharedChunks = -1;
+    pthread_mutex_lock(&ownedFilesMutex);
+    auto ownedIt = ownedFilesInfo.find(fileName);
+    if (ownedIt != ownedFilesInfo.end() && ownedIt->second.fileSHA1 == fileSha1) {
+        sharedChunks = ownedIt->second.totalChunks;
+    }
+    pthread_mutex_unlock(&ownedFilesMutex);
+    if (sharedChunks >= 0) {
+        // Shared files have every chunk, and never change under the same SHA1
+        ArrayList<bool> have;
+        for (int i = 0; i < sharedChunks; ++i) have.add(true);
+        string bits = packBitfield(have);
+        reply = "bitfield " + to_string(have.size()) + " 0 " + to_string(bits.length()) + "\n" + bits;
+    } else {
+        pthread_mutex_lock(&downloadMutex);
+        if (swarmFile.fileName == fileName && swarmFile.fileSha1 == fileSha1) {
+            int seq = swarmFile.haveLog.size();
+            if (since >= 0 && since <= seq) {
+                reply = "have " + to_string(seq) + " " + to_string(seq - since);
+                for (int i = since; i < seq; ++i) {
+                    reply += " " + to_string(swarmFile.haveLog.get(i));
+                }
+                reply += "\n";
+            } else {
+                string bits = packBitfield(swarmFile.have);
+                reply = "bitfield " + to_string(swarmFile.have.size()) + " " + to_string(seq) + " " + to_string(bits.length()) + "\n" + bits;
+            }
         }
+        pthread_mutex_unlock(&downloadMutex);
+    }
+    if (reply.empty()) {
+        reply = "Error: File not found.\n";
+    }
+    sendAll(clientSocket, reply.data(), reply.length());
+    close(clientSocket);
+}
+
+// User logged in on this client, or empty; safe to call from any thread
+string loggedInUser() {
+    pthread_mutex_lock(&userMutex);
+    string userId = currentUserId;
+    pthread_mutex_unlock(&userMutex);
+    return userId;
+}
+
+// --- Peer Exchange Functions ---
+// Peers gossip the other peers they know for a file. "get_peers <file_sha1> [<user_id> <ip> <port>]"
+// is answered with "peers <n> <user_id> <ip> <port>...\n", at most PEX_MAX_PEERS of them, most
+// recently seen first. The optional identity of the asking downloader only leaves it out of the
+// reply: a peer is known, and gossiped, only once a bitfield or chunk exchange with it succeeded.
+void rememberSwarmPeer(const string& fileSha1, const PeerInfo& peer) {
+    if (peer.userId.empty() || peer.userId == loggedInUser() || peer.port <= 0) return;
+    pthread_mutex_lock(&pexMutex);
+    if (knownSwarmPeers.count(fileSha1) == 0 && knownSwarmPeers.size() >= PEX_MAX_FILES) {
+        knownSwarmPeers.erase(knownSwarmPeers.begin()); // Forget the peers of some other file
+    }
+    ArrayList<PeerInfo>& peers = knownSwarmPeers[fileSha1];
+    ArrayList<PeerInfo> updated;
+    updated.add(peer);
+    for (int i = 0; i < peers.size() && updated.size() < PEX_MAX_PEERS; ++i) {
+        if (peers.get(i).userId != peer.userId) updated.add(peers.get(i));
+    }
+    peers = updated;
+    pthread_mutex_unlock(&pexMutex);
+}
+
+// Answer a get_peers request for a shared file or the current download
+void answerPeers(int clientSocket, istringstream& request) {
+    string fileSha1;
+    PeerInfo asker;
+    asker.port = 0;
+    request >> fileSha1 >> asker.userId >> asker.ip >> asker.port;
+
+    bool known = false;
+    pthread_mutex_lock(&ownedFilesMutex);
+    for (auto it = ownedFilesInfo.begin(); it != ownedFilesInfo.end() && !known; ++it) {
+        known = it->second.fileSHA1 == fileSha1;
+    }
+    pthread_mutex_unlock(&ownedFilesMutex);
+    pthread_mutex_lock(&downloadMutex);
+    known = known || swarmFile.fileSha1 == fileSha1;
+    pthread_mutex_unlock(&downloadMutex);
+
+    string reply;
+    int count = 0;
+    if (known) {
+        pthread_mutex_lock(&pexMutex);
+        auto it = knownSwarmPeers.find(fileSha1);
+        for (int i = 0; it != knownSwarmPeers.end() && i < it->second.size(); ++i) {
+            const PeerInfo& peer = it->second.get(i);
+            if (peer.userId == asker.userId) continue;
+            reply += " " + peer.userId + " " + peer.ip + " " + to_string(peer.port);
+            count++;
+        }
+        pthread_mutex_unlock(&pexMutex);
+    }
+    reply = "peers " + to_string(count) + reply + "\n";
+    sendAll(clientSocket, reply.data(), reply.length());
+    close(clientSocket);
+}
+
+// --- Peer Server Functions ---
+// A parsed and validated get_chunk request waiting to be served in a batch
+struct ServeJob {
+    int clientSocket;
+    string peerIp;
+    string fileName;
+    int chunkIndex;
+    map<string, string> options;
+    bool framed;
+    int fd;                     // -1 for directory shares and chunks of the current download
+    bool owned;                 // Chunk of a shared file rather than of the current download
+    int totalChunks;            // Chunks of the shared file, for super-seeding
+    string memoryData;          // Chunk of the current download or of a directory share, served from memory
+    int readIndex;              // Position in the batched reads, -1 when served from memory
+    off_t offset;
+    size_t expectedChunkSize;
+    char* chunkBuffer;
+    int bufferIndex;
+    string compressed; // Payload when sent with a codec other than raw
+    string proof;      // Merkle proof for the chunk when requested with proof=1
+    bool withProof;
+};
+
+// Apply upload slot scheduling to a prepared chunk request; a choked downloader is told when to retry
+bool admitJob(ServeJob& job) {
+    if (job.options.count("from") == 0) {
+        return true; // Downloaders that do not name themselves are served in arrival order
+    }
+    int availability = job.options.count("avail") > 0 ? myAtoi(job.options["avail"]) : 1;
+    if (admitUpload(job.peerIp, job.expectedChunkSize, availability) &&
+        (!job.owned || admitSuperSeed(job.fileName, job.chunkIndex, job.totalChunks, job.expectedChunkSize))) {
+        return true;
+    }
+    string reply = "choked " + to_string(CHOKE_RETRY_MS) + "\n";
+    sendAll(job.clientSocket, reply.c_str(), reply.length());
+    if (job.fd >= 0) close(job.fd);
+    close(job.clientSocket);
+    return false;
+}
+
+// Read and validate one peer request. Valid chunk requests are appended to `batch`;
+// anything else is answered with an error and the connection is closed.
+void prepareServeJob(int clientSocket, const sockaddr_in& clientAddr, ArrayList<ServeJob>& batch) {
+    char buffer[BUFFER_SIZE];
+    memset(buffer, 0, BUFFER_SIZE);
+    int readSize = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
+    if (readSize <= 0) {
+        close(clientSocket);
+        return;
+    }
+    buffer[readSize] = '\0';
+    string request(buffer);
+
+    ServeJob job;
+    job.clientSocket = clientSocket;
+    job.peerIp = inet_ntoa(clientAddr.sin_addr);
+
+    // Parse request
+    istringstream iss(request);
+    string command;
+    iss >> command;
+    if (command == "get_bitfield") {
+        answerBitfield(clientSocket, iss);
+        return;
+    }
+    if (command == "get_peers") {
+        answerPeers(clientSocket, iss);
+        return;
+    }
+    iss >> job.fileName >> job.chunkIndex;
+
+    // Optional key=value tokens; their presence selects the framed reply
+    // "chunk <codec> <length>\n<payload>" instead of raw chunk bytes
+    string optionToken;
+    while (iss >> optionToken) {
+        int eqPos = locate(optionToken, '=');
+        if (eqPos > 0) {
+            job.options[substring(optionToken, 0, eqPos)] = substring(optionToken, eqPos + 1, optionToken.length() - eqPos - 1);
+        }
+    }
+    job.framed = !job.options.empty();
+
+    if (command != "get_chunk") {
+        string errorMsg = "Error: Invalid command.\n";
+        sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+        close(clientSocket);
+        return;
+    }
+
+    // Chunks of the current download are served from memory or the partly written output file;
+    // they carry no Merkle proofs
+    pthread_mutex_lock(&ownedFilesMutex);
+    bool sharedFile = ownedFilesInfo.find(job.fileName) != ownedFilesInfo.end();
+    pthread_mutex_unlock(&ownedFilesMutex);
+    if (!sharedFile && job.options.count("proof") == 0 &&
+        readSwarmChunk(job.fileName, job.chunkIndex, job.memoryData)) {
+        job.fd = -1;
+        job.owned = false;
+        job.totalChunks = 0;
+        job.withProof = false;
+        job.offset = 0;
+        job.expectedChunkSize = job.memoryData.length();
+        job.chunkBuffer = NULL;
+        job.bufferIndex = -1;
+        if (admitJob(job)) batch.add(job);
+        return;
+    }
+
+    // Check if the client has the requested file. The entry is only used while ownedFilesMutex is
+    // held, since update_file may replace it; everything served later is copied into the job.
+    pthread_mutex_lock(&ownedFilesMutex);
+    if (ownedFilesInfo.find(job.fileName) == ownedFilesInfo.end()) {
+        pthread_mutex_unlock(&ownedFilesMutex);
+        string errorMsg = "Error: File not found.\n";
+        sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+        close(clientSocket);
+        return;
+    }
+
+    const OwnedFileInfo& fileInfo = ownedFilesInfo.at(job.fileName);
+    job.owned = true;
+    job.totalChunks = fileInfo.totalChunks;
+
+    // Parity chunks of erasure-coded shares are read from the parity sidecar
+    string servePath = fileInfo.filePath;
+    if (job.chunkIndex >= firstParityChunk(fileInfo)) {
+        servePath += PARITY_SUFFIX;
+    }
+
+    // Get file size using stat
+    struct stat st;
+    if (stat(servePath.c_str(), &st) != 0) {
+        pthread_mutex_unlock(&ownedFilesMutex);
+        alertPrompt("Failed to get file size: " + servePath, true);
+        string errorMsg = "Error: Cannot get file size.\n";
+        sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+        close(clientSocket);
+        return;
+    }
+    off_t fileSize = fileInfo.packedHeader.empty() ? st.st_size : fileInfo.fileSize;
+
+    // Look up offset and expected chunk size
+    int chunkIndex = job.chunkIndex;
+    if (chunkIndex < 0 || chunkIndex >= fileInfo.totalChunks || fileInfo.chunkOffsets.get(chunkIndex) >= fileSize) {
+        pthread_mutex_unlock(&ownedFilesMutex);
+        string errorMsg = "Error: Invalid chunk index.\n";
+        sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+        close(clientSocket);
+        return;
+    }
+    job.offset = fileInfo.chunkOffsets.get(chunkIndex);
+    job.expectedChunkSize = fileInfo.chunkLengths.get(chunkIndex);
+
+    // Merkle manifests: the downloader verifies the chunk against the root with this proof
+    job.withProof = job.options.count("proof") > 0;
+    if (job.withProof) {
+        if (fileInfo.merkleLayers.isEmpty()) {
+            pthread_mutex_unlock(&ownedFilesMutex);
+            string errorMsg = "Error: No Merkle tree for this file.\n";
+            sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+            close(clientSocket);
+            return;
+        }
+        job.proof = merkleProof(fileInfo.merkleLayers, chunkIndex);
+    }
+
+    // Open the file; chunks of directory shares are read from their member files right away,
+    // while the file table is still locked
+    bool packed = !fileInfo.packedHeader.empty();
+    job.fd = -1;
+    if (packed) {
+        job.memoryData.resize(job.expectedChunkSize);
+        if (readPacked(fileInfo, &job.memoryData[0], job.expectedChunkSize, job.offset) < 0) {
+            pthread_mutex_unlock(&ownedFilesMutex);
+            alertPrompt("Failed to read chunk from directory share: " + servePath, true);
+            string errorMsg = "Error: Cannot read chunk.\n";
+            sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+            close(clientSocket);
+            return;
+        }
+    } else {
+        job.fd = open(servePath.c_str(), O_RDONLY);
+    }
+    pthread_mutex_unlock(&ownedFilesMutex);
+    if (job.fd < 0 && !packed) {
+        alertPrompt("Failed to open file for chunk transfer: " + servePath, true);
+        string errorMsg = "Error: Cannot open file.\n";
+        sendAll(clientSocket, errorMsg.c_str(), errorMsg.length());
+        close(clientSocket);
+        return;
+    }
+
+    job.chunkBuffer = NULL;
+    job.bufferIndex = -1;
+    if (admitJob(job)) batch.add(job);
+}
+
+// A rate-limited chunk send handed off by the peer server, so that waiting on one peer's
+// limit does not hold up the others
+struct ShapedSend {
+    int clientSocket;
+    string payload;
+    string peerIp;
+};
+
+void* shapedSendThread(void* arg) {
+    ShapedSend* send = (ShapedSend*)arg;
+    if (!sendShaped(send->clientSocket, send->payload.data(), send->payload.length(), send->peerIp)) {
+        alertPrompt("Failed to send chunk data to peer.", false);
+    } else {
+        recordUploadServed(send->peerIp, send->payload.length());
+    }
+    close(send->clientSocket);
+    delete send;
+    pthread_mutex_lock(&shapingMutex);
+    shapedSenders--;
+    pthread_mutex_unlock(&shapingMutex);
+    return NULL;
+}
+
+// Serve a batch of chunk requests: all chunk reads are submitted together, then
+// all payloads are sent together (or one by one through the rate limiter when shaping)
+void serveBatch(ArrayList<ServeJob>& batch) {
+    long long batchStart = nowMicros();
+    bool useRing = ioUringEnabled;
+
+    ArrayList<IoRequest> reads;
+    for (int i = 0; i < batch.size(); ++i) {
+        ServeJob& job = batch.get(i);
+        job.chunkBuffer = serveIo.acquireBuffer(job.expectedChunkSize, job.bufferIndex);
+        job.readIndex = -1;
+        if (job.fd < 0) {
+            continue; // Chunks of directory shares and of the current download are already in memory
+        }
+        job.readIndex = reads.size();
+        IoRequest request;
+        request.op = IoOp::READ;
+        request.fd = job.fd;
+        request.buffer = job.chunkBuffer;
+        request.length = job.expectedChunkSize;
+        request.offset = job.offset;
+        request.bufferIndex = job.bufferIndex;
+        reads.add(request);
+    }
+    serveIo.run(reads, useRing);
+
+    bool shaping = uploadBucket.getRate() > 0 || peerRateLimit(perPeerUploadRate) > 0;
+    ArrayList<IoRequest> sends;
+    ArrayList<int> sendJobs; // Job index of each batched send
+    for (int i = 0; i < batch.size(); ++i) {
+        ServeJob& job = batch.get(i);
+        ssize_t readResult = job.readIndex >= 0 ? reads.get(job.readIndex).result : job.expectedChunkSize;
+        if (job.readIndex < 0) {
+            memcpy(job.chunkBuffer, job.memoryData.data(), job.memoryData.length());
+        }
+        if (readResult < 0) {
+            errno = -readResult;
+            alertPrompt("Failed to read chunk from file", true);
+            string errorMsg = "Error: Cannot read chunk.\n";
+            sendAll(job.clientSocket, errorMsg.c_str(), errorMsg.length());
+            continue;
+        }
+        size_t totalBytesRead = readResult; // Short if the file ended unexpectedly
+
+        // Debugging statements
+        cout << "Peer Server: Serving chunk " << job.chunkIndex << " of file " << job.fileName << endl;
+        cout << "Chunk offset: " << job.offset << ", Expected chunk size: " << job.expectedChunkSize << endl;
+        cout << "Bytes read from file: " << totalBytesRead << endl;
+
+        char* payload = job.chunkBuffer;
+        size_t payloadLen = totalBytesRead;
+        string codec = "raw";
+        if (job.framed) {
+            codec = compressChunk(job.chunkBuffer, totalBytesRead, job.options["accept"], job.compressed);
+            if (codec != "raw") {
+                payload = &job.compressed[0];
+                payloadLen = job.compressed.length();
+            }
+            string header = "chunk " + codec + " " + to_string(payloadLen);
+            if (job.withProof) {
+                header += " proof=" + job.proof;
+            }
+            header += "\n";
+            sendAll(job.clientSocket, header.c_str(), header.length());
+        }
+
+        if (shaping) {
+            // Send the chunk data on its own thread, or here once MAX_SHAPED_SENDERS are busy
+            ShapedSend* send = new ShapedSend();
+            send->clientSocket = job.clientSocket;
+            send->payload.assign(payload, payloadLen);
+            send->peerIp = job.peerIp;
+            pthread_mutex_lock(&shapingMutex);
+            bool handOff = shapedSenders < MAX_SHAPED_SENDERS;
+            if (handOff) shapedSenders++;
+            pthread_mutex_unlock(&shapingMutex);
+            pthread_t senderThread;
+            if (handOff && pthread_create(&senderThread, NULL, shapedSendThread, send) == 0) {
+                pthread_detach(senderThread);
+                job.clientSocket = -1; // Closed by the sender thread
+            } else {
+                if (handOff) {
+                    pthread_mutex_lock(&shapingMutex);
+                    shapedSenders--;
+                    pthread_mutex_unlock(&shapingMutex);
+                }
+                if (!sendShaped(job.clientSocket, payload, payloadLen, job.peerIp)) {
+                    alertPrompt("Failed to send chunk data to peer.", false);
+                } else {
+                    recordUploadServed(job.peerIp, payloadLen);
+                }
+                delete send;
+            }
+        } else {
+            IoRequest request;
+            request.op = IoOp::SEND;
+            request.fd = job.clientSocket;
+            request.buffer = payload;
+            request.length = payloadLen;
+            sends.add(request);
+            sendJobs.add(i);
+        }
+
+        cout << "Served chunk " << job.chunkIndex << " of file " << job.fileName << " to peer ("
+             << codec << ", " << payloadLen << " bytes on the wire)." << endl;
+    }
+
+    serveIo.run(sends, useRing);
+    for (int i = 0; i < sends.size(); ++i) {
+        ServeJob& job = batch.get(sendJobs.get(i));
+        if (sends.get(i).result != (ssize_t)sends.get(i).length) {
+            alertPrompt("Failed to send chunk data to peer.", false);
+        }
+        if (sends.get(i).done > 0) {
+            uploadMeter.add(sends.get(i).done);
+            PeerShaper* shaper = acquirePeerShaper(uploadPeers, job.peerIp, perPeerUploadRate);
+            shaper->meter.add(sends.get(i).done);
+            releasePeerShaper(shaper);
+            recordUploadServed(job.peerIp, sends.get(i).done);
+        }
+    }
+
+    for (int i = 0; i < batch.size(); ++i) {
+        ServeJob& job = batch.get(i);
+        serveIo.releaseBuffer(job.chunkBuffer, job.bufferIndex);
+        if (job.fd >= 0) close(job.fd);
+        if (job.clientSocket >= 0) close(job.clientSocket);
+    }
+    if (batch.size() > 1) {
+        cout << "Served batch of " << batch.size() << " chunks in " << (nowMicros() - batchStart) << " us ("
+             << (useRing ? "io_uring" : "blocking syscalls") << ")." << endl;
+    }
+}
+
+// --- Peer Server Function ---
+// Function to handle incoming connections from peers requesting chunks
+void* peerServer(void* arg) {
+    int listenPort = *(int*)arg;
+    delete (int*)arg;
+
+    int serverSocket, clientSocket, c;
+    sockaddr_in serverAddr, clientAddr;
+
+    // Create socket
+    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == -1) {
+        alertPrompt("Could not create peer server socket", true);
+        pthread_exit(NULL);
+    }
+
+    // Prepare sockaddr_in structure
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY; // Listen on all interfaces
+    serverAddr.sin_port = htons(listenPort);
+
+    // Bind
+    if (::bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        alertPrompt("Peer server bind failed", true);
+        close(serverSocket);
+        pthread_exit(NULL);
+    }
+
+    // Listen
+    if (listen(serverSocket, PEER_LISTEN_BACKLOG) < 0) {
+        alertPrompt("Peer server listen failed", true);
+        close(serverSocket);
+        pthread_exit(NULL);
+    }
+
+    cout << "Peer server listening on port " << listenPort << endl;
+
+    c = sizeof(sockaddr_in);
+
+    // Accept incoming connections
+    while (clientRunning && (clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, (socklen_t*)&c)) >= 0) {
+        ArrayList<ServeJob> batch;
+        prepareServeJob(clientSocket, clientAddr, batch);
+
+        // Drain connections that are already waiting so their chunks are served in the same batch
+        int flags = fcntl(serverSocket, F_GETFL, 0);
+        fcntl(serverSocket, F_SETFL, flags | O_NONBLOCK);
+        while (batch.size() < IO_BATCH_SIZE && (clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, (socklen_t*)&c)) >= 0) {
+            fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL, 0) & ~O_NONBLOCK);
+            prepareServeJob(clientSocket, clientAddr, batch);
+        }
+        fcntl(serverSocket, F_SETFL, flags);
+
+        serveBatch(batch);
+    }
+
+    close(serverSocket);
+    pthread_exit(NULL);
+}
+
+// --- Download Info Functions ---
+// Parse a tracker download_info response into file metadata and the per-chunk peer lists.
+// A chunk size of 0 marks content-defined chunks, which carry their own offset and length.
+// A Merkle manifest lists its root and the sharers once; its chunk SHA1s stay empty until
+// each chunk arrives with a proof. Erasure-coded files ("rs <data> <parity>") list their
+// parity chunks after the data chunks. A trailing "swarm <count> <user ip port>..." lists
+// other recent downloaders to ask for bitfields.
+bool parseDownloadInfo(const string& responseStr, long& fileSize, long& chunkSize, string& fileSha1, string& rootHash,
+                       ArrayList<ChunkInfo>& chunks, ErasureLayout& erasure, ArrayList<PeerInfo>& swarmPeers) {
+    istringstream responseStream(responseStr);
+    string infoTag;
+    responseStream >> infoTag;
+    if (infoTag != "download_info") {
+        alertPrompt("Invalid response from tracker.", false);
+        return false;
+    }
+
+    // Extract file metadata
+    int chunkCount = 0;
+    responseStream >> fileSize >> chunkCount >> chunkSize >> fileSha1;
+    erasure.dataShards = erasure.parityShards = 0;
+    if (responseStream >> ws && responseStream.peek() == 'r') {
+        string rsTag;
+        responseStream >> rsTag >> erasure.dataShards >> erasure.parityShards;
+        if (rsTag != "rs" || erasure.dataShards < 1 || erasure.parityShards < 1 || erasure.dataShards + erasure.parityShards > 255) {
+            responseStream.setstate(ios::failbit);
+        }
+    }
+    erasure.dataChunks = chunkSize > 0 ? (fileSize + chunkSize - 1) / chunkSize : chunkCount;
+    int parityChunks = erasure.dataShards > 0 ? (erasure.dataChunks + erasure.dataShards - 1) / erasure.dataShards * erasure.parityShards : 0;
+    if (!responseStream || chunkSize < 0 || (chunkSize > 0 && erasure.dataChunks + parityChunks != chunkCount)) {
+        alertPrompt("Invalid chunk layout in download_info.", false);
+        return false;
+    }
+
+    chunks.clear();
+    rootHash.clear();
+    swarmPeers.clear();
+    auto parseSwarm = [&]() {
+        string swarmTag;
+        int swarmCount = 0;
+        if (!(responseStream >> swarmTag >> swarmCount) || swarmTag != "swarm") return;
+        for (int j = 0; j < swarmCount; ++j) {
+            PeerInfo peer;
+            if (!(responseStream >> peer.userId >> peer.ip >> peer.port)) break;
+            swarmPeers.add(peer);
+        }
+    };
+    if (responseStream >> ws && responseStream.peek() == 'm') {
+        string merkleTag;
+        int sharerCount = 0;
+        responseStream >> merkleTag >> rootHash >> sharerCount;
+        ArrayList<PeerInfo> sharers;
+        for (int j = 0; j < sharerCount; ++j) {
+            PeerInfo peer;
+            responseStream >> peer.userId >> peer.ip >> peer.port;
+            sharers.add(peer);
+        }
+        if (!responseStream || merkleTag != "merkle" || chunkSize == 0) {
+            alertPrompt("Invalid Merkle manifest in download_info.", false);
+            return false;
+        }
+        for (int i = 0; i < chunkCount; ++i) {
+            ChunkInfo chunk;
+            chunk.chunkIndex = i;
+            chunk.availability = sharerCount;
+            chunk.peersWithChunk = sharers;
+            chunk.offset = static_cast<long>(i) * chunkSize;
+            chunk.length = chunkLength(fileSize, chunkSize, i);
+            chunk.parity = false;
+            chunks.add(chunk);
+        }
+        parseSwarm();
+        return true;
+    }
+
+    // Extract chunk availability and peer info
+    long coveredBytes = 0;
+    for (int i = 0; i < chunkCount; ++i) {
+        ChunkInfo chunk;
+        responseStream >> chunk.chunkIndex >> chunk.availability >> chunk.expectedSha1;
+        chunk.parity = chunk.chunkIndex >= erasure.dataChunks;
+        if (chunkSize == 0) {
+            responseStream >> chunk.offset >> chunk.length;
+        } else if (chunk.parity) {
+            // Parity chunks are always full-size and have no place in the file
+            chunk.offset = -1;
+            chunk.length = chunkSize;
+        } else {
+            chunk.offset = static_cast<long>(chunk.chunkIndex) * chunkSize;
+            chunk.length = chunkLength(fileSize, chunkSize, chunk.chunkIndex);
+        }
+        coveredBytes += chunk.parity ? 0 : chunk.length;
+        for (int j = 0; j < chunk.availability; ++j) {
+            PeerInfo peer;
+            responseStream >> peer.userId >> peer.ip >> peer.port;
+            chunk.peersWithChunk.add(peer);
+        }
+        chunks.add(chunk);
+    }
+    if (!responseStream || coveredBytes != fileSize) {
+        alertPrompt("Invalid chunk layout in download_info.", false);
+        return false;
+    }
+    parseSwarm();
+    return true;
+}
+
+// Ask the tracker for fresh chunk availability and replace the peer lists of the current
+// download. Returns the number of chunks whose peer list changed, or -1 on failure.
+int refreshChunkPeers() {
+    string refreshCommand = "download_file " + downloadGroupId + " " + downloadFileName + "\n";
+    string responseStr;
+    if (!sendAll(trackerSocket, refreshCommand.c_str(), refreshCommand.length()) || recvTrackerResponse(responseStr) <= 0) {
+        alertPrompt("Failed to refresh peers from tracker.", false);
+        return -1;
+    }
+    if (responseStr.find("Error:") == 0) {
+        cout << responseStr;
+        return -1;
+    }
+
+    long fileSize, chunkSize;
+    string fileSha1, rootHash;
+    ArrayList<ChunkInfo> freshChunks;
+    ErasureLayout erasure;
+    ArrayList<PeerInfo> swarmPeers;
+    if (!parseDownloadInfo(responseStr, fileSize, chunkSize, fileSha1, rootHash, freshChunks, erasure, swarmPeers)) {
+        return -1;
+    }
+    if (fileSha1 != downloadFileSha1 || freshChunks.size() != totalChunks) {
+        alertPrompt("File changed on the tracker during download; keeping the old peer lists.", false);
+        return -1;
+    }
+
+    map<int, int> freshByIndex; // Chunk index -> position in freshChunks
+    for (int i = 0; i < freshChunks.size(); ++i) {
+        freshByIndex[freshChunks.get(i).chunkIndex] = i;
+    }
+    int changed = 0;
+    for (int i = 0; i < chunkInfoList.size(); ++i) {
+        ChunkInfo& chunk = chunkInfoList.get(i);
+        auto it = freshByIndex.find(chunk.chunkIndex);
+        if (it == freshByIndex.end()) continue;
+        const ChunkInfo& fresh = freshChunks.get(it->second);
+        bool samePeers = fresh.peersWithChunk.size() == chunk.peersWithChunk.size();
+        for (int j = 0; samePeers && j < fresh.peersWithChunk.size(); ++j) {
+            samePeers = fresh.peersWithChunk.get(j).userId == chunk.peersWithChunk.get(j).userId;
+        }
+        if (!samePeers) {
+            chunk.availability = fresh.availability;
+            chunk.peersWithChunk = fresh.peersWithChunk;
+            changed++;
+        }
+    }
+    downloadSwarmPeers = swarmPeers;
+    return changed;
+}
+
+// Start a control request to a peer as a non-blocking exchange polled by the download engine.
+// Returns false if the connection could not even be started.
+bool startControlExchange(const PeerInfo& peer, const string& request, bool getPeers) {
+    sockaddr_in peerAddr;
+    peerAddr.sin_family = AF_INET;
+    peerAddr.sin_port = htons(peer.port);
+    if (inet_pton(AF_INET, peer.ip.c_str(), &peerAddr.sin_addr) <= 0) {
+        return false;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return false;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, (sockaddr*)&peerAddr, sizeof(peerAddr)) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        return false;
+    }
+    ControlExchange* exchange = new ControlExchange();
+    exchange->peer = peer;
+    exchange->getPeers = getPeers;
+    exchange->sock = sock;
+    exchange->connecting = true;
+    exchange->request = request;
+    exchange->requestSent = 0;
+    exchange->deadline = nowMicros() + BITFIELD_TIMEOUT_MS * 1000LL;
+    exchange->pollIndex = -1;
+    controlExchanges.add(exchange);
+    return true;
+}
+
+// Advance an exchange whose socket poll reported ready: 1 = the whole reply is in,
+// 0 = still in progress, -1 = failed
+int stepControlExchange(ControlExchange* exchange) {
+    if (exchange->connecting) {
+        int connectError = 0;
+        socklen_t errorLength = sizeof(connectError);
+        if (getsockopt(exchange->sock, SOL_SOCKET, SO_ERROR, &connectError, &errorLength) != 0 || connectError != 0) {
+            return -1;
+        }
+        exchange->connecting = false;
+    }
+    if (exchange->requestSent < exchange->request.length()) {
+        ssize_t sent = send(exchange->sock, exchange->request.data() + exchange->requestSent,
+                            exchange->request.length() - exchange->requestSent, 0);
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        exchange->requestSent += sent;
+        return 0;
+    }
+    char buffer[BUFFER_SIZE];
+    ssize_t readSize = recv(exchange->sock, buffer, sizeof(buffer), 0);
+    if (readSize < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    if (readSize == 0) {
+        return 1;
+    }
+    exchange->reply.append(buffer, readSize);
+    return 0;
+}
+
+// Add the exchanges in flight to a poll set, shortening `timeoutMs` to the nearest deadline
+void pollControlExchanges(ArrayList<pollfd>& pollFds, long long now, int& timeoutMs) {
+    for (int i = 0; i < controlExchanges.size(); ++i) {
+        ControlExchange* exchange = controlExchanges.get(i);
+        timeoutMs = min(timeoutMs, (int)max(0LL, (exchange->deadline - now + 999) / 1000));
+        pollfd pfd;
+        pfd.fd = exchange->sock;
+        pfd.events = exchange->connecting || exchange->requestSent < exchange->request.length() ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        exchange->pollIndex = pollFds.size();
+        pollFds.add(pfd);
+    }
+}
+
+// Apply a get_bitfield reply to the peer's state. Returns false if the peer did not know the file.
+bool applyBitfieldReply(PeerBitfield& state, const string& reply) {
+    size_t newlinePos = reply.find('\n');
+    if (newlinePos == string::npos) {
+        return false;
+    }
+    istringstream header(reply.substr(0, newlinePos));
+    string tag;
+    int seq = 0;
+    header >> tag;
+    if (tag == "bitfield") {
+        int chunkCount = 0;
+        size_t payloadBytes = 0;
+        header >> chunkCount >> seq >> payloadBytes;
+        if (!header || chunkCount != state.have.size() || payloadBytes != (size_t)(chunkCount + 7) / 8 ||
+            reply.length() - newlinePos - 1 != payloadBytes) {
+            return false;
+        }
+        const unsigned char* bits = reinterpret_cast<const unsigned char*>(reply.data() + newlinePos + 1);
+        for (int i = 0; i < chunkCount; ++i) {
+            state.have.get(i) = (bits[i / 8] & (0x80 >> (i % 8))) != 0;
+        }
+    } else if (tag == "have") {
+        int count = 0, chunkIndex = 0;
+        header >> seq >> count;
+        for (int i = 0; i < count && header >> chunkIndex; ++i) {
+            if (chunkIndex >= 0 && chunkIndex < state.have.size()) state.have.get(chunkIndex) = true;
+        }
+        if (!header) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    state.seq = seq;
+    state.responsive = true;
+    rememberSwarmPeer(downloadFileSha1, state.peer);
+    state.complete = true;
+    for (int i = 0; i < state.have.size() && state.complete; ++i) {
+        state.complete = state.have.get(i);
+    }
+    return true;
+}
+
+// Rebuild each chunk's peer list from the bitfields: peers that answered are listed exactly for the
+// chunks they reported, peers that never answered keep the chunks the tracker listed. Each list
+// starts at a different holder (by chunk index) so first attempts spread over all of them.
+// Returns the number of chunks whose peer list changed.
+int applyPeerBitfields() {
+    int changed = 0;
+    for (int i = 0; i < chunkInfoList.size(); ++i) {
+        ChunkInfo& chunk = chunkInfoList.get(i);
+        ArrayList<PeerInfo> holders;
+        for (int j = 0; j < chunk.peersWithChunk.size(); ++j) {
+            auto it = peerBitfields.find(chunk.peersWithChunk.get(j).userId);
+            if (it == peerBitfields.end() || !it->second.responsive) holders.add(chunk.peersWithChunk.get(j));
+        }
+        for (auto it = peerBitfields.begin(); it != peerBitfields.end(); ++it) {
+            if (it->second.responsive && it->second.have.get(chunk.chunkIndex)) holders.add(it->second.peer);
+        }
+        ArrayList<PeerInfo> peers;
+        for (int j = 0; j < holders.size(); ++j) {
+            peers.add(holders.get((chunk.chunkIndex + j) % holders.size()));
+        }
+        bool samePeers = peers.size() == chunk.peersWithChunk.size();
+        for (int j = 0; samePeers && j < peers.size(); ++j) {
+            samePeers = peers.get(j).userId == chunk.peersWithChunk.get(j).userId;
+        }
+        if (!samePeers) {
+            chunk.peersWithChunk = peers;
+            chunk.availability = peers.size();
+            changed++;
+        }
+    }
+    return changed;
+}
+
+// Start tracking a peer of the current download; it is asked for its bitfield on the next sync.
+// Returns false if already known.
+bool addBitfieldPeer(const PeerInfo& peer) {
+    if (peer.userId == loggedInUser() || peerBitfields.count(peer.userId) > 0) return false;
+    PeerBitfield state;
+    state.peer = peer;
+    state.seq = 0;
+    state.responsive = state.failed = state.complete = state.querying = false;
+    for (int i = 0; i < totalChunks; ++i) state.have.add(false);
+    peerBitfields[peer.userId] = state;
+    return true;
+}
+
+// Add the peers from a get_peers reply; returns the number of new peers
+int applyPeersReply(const string& reply) {
+    istringstream replyStream(reply);
+    string tag;
+    int count = 0;
+    replyStream >> tag >> count;
+    if (tag != "peers") {
+        return 0;
+    }
+    int learned = 0;
+    for (int j = 0; j < count && j < PEX_MAX_PEERS; ++j) {
+        PeerInfo peer;
+        if (!(replyStream >> peer.userId >> peer.ip >> peer.port)) break;
+        learned += addBitfieldPeer(peer);
+    }
+    return learned;
+}
+
+// Ask every known peer of the current download which chunks it holds (have-updates after the
+// first exchange). Peers come from the tracker's chunk lists and its swarm list. The requests run
+// on the engine's poll loop, and their replies are applied by finishControlExchanges.
+void startBitfieldSync() {
+    if (!downloadMerkleRoot.empty()) {
+        return; // Only sharers can send Merkle proofs, and the tracker lists all of them
+    }
+    for (int i = 0; i < chunkInfoList.size(); ++i) {
+        for (int j = 0; j < chunkInfoList.get(i).peersWithChunk.size(); ++j) {
+            addBitfieldPeer(chunkInfoList.get(i).peersWithChunk.get(j));
+        }
+    }
+    for (int i = 0; i < downloadSwarmPeers.size(); ++i) {
+        addBitfieldPeer(downloadSwarmPeers.get(i));
+    }
+    for (auto it = peerBitfields.begin(); it != peerBitfields.end(); ++it) {
+        PeerBitfield& state = it->second;
+        if (state.failed || state.complete || state.querying) continue;
+        string request = "get_bitfield " + downloadFileName + " " + downloadFileSha1;
+        if (state.responsive) {
+            request += " since=" + to_string(state.seq);
+        }
+        request += "\n";
+        if (startControlExchange(state.peer, request, false)) {
+            state.querying = true;
+        } else {
+            state.failed = true;
+        }
+    }
+}
+
+// Step the exchanges poll found ready, then apply the ones that finished and drop the ones that
+// failed or ran out of time. A peer that does not answer get_bitfield is not asked again during this
+// download, but keeps the bitfield it last reported. Adds the peers learned by gossip to `learned`
+// and returns the number of finished get_bitfield exchanges.
+int finishControlExchanges(const ArrayList<pollfd>& pollFds, int& learned) {
+    long long now = nowMicros();
+    int finished = 0;
+    for (int i = controlExchanges.size() - 1; i >= 0; --i) {
+        ControlExchange* exchange = controlExchanges.get(i);
+        int result = 0;
+        if (exchange->pollIndex >= 0 && exchange->pollIndex < pollFds.size() && pollFds.get(exchange->pollIndex).revents != 0) {
+            result = stepControlExchange(exchange);
+        }
+        if (result == 0 && now > exchange->deadline) {
+            result = -1;
+        }
+        if (result == 0) continue;
+        if (exchange->getPeers) {
+            learned += result == 1 ? applyPeersReply(exchange->reply) : 0;
+        } else {
+            auto it = peerBitfields.find(exchange->peer.userId);
+            if (it != peerBitfields.end()) {
+                it->second.querying = false;
+                if (result != 1 || !applyBitfieldReply(it->second, exchange->reply)) {
+                    it->second.failed = true;
+                }
+            }
+            finished++;
+        }
+        close(exchange->sock);
+        delete exchange;
+        controlExchanges.removeAt(i);
+    }
+    return finished;
+}
+
+// Wait for the exchanges in flight; used before the first chunk transfer starts
+void runControlExchanges() {
+    while (!controlExchanges.isEmpty()) {
+        ArrayList<pollfd> pollFds;
+        int timeoutMs = BITFIELD_TIMEOUT_MS;
+        pollControlExchanges(pollFds, nowMicros(), timeoutMs);
+        if (poll(&pollFds.get(0), pollFds.size(), timeoutMs) < 0 && errno != EINTR) {
+            break;
+        }
+        int learned = 0;
+        finishControlExchanges(pollFds, learned);
+    }
+}
+
+// Abandon the exchanges still in flight when a download ends
+void closeControlExchanges() {
+    for (int i = 0; i < controlExchanges.size(); ++i) {
+        close(controlExchanges.get(i)->sock);
+        delete controlExchanges.get(i);
+    }
+    controlExchanges.clear();
+}
+
+// Number of get_peers exchanges still in flight
+int pendingPeerExchanges() {
+    int pending = 0;
+    for (int i = 0; i < controlExchanges.size(); ++i) {
+        pending += controlExchanges.get(i)->getPeers;
+    }
+    return pending;
+}
+
+// Gossip with up to PEX_FANOUT bitfield peers of the current download (taking turns across
+// rounds): announce ourselves and ask for the peers they know. Their replies are added by
+// finishControlExchanges. Peers remembered from earlier successful exchanges for this file are
+// added right away; returns the number of those that were new.
+int startPeerExchange() {
+    static int pexCursor = 0;
+    if (!downloadMerkleRoot.empty()) {
+        return 0;
+    }
+    int learned = 0;
+    pthread_mutex_lock(&pexMutex);
+    ArrayList<PeerInfo> known = knownSwarmPeers[downloadFileSha1];
+    pthread_mutex_unlock(&pexMutex);
+    for (int i = 0; i < known.size(); ++i) {
+        learned += addBitfieldPeer(known.get(i));
+    }
+
+    ArrayList<PeerInfo> targets;
+    for (auto it = peerBitfields.begin(); it != peerBitfields.end(); ++it) {
+        if (it->second.responsive && !it->second.failed) targets.add(it->second.peer);
+    }
+    string request = "get_peers " + downloadFileSha1 + " " + loggedInUser() + " " + clientListenIp + " " +
+                     to_string(clientListenPort) + "\n";
+    for (int i = 0; i < targets.size() && i < PEX_FANOUT; ++i) {
+        startControlExchange(targets.get((pexCursor + i) % targets.size()), request, true);
+    }
+    pexCursor += PEX_FANOUT;
+    return learned;
+}
+
+// --- Peer Health Reporting Functions ---
+// Downloads tally how each peer's chunk transfers went; the tallies and our own upload load go
+// to the tracker in one report_health line every HEALTH_REPORT_INTERVAL_MS (and after each
+// download), so the tracker can rank busy or failing peers last when answering download_info.
+
+void notePeerSuccess(const string& userId, size_t bytes, long long micros) {
+    pthread_mutex_lock(&healthMutex);
+    PeerHealth& health = peerHealth[userId];
+    health.succeeded++;
+    health.bytes += bytes;
+    health.micros += micros;
+    pthread_mutex_unlock(&healthMutex);
+}
+
+void notePeerFailure(const string& userId, bool timedOut) {
+    pthread_mutex_lock(&healthMutex);
+    PeerHealth& health = peerHealth[userId];
+    if (timedOut) {
+        health.timedOut++;
+    } else {
+        health.failed++;
+    }
+    pthread_mutex_unlock(&healthMutex);
+}
+
+// Downloaders our peer server is currently serving
+int currentUploadLoad() {
+    long long now = nowMicros();
+    int load = 0;
+    pthread_mutex_lock(&slotMutex);
+    for (auto& entry : uploadSlots) {
+        if (entry.second.unchoked && now - entry.second.lastRequest <= UPLOAD_IDLE_MS * 1000LL) load++;
+    }
+    pthread_mutex_unlock(&slotMutex);
+    return load;
+}
+
+// Send the outcomes gathered since the last report. Unless forced, nothing is sent before the
+// report interval has passed or when there is nothing new to say. Caller holds trackerMutex.
+bool sendHealthReportLocked(bool force) {
+    if (loggedInUser().empty() || trackerSocket == -1) return false;
+    long long now = nowMicros();
+    if (!force && now - lastHealthReport < HEALTH_REPORT_INTERVAL_MS * 1000LL) return false;
+
+    int load = currentUploadLoad();
+    pthread_mutex_lock(&healthMutex);
+    if (peerHealth.empty() && load == lastReportedLoad) {
+        pthread_mutex_unlock(&healthMutex);
+        return false;
+    }
+    string entries;
+    for (auto& entry : peerHealth) {
+        const PeerHealth& health = entry.second;
+        long kbps = health.micros > 0 ? (long)(health.bytes * 1000 / health.micros) : 0; // KB/s
+        entries += " " + entry.first + " " + to_string(health.succeeded) + " " + to_string(health.failed) + " " +
+                   to_string(health.timedOut) + " " + to_string(kbps);
+    }
+    string report = "report_health " + to_string(load) + " " + to_string(peerHealth.size()) + entries + "\n";
+    peerHealth.clear();
+    pthread_mutex_unlock(&healthMutex);
+    lastHealthReport = now;
+    lastReportedLoad = load;
+
+    string responseStr;
+    if (!sendAll(trackerSocket, report.c_str(), report.length()) || recvTrackerResponse(responseStr) <= 0) {
+        alertPrompt("Failed to send health report to tracker.", false);
+        return false;
+    }
+    return true;
+}
+
+// Background reporter: lets seeders that sit at the prompt keep their upload load current
+void* healthReporter(void* arg) {
+    (void)arg;
+    while (clientRunning) {
+        usleep(200 * 1000);
+        // The report interval is checked under trackerMutex, which guards lastHealthReport
+        pthread_mutex_lock(&trackerMutex);
+        if (clientRunning) sendHealthReportLocked(false);
+        pthread_mutex_unlock(&trackerMutex);
+    }
+    return NULL;
+}
+
+// --- Download Engine ---
+// Each chunk transfer is a small state machine driven by a single poll() loop, so an
+// in-flight chunk costs a socket and its receive buffer instead of a thread stack.
+enum class TransferState {
+    CONNECTING,
+    SENDING_REQUEST,
+    READING_HEADER,
+    READING_BODY
+};
+
+struct ChunkTransfer {
+    int listIndex;      // Index into chunkInfoList
+    int peerCursor;     // Index of the peer currently tried in peersWithChunk
+    PeerInfo peer;
+    PeerShaper* shaper; // Held from startTransfer until closeTransfer
+    int sock;
+    TransferState state;
+    bool framed;
+    string request;
+    size_t requestSent;
+    string header;
+    string codec;
+    string proof;       // Merkle proof sent with the chunk header
+    size_t wireSize;
+    char* wireBuffer;
+    size_t received;
+    long long resumeAt; // Bandwidth shaping: do not read again before this time
+    long long deadline; // The current step fails over to the next peer after this time
+    bool gotFirstByte;
+    long long startedAt; // When the request to the current peer began
+    int pollIndex;      // Slot in this round's pollfd array, -1 if not polled
+    bool waiting;       // Every peer failed; waiting to retry after backoff
+    bool choked;        // A peer choked this chunk during the current pass over its peers
+    bool peerChoked;    // The current peer answered with choked
+    bool chokeWait;     // Waiting only because peers choked it; does not use up retries
+    long long chokedSince; // When peers first choked this chunk, 0 if never
+    long long retryAt;
+    int retries;
+};
+
+// Identical bytes may already exist in a local file; take them from disk instead of the network
+bool takeLocalChunk(const ChunkInfo& chunkInfo) {
+    ChunkLocation location;
+    if (chunkInfo.expectedSha1.empty() || !lookupLocalChunk(chunkInfo.expectedSha1, location) || location.length != (size_t)chunkInfo.length) {
+        return false;
+    }
+    string localData;
+    if (!readLocalChunk(location, chunkInfo.expectedSha1, localData)) {
+        forgetLocalChunk(chunkInfo.expectedSha1); // Stale entry: the file changed since it was indexed
+        return false;
+    }
+    pthread_mutex_lock(&downloadMutex);
+    if (location.filePath == downloadFilePath) {
+        // The output file is truncated before assembly, so keep these bytes in memory
+        chunkData[chunkInfo.chunkIndex] = localData;
+    } else {
+        localChunkSources[chunkInfo.chunkIndex] = location;
+    }
+    markHaveLocked(chunkInfo.chunkIndex);
+    pthread_mutex_unlock(&downloadMutex);
+    cout << "Chunk " << chunkInfo.chunkIndex << " found locally in " << location.filePath << endl;
+    return true;
+}
+
+// Release the socket and buffer of the current attempt
+void closeTransfer(ChunkTransfer* transfer) {
+    if (transfer->sock >= 0) {
+        close(transfer->sock);
+        transfer->sock = -1;
+    }
+    if (transfer->shaper != NULL) {
+        releasePeerShaper(transfer->shaper);
+        transfer->shaper = NULL;
+    }
+    delete[] transfer->wireBuffer;
+    transfer->wireBuffer = NULL;
+}
+
+// Begin a non-blocking connect to the next usable peer; returns false when no peers are left
+bool startTransfer(ChunkTransfer* transfer) {
+    const ChunkInfo& chunkInfo = chunkInfoList.get(transfer->listIndex);
+    for (; transfer->peerCursor < chunkInfo.peersWithChunk.size(); ++transfer->peerCursor) {
+        PeerInfo peer = chunkInfo.peersWithChunk.get(transfer->peerCursor);
+
+        sockaddr_in peerAddr;
+        peerAddr.sin_family = AF_INET;
+        peerAddr.sin_port = htons(peer.port);
+        if (inet_pton(AF_INET, peer.ip.c_str(), &peerAddr.sin_addr) <= 0) {
+            alertPrompt("Invalid peer IP address: " + peer.ip, false);
+            continue;
+        }
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            alertPrompt("Could not create socket to peer", true);
+            continue;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(sock, (sockaddr*)&peerAddr, sizeof(peerAddr)) < 0 && errno != EINPROGRESS) {
+            alertPrompt("Could not connect to peer " + peer.userId, true);
+            close(sock);
+            continue;
+        }
+
+        // Name ourselves and the chunk's availability for the peer's upload slots, offer our codecs
+        // when compression is enabled and ask for a proof on Merkle manifests; any option makes
+        // the reply framed
+        bool compress = compressionEnabled && !localCodecs().empty();
+        string options;
+        string userId = loggedInUser();
+        if (!userId.empty()) {
+            options += " from=" + userId + " avail=" + to_string(chunkInfo.availability);
+        }
+        if (compress) {
+            options += " accept=" + localCodecs();
+        }
+        if (!downloadMerkleRoot.empty()) {
+            options += " proof=1";
+        }
+        transfer->peer = peer;
+        transfer->shaper = acquirePeerShaper(downloadPeers, peer.ip, perPeerDownloadRate);
+        transfer->sock = sock;
+        transfer->state = TransferState::CONNECTING;
+        transfer->framed = !options.empty();
+        transfer->request = "get_chunk " + downloadFileName + " " + to_string(chunkInfo.chunkIndex) + options + "\n";
+        transfer->requestSent = 0;
+        transfer->header.clear();
+        transfer->codec = "raw";
+        transfer->proof.clear();
+        transfer->wireSize = chunkInfo.length;
+        transfer->wireBuffer = NULL;
+        transfer->received = 0;
+        transfer->resumeAt = 0;
+        transfer->deadline = nowMicros() + connectTimeoutMs * 1000;
+        transfer->gotFirstByte = false;
+        transfer->startedAt = nowMicros();
+        transfer->peerChoked = false;
+        return true;
+    }
+    return false;
+}
+
+// Count received bytes against the download limits; returns how long to pause reading
+long long accountReceived(size_t bytes, PeerShaper* shaper) {
+    downloadMeter.add(bytes);
+    shaper->meter.add(bytes);
+    return max(downloadBucket.reserve(bytes), shaper->bucket.reserve(bytes));
+}
+
+// Parse "chunk <codec> <wire_size> [proof=<hex>]" and move any payload bytes that arrived with it into the body
+bool acceptChunkHeader(ChunkTransfer* transfer, size_t newlinePos) {
+    const ChunkInfo& chunkInfo = chunkInfoList.get(transfer->listIndex);
+    string rest = transfer->header.substr(newlinePos + 1);
+    transfer->header.resize(newlinePos);
+
+    string tag;
+    istringstream headerStream(transfer->header);
+    headerStream >> tag >> transfer->codec >> transfer->wireSize;
+    string optionToken;
+    while (headerStream >> optionToken) {
+        if (optionToken.compare(0, 6, "proof=") == 0) {
+            transfer->proof = optionToken.substr(6);
+        }
+    }
+    if (tag == "choked") {
+        cout << "Peer " << transfer->peer.userId << " choked chunk " << chunkInfo.chunkIndex << "." << endl;
+        transfer->choked = transfer->peerChoked = true;
+        return false;
+    }
+    if (tag != "chunk" || transfer->wireSize > 2 * (size_t)chunkInfo.length + BUFFER_SIZE || rest.length() > transfer->wireSize) {
+        alertPrompt("Peer " + transfer->peer.userId + " refused chunk " + to_string(chunkInfo.chunkIndex) + ": " + transfer->header, false);
+        return false;
+    }
+
+    transfer->wireBuffer = new char[transfer->wireSize];
+    memcpy(transfer->wireBuffer, rest.data(), rest.length());
+    transfer->received = rest.length();
+    transfer->state = TransferState::READING_BODY;
+    if (!rest.empty()) {
+        transfer->resumeAt = nowMicros() + accountReceived(rest.length(), transfer->shaper);
+        transfer->deadline = transfer->resumeAt + stallTimeoutMs * 1000;
+    }
+    return true;
+}
+
+// Advance a transfer by one non-blocking step after poll() reported its socket ready.
+// Returns -1 if this attempt failed, 0 while in progress and 1 once the whole payload is received.
+int stepTransfer(ChunkTransfer* transfer) {
+    switch (transfer->state) {
+        case TransferState::CONNECTING: {
+            int error = 0;
+            socklen_t errorLen = sizeof(error);
+            getsockopt(transfer->sock, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+            if (error != 0) {
+                errno = error;
+                alertPrompt("Could not connect to peer " + transfer->peer.userId, true);
+                return -1;
+            }
+            transfer->state = TransferState::SENDING_REQUEST;
+            transfer->deadline = nowMicros() + firstByteTimeoutMs * 1000;
+            return 0;
+        }
+        case TransferState::SENDING_REQUEST: {
+            ssize_t sent = send(transfer->sock, transfer->request.c_str() + transfer->requestSent,
+                                transfer->request.length() - transfer->requestSent, 0);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            if (sent <= 0) {
+                alertPrompt("Failed to send get_chunk command to peer " + transfer->peer.userId, false);
+                return -1;
+            }
+            transfer->requestSent += sent;
+            if (transfer->requestSent == transfer->request.length()) {
+                if (transfer->framed) {
+                    transfer->state = TransferState::READING_HEADER;
+                } else {
+                    transfer->wireBuffer = new char[transfer->wireSize];
+                    transfer->state = TransferState::READING_BODY;
+                }
+            }
+            return 0;
+        }
+        case TransferState::READING_HEADER: {
+            char buffer[BUFFER_SIZE];
+            ssize_t bytesReceived = recv(transfer->sock, buffer, BUFFER_SIZE, 0);
+            if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            if (bytesReceived <= 0) {
+                alertPrompt("Failed to receive chunk header from peer " + transfer->peer.userId, false);
+                return -1;
+            }
+            transfer->header.append(buffer, bytesReceived);
+            transfer->gotFirstByte = true;
+            transfer->deadline = nowMicros() + stallTimeoutMs * 1000;
+            size_t newlinePos = transfer->header.find('\n');
+            if (newlinePos == string::npos) {
+                return transfer->header.length() > BUFFER_SIZE ? -1 : 0;
+            }
+            if (!acceptChunkHeader(transfer, newlinePos)) return -1;
+            return transfer->received == transfer->wireSize ? 1 : 0;
+        }
+        case TransferState::READING_BODY: {
+            size_t wanted = min((size_t)RATE_SLICE, transfer->wireSize - transfer->received);
+            ssize_t bytesReceived = recv(transfer->sock, transfer->wireBuffer + transfer->received, wanted, 0);
+            if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            if (bytesReceived < 0) {
+                alertPrompt("Failed to receive chunk from peer " + transfer->peer.userId, true);
+                return -1;
+            } else if (bytesReceived == 0) {
+                alertPrompt("Connection closed by peer " + transfer->peer.userId + " before receiving full chunk.", false);
+                return -1;
+            }
+            transfer->received += bytesReceived;
+            transfer->gotFirstByte = true;
+            long long waitMicros = accountReceived(bytesReceived, transfer->shaper);
+            long long now = nowMicros();
+            if (waitMicros > 0) {
+                transfer->resumeAt = now + waitMicros;
+            }
+            // Time spent paused by bandwidth shaping does not count as a stall
+            transfer->deadline = max(now, transfer->resumeAt) + stallTimeoutMs * 1000;
+            return transfer->received == transfer->wireSize ? 1 : 0;
+        }
+    }
+    return -1;
+}
+
+// Decode and verify a fully received chunk; stores it in chunkData on success
+bool completeTransfer(ChunkTransfer* transfer) {
+    const ChunkInfo& chunkInfo = chunkInfoList.get(transfer->listIndex);
+    int chunkIndex = chunkInfo.chunkIndex;
+    size_t expectedChunkSize = chunkInfo.length;
+
+    // Debugging statements
+    cout << "Downloading chunk " << chunkIndex << " from peer " << transfer->peer.userId << " (" << transfer->codec << ")" << endl;
+    cout << "Expected wire size: " << transfer->wireSize << ", Total bytes received: " << transfer->received << endl;
+
+    // Decompress if needed; the SHA1 is always checked on the decompressed bytes
+    string chunk;
+    if (transfer->codec == "raw" && transfer->received == expectedChunkSize) {
+        chunk.assign(transfer->wireBuffer, transfer->received);
+    } else {
+        chunk.resize(expectedChunkSize);
+        if (!decompressChunk(transfer->codec, transfer->wireBuffer, transfer->received, &chunk[0], expectedChunkSize)) {
+            alertPrompt("Failed to decode " + transfer->codec + " chunk " + to_string(chunkIndex) + " from peer " + transfer->peer.userId, false);
+            return false;
+        }
+    }
+
+    // Compute SHA1 of received chunk
+    string receivedChunkSha1 = computeSHA1(chunk.data(), chunk.length());
+
+    cout << "Computed SHA1 of received chunk: " << receivedChunkSha1 << endl;
+
+    // Merkle manifests: the chunk and its proof must hash up to the root from the tracker
+    if (!downloadMerkleRoot.empty()) {
+        if (merkleRootFromProof(receivedChunkSha1, chunkIndex, totalChunks, transfer->proof) != downloadMerkleRoot) {
+            alertPrompt("Merkle proof mismatch for chunk " + to_string(chunkIndex) + " from peer " + transfer->peer.userId, false);
+            return false;
+        }
+        chunkInfoList.get(transfer->listIndex).expectedSha1 = receivedChunkSha1;
+    }
+    cout << "Expected SHA1 of chunk: " << chunkInfo.expectedSha1 << endl;
+
+    if (receivedChunkSha1 != chunkInfo.expectedSha1) {
+        alertPrompt("SHA1 mismatch for chunk " + to_string(chunkIndex) + " from peer " + transfer->peer.userId, false);
+        return false;
+    }
+
+    pthread_mutex_lock(&downloadMutex);
+    chunkData[chunkIndex] = chunk;
+    markHaveLocked(chunkIndex);
+    pthread_mutex_unlock(&downloadMutex);
+
+    cout << "Successfully downloaded chunk " << chunkIndex << " from peer " << transfer->peer.userId << endl;
+    notePeerSuccess(transfer->peer.userId, transfer->received, nowMicros() - transfer->startedAt);
+    return true;
+}
+
+// Record that a transfer missed its deadline, charging the peer by the step that expired
+void recordTimeout(ChunkTransfer* transfer) {
+    PeerTimeouts& counts = peerTimeouts[transfer->peer.userId];
+    string step;
+    if (transfer->state == TransferState::CONNECTING) {
+        counts.connect++;
+        step = "connect";
+    } else if (!transfer->gotFirstByte) {
+        counts.firstByte++;
+        step = "first byte";
+    } else {
+        counts.stall++;
+        step = "stalled transfer";
+    }
+    alertPrompt("Timed out (" + step + ") fetching chunk " + to_string(chunkInfoList.get(transfer->listIndex).chunkIndex) +
+                " from peer " + transfer->peer.userId, false);
+    notePeerFailure(transfer->peer.userId, true);
+}
+
+void printTimeouts() {
+    cout << "Timeouts: connect " << connectTimeoutMs << " ms, first byte " << firstByteTimeoutMs
+         << " ms, stall " << stallTimeoutMs << " ms" << endl;
+    for (auto& entry : peerTimeouts) {
+        cout << "  " << entry.first << ": " << entry.second.connect << " connect, " << entry.second.firstByte
+             << " first byte, " << entry.second.stall << " stall" << endl;
+    }
+}
+
+// Jittered exponential backoff: a random delay between half and all of base * 2^retries
+long long retryDelayMicros(int retries) {
+    long long delayMs = min((long long)RETRY_MAX_DELAY_MS, (long long)RETRY_BASE_DELAY_MS << min(retries, 16));
+    return (delayMs / 2 + rand() % (delayMs / 2 + 1)) * 1000;
+}
+
+// Called when a transfer has run out of peers: park it until its backoff expires.
+// Returns false once the chunk has used up its retries.
+bool scheduleRetry(ChunkTransfer* transfer) {
+    int chunkIndex = chunkInfoList.get(transfer->listIndex).chunkIndex;
+    long long now = nowMicros();
+    if (transfer->choked && transfer->chokedSince == 0) {
+        transfer->chokedSince = now;
+    }
+    // Choking peers unchoke on their own schedule, so waiting for them does not use up retries,
+    // unless they have kept the chunk choked for MAX_CHOKE_WAIT_MS
+    transfer->chokeWait = transfer->choked && now - transfer->chokedSince < MAX_CHOKE_WAIT_MS * 1000LL;
+    transfer->choked = false;
+    if (transfer->chokeWait) {
+        long long delay = (CHOKE_RETRY_MS / 2 + rand() % (CHOKE_RETRY_MS / 2 + 1)) * 1000LL;
+        transfer->waiting = true;
+        transfer->retryAt = now + delay;
+        transfer->deadline = transfer->retryAt;
+        cout << "Peers of chunk " << chunkIndex << " are choking us, retry in " << delay / 1000 << " ms" << endl;
+        return true;
+    }
+    if (transfer->retries >= MAX_CHUNK_RETRIES) {
+        alertPrompt("Failed to download chunk " + to_string(chunkIndex) + " after " + to_string(transfer->retries) + " retries", false);
+        return false;
+    }
+    long long delay = retryDelayMicros(transfer->retries);
+    transfer->retries++;
+    transfer->waiting = true;
+    transfer->retryAt = nowMicros() + delay;
+    transfer->deadline = transfer->retryAt;
+    cout << "No working peer for chunk " << chunkIndex << ", retry " << transfer->retries << " in " << delay / 1000 << " ms" << endl;
+    return true;
+}
+
+// Feed the file hash with every chunk that is now contiguous with the bytes hashed so far.
+// fileOrder lists chunkInfoList positions sorted by offset; cursor is the next one to hash.
+void hashContiguousChunks(const ArrayList<int>& fileOrder, int& cursor, StreamingSha1& fileHash) {
+    while (cursor < fileOrder.size()) {
+        const ChunkInfo& chunk = chunkInfoList.get(fileOrder.get(cursor));
+        auto it = chunkData.find(chunk.chunkIndex);
+        if (it != chunkData.end()) {
+            fileHash.update(it->second.data(), it->second.length());
+        } else {
+            // Chunks reused from local files are read back from their source, not the output file
+            auto localIt = localChunkSources.find(chunk.chunkIndex);
+            if (localIt == localChunkSources.end()) {
+                return;
+            }
+            string data(localIt->second.length, '\0');
+            int fd = open(localIt->second.filePath.c_str(), O_RDONLY);
+            ssize_t bytesRead = fd < 0 ? -1 : pread(fd, &data[0], data.length(), localIt->second.offset);
+            if (fd >= 0) close(fd);
+            if (bytesRead != (ssize_t)data.length()) {
+                return; // Leaves the stream incomplete, so verification fails
+            }
+            fileHash.update(data.data(), data.length());
+        }
+        cursor++;
+    }
+}
+
+// Streaming downloads publish the length of the usable prefix in <output>.watermark
+void publishWatermark() {
+    string watermarkPath = downloadFilePath + ".watermark";
+    string contents = to_string(downloadWatermark) + "\n";
+    int fd = open(watermarkPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, contents.data(), contents.length()) != (ssize_t)contents.length()) {
+        alertPrompt("Failed to update " + watermarkPath, true);
+    }
+    if (fd >= 0) close(fd);
+}
+
+// Write every chunk that extends the contiguous prefix of the output file and release its buffer.
+// Returns false if a write fails; the prefix then stops growing and assembly reports the chunk.
+bool writeContiguousChunks(const ArrayList<int>& fileOrder, int& cursor, int outFd) {
+    while (cursor < fileOrder.size()) {
+        const ChunkInfo& chunk = chunkInfoList.get(fileOrder.get(cursor));
+        auto it = chunkData.find(chunk.chunkIndex);
+        auto localIt = localChunkSources.find(chunk.chunkIndex);
+        if (it != chunkData.end()) {
+            if (pwrite(outFd, it->second.data(), it->second.length(), chunk.offset) != (ssize_t)it->second.length()) {
+                alertPrompt("Failed to write to output file: " + downloadFilePath, true);
+                return false;
+            }
+        } else if (localIt != localChunkSources.end()) {
+            if (cloneOrCopyRange(localIt->second, outFd, chunk.offset) < 0) {
+                return false;
+            }
+        } else {
+            return true;
+        }
+        // Peers reading the chunk for get_chunk find it either in memory or below the watermark
+        pthread_mutex_lock(&downloadMutex);
+        downloadWatermark = chunk.offset + chunk.length;
+        if (it != chunkData.end()) {
+            chunkData.erase(it);
+        }
+        pthread_mutex_unlock(&downloadMutex);
+        cursor++;
+    }
+    return true;
+}
+
+// Next chunkInfoList position to fetch: in streaming mode the first unstarted chunk within the
+// window past the written prefix, otherwise the next unstarted chunk in rarest-first order
+int nextChunkToFetch(ArrayList<bool>& started, int& rarestCursor, const ArrayList<int>& fileOrder, int prefixCursor, int window) {
+    for (int pos = prefixCursor; pos < fileOrder.size() && pos < prefixCursor + window; ++pos) {
+        if (!started.get(fileOrder.get(pos))) {
+            started.get(fileOrder.get(pos)) = true;
+            return fileOrder.get(pos);
+        }
+    }
+    while (rarestCursor < started.size() && started.get(rarestCursor)) {
+        rarestCursor++;
+    }
+    if (rarestCursor == started.size()) {
+        return -1;
+    }
+    started.get(rarestCursor) = true;
+    return rarestCursor++;
+}
+
+// Stripe of a chunk of the current erasure-coded download
+int stripeOf(int chunkIndex) {
+    const ErasureLayout& erasure = downloadErasure;
+    return chunkIndex < erasure.dataChunks ? chunkIndex / erasure.dataShards : (chunkIndex - erasure.dataChunks) / erasure.parityShards;
+}
+
+// Chunk index at a stripe position: data chunks first, then the stripe's parity chunks
+int stripeChunkIndex(int stripe, int position) {
+    const ErasureLayout& erasure = downloadErasure;
+    return position < erasure.dataShards ? stripe * erasure.dataShards + position
+                                         : erasure.dataChunks + stripe * erasure.parityShards + position - erasure.dataShards;
+}
+
+// Once any dataShards chunks of a stripe are at hand, decode its missing data chunks into chunkData.
+// Data positions past the end of the file count as zero chunks, and on a streaming download data
+// chunks already written below the watermark are read back from streamFd. Returns true when every
+// data chunk of the stripe is available.
+bool rebuildStripe(int stripe, const map<int, int>& positionOf, int streamFd, int& rebuiltChunks) {
+    int k = downloadErasure.dataShards;
+    int m = downloadErasure.parityShards;
+    long chunkSize = downloadChunkSize;
+    ArrayList<int> present; // Stripe positions used for decoding
+    ArrayList<int> missing; // Data positions to rebuild
+    auto written = [&](int chunkIndex) {
+        if (streamFd < 0 || chunkIndex >= downloadErasure.dataChunks) return false;
+        const ChunkInfo& chunkInfo = chunkInfoList.get(positionOf.at(chunkIndex));
+        return chunkInfo.offset + chunkInfo.length <= downloadWatermark;
+    };
+    for (int j = 0; j < k + m; ++j) {
+        int chunkIndex = stripeChunkIndex(stripe, j);
+        bool available = (j < k && chunkIndex >= downloadErasure.dataChunks) || chunkData.count(chunkIndex) > 0 ||
+                         localChunkSources.count(chunkIndex) > 0 || (j < k && written(chunkIndex));
+        if (available && present.size() < k) {
+            present.add(j);
+        } else if (!available && j < k) {
+            missing.add(j);
+        }
+    }
+    if (missing.isEmpty()) return true;
+    if (present.size() < k) return false;
+
+    // Zero-padded copies of the k chunks used for decoding
+    long long decodeStart = nowMicros();
+    string shards(k * chunkSize, '\0');
+    string rebuilt(missing.size() * chunkSize, '\0');
+    const unsigned char* shardPtrs[255];
+    unsigned char* rebuiltPtrs[255];
+    for (int i = 0; i < k; ++i) {
+        int chunkIndex = stripeChunkIndex(stripe, present.get(i));
+        shardPtrs[i] = (const unsigned char*)&shards[i * chunkSize];
+        if (present.get(i) < k && chunkIndex >= downloadErasure.dataChunks) continue;
+        string localData;
+        const ChunkInfo& chunkInfo = chunkInfoList.get(positionOf.at(chunkIndex));
+        auto it = chunkData.find(chunkIndex);
+        if (it == chunkData.end() && localChunkSources.count(chunkIndex) == 0 && written(chunkIndex)) {
+            localData.resize(chunkInfo.length);
+            if (pread(streamFd, &localData[0], localData.length(), chunkInfo.offset) != (ssize_t)localData.length()) {
+                alertPrompt("Failed to read back chunk " + to_string(chunkIndex) + " from " + downloadFilePath, true);
+                return false;
+            }
+        } else if (it == chunkData.end() && !readLocalChunk(localChunkSources[chunkIndex], chunkInfo.expectedSha1, localData)) {
+            return false;
+        }
+        const string& data = it != chunkData.end() ? it->second : localData;
+        memcpy(&shards[i * chunkSize], data.data(), data.length());
+    }
+    for (int i = 0; i < missing.size(); ++i) {
+        rebuiltPtrs[i] = (unsigned char*)&rebuilt[i * chunkSize];
+    }
+    decodeStripe(k, &present.get(0), shardPtrs, &missing.get(0), missing.size(), rebuiltPtrs, chunkSize);
+
+    // Rebuilt chunks are checked against the manifest like downloaded ones
+    for (int i = 0; i < missing.size(); ++i) {
+        int chunkIndex = stripeChunkIndex(stripe, missing.get(i));
+        const ChunkInfo& chunkInfo = chunkInfoList.get(positionOf.at(chunkIndex));
+        string data = rebuilt.substr(i * chunkSize, chunkInfo.length);
+        if (computeSHA1(data.data(), data.length()) != chunkInfo.expectedSha1) {
+            alertPrompt("SHA1 mismatch for chunk " + to_string(chunkIndex) + " rebuilt from parity", false);
+            return false;
+        }
+        pthread_mutex_lock(&downloadMutex);
+        chunkData[chunkIndex] = data;
+        markHaveLocked(chunkIndex);
+        pthread_mutex_unlock(&downloadMutex);
+        rebuiltChunks++;
+    }
+    cout << "Rebuilt " << missing.size() << " chunks of stripe " << stripe << " from parity in "
+         << (nowMicros() - decodeStart) / 1000 << " ms." << endl;
+    return true;
+}
+
+// Fetch every chunk in chunkInfoList, keeping up to MAX_INFLIGHT_TRANSFERS transfers in flight.
+// With streamVerify, returns the SHA1 of the whole file hashed in order while chunks arrive
+// (empty if some chunk is missing); otherwise returns an empty string.
+// With a streamFd, chunks near the written prefix are fetched first and the prefix is written
+// to streamFd in place as it grows, advancing downloadWatermark.
+// Erasure-coded downloads fetch the data chunks and use parity chunks only to finish a stripe:
+// when one of its data chunks fails, or to race a data chunk that is retrying once nothing else
+// is left to start. A stripe is complete as soon as any dataShards of its chunks are at hand.
+// Peer lists start from the tracker and follow the peers' bitfields and have-updates from then on.
+string runDownloadEngine(bool streamVerify, int streamFd) {
+    long long engineStart = nowMicros();
+
+    // Exchange bitfields with every known peer and order chunks rarest-first by live availability
+    peerBitfields.clear();
+    startBitfieldSync();
+    runControlExchanges();
+    applyPeerBitfields();
+    auto countBitfieldPeers = []() {
+        int responsive = 0;
+        for (auto it = peerBitfields.begin(); it != peerBitfields.end(); ++it) {
+            responsive += it->second.responsive;
+        }
+        return responsive;
+    };
+    int bitfieldPeers = countBitfieldPeers();
+    if (!peerBitfields.empty()) {
+        cout << "Exchanged bitfields with " << bitfieldPeers << " of " << peerBitfields.size() << " peers in "
+             << (nowMicros() - engineStart) / 1000 << " ms." << endl;
+    }
+    chunkInfoList.sort([](const ChunkInfo& a, const ChunkInfo& b) -> bool {
+        return a.availability < b.availability;
+    });
+    long long lastBitfieldPoll = nowMicros();
+    long long lastPeerExchange = 0;
+
+    long long hashMicros = 0;
+    StreamingSha1 fileHash;
+    ArrayList<int> fileOrder;
+    int hashCursor = 0;
+    bool erasure = downloadErasure.dataShards > 0;
+    map<int, int> positionOf; // Chunk index -> chunkInfoList position
+    for (int i = 0; i < chunkInfoList.size(); ++i) {
+        positionOf[chunkInfoList.get(i).chunkIndex] = i;
+        if (!chunkInfoList.get(i).parity) {
+            fileOrder.add(i);
+        }
+    }
+    int stripeCount = erasure ? (downloadErasure.dataChunks + downloadErasure.dataShards - 1) / downloadErasure.dataShards : 0;
+    ArrayList<bool> stripeDone;
+    ArrayList<bool> parityRequested;
+    for (int i = 0; i < stripeCount; ++i) {
+        stripeDone.add(false);
+        parityRequested.add(false);
+    }
+    ArrayList<int> pendingParity; // chunkInfoList positions of parity chunks to start
+    int rebuiltChunks = 0, skippedChunks = 0;
+    // Sort positions by chunk offset (chunkInfoList itself is in rarest-first order)
+    if (!fileOrder.isEmpty()) {
+        std::sort(&fileOrder.get(0), &fileOrder.get(0) + fileOrder.size(), [](int a, int b) {
+            return chunkInfoList.get(a).offset < chunkInfoList.get(b).offset;
+        });
+    }
+    ArrayList<ChunkTransfer*> active;
+    ArrayList<bool> started;
+    for (int i = 0; i < chunkInfoList.size(); ++i) {
+        started.add(chunkInfoList.get(i).parity); // Parity chunks are only started on demand
+    }
+    int rarestCursor = 0, startedChunks = 0, writeCursor = 0;
+    bool streamWriteFailed = false;
+    int window = streamFd >= 0 ? STREAM_WINDOW_CHUNKS : 0;
+    downloadWatermark = 0;
+    long long firstByteAt = 0;
+    int fetchedChunks = 0, failedChunks = 0, peakInflight = 0, refreshes = 0, peerExchanges = 0;
+    long long lastRefresh = engineStart;
+
+    // Queue the parity chunks of a stripe that cannot be finished from its data chunks alone
+    auto requestParity = [&](int stripe) {
+        if (stripeDone.get(stripe) || parityRequested.get(stripe)) return;
+        parityRequested.get(stripe) = true;
+        for (int r = 0; r < downloadErasure.parityShards; ++r) {
+            auto it = positionOf.find(stripeChunkIndex(stripe, downloadErasure.dataShards + r));
+            if (it != positionOf.end()) pendingParity.add(it->second);
+        }
+    };
+    auto chunkFailed = [&](int listIndex) {
+        failedChunks++;
+        if (erasure) requestParity(stripeOf(chunkInfoList.get(listIndex).chunkIndex));
+    };
+    auto chunkArrived = [&](int listIndex) {
+        int stripe = erasure ? stripeOf(chunkInfoList.get(listIndex).chunkIndex) : -1;
+        if (erasure && !stripeDone.get(stripe) && rebuildStripe(stripe, positionOf, streamFd, rebuiltChunks)) {
+            stripeDone.get(stripe) = true;
+        }
+    };
+
+    while (startedChunks < fileOrder.size() || !pendingParity.isEmpty() || !active.isEmpty()) {
+        // Top up the in-flight set
+        while ((startedChunks < fileOrder.size() || !pendingParity.isEmpty()) && active.size() < MAX_INFLIGHT_TRANSFERS) {
+            int listIndex;
+            if (!pendingParity.isEmpty()) {
+                listIndex = pendingParity.get(pendingParity.size() - 1);
+                pendingParity.removeAt(pendingParity.size() - 1);
+            } else {
+                listIndex = nextChunkToFetch(started, rarestCursor, fileOrder, writeCursor, window);
+                startedChunks++;
+            }
+            if (erasure && stripeDone.get(stripeOf(chunkInfoList.get(listIndex).chunkIndex))) {
+                skippedChunks++;
+                continue;
+            }
+            if (takeLocalChunk(chunkInfoList.get(listIndex))) {
+                chunkArrived(listIndex);
+                continue;
+            }
+            ChunkTransfer* transfer = new ChunkTransfer();
+            transfer->listIndex = listIndex;
+            transfer->peerCursor = 0;
+            transfer->sock = -1;
+            transfer->shaper = NULL;
+            transfer->wireBuffer = NULL;
+            transfer->waiting = false;
+            transfer->choked = transfer->chokeWait = false;
+            transfer->chokedSince = 0;
+            transfer->retries = 0;
+            if (!startTransfer(transfer) && !scheduleRetry(transfer)) {
+                chunkFailed(listIndex);
+                delete transfer;
+                continue;
+            }
+            active.add(transfer);
+        }
+        peakInflight = max(peakInflight, active.size());
+        if (active.isEmpty()) {
+            break;
+        }
+
+        // Follow the peers' have-updates and gossip for new peers. The tracker is re-queried only when
+        // a chunk has run out of peers and gossip found nobody new, or periodically on long downloads
+        // when no peer exchanges bitfields.
+        long long now = nowMicros();
+        bool anyWaiting = false;
+        for (int i = 0; i < active.size() && !anyWaiting; ++i) {
+            anyWaiting = active.get(i)->waiting && !active.get(i)->chokeWait;
+        }
+        bool gossiping = pendingPeerExchanges() > 0;
+        if (bitfieldPeers > 0 && !gossiping && (now - lastPeerExchange >= PEX_INTERVAL_MS * 1000LL ||
+                                                (anyWaiting && now - lastPeerExchange >= PEER_REFRESH_MIN_GAP_MS * 1000LL))) {
+            int learned = startPeerExchange();
+            gossiping = pendingPeerExchanges() > 0;
+            lastPeerExchange = nowMicros();
+            peerExchanges++;
+            if (learned > 0) {
+                cout << "Peer exchange: learned " << learned << " new peers." << endl;
+                lastBitfieldPoll = 0; // Ask the new peers for bitfields right away
+                if (anyWaiting) lastRefresh = lastPeerExchange;
+            }
+        }
+        if (bitfieldPeers > 0 && now - lastBitfieldPoll >= BITFIELD_POLL_INTERVAL_MS * 1000LL) {
+            startBitfieldSync();
+            lastBitfieldPoll = nowMicros();
+        }
+        if ((anyWaiting && !gossiping && now - lastRefresh >= PEER_REFRESH_MIN_GAP_MS * 1000LL) ||
+            (bitfieldPeers == 0 && now - lastRefresh >= PEER_REFRESH_INTERVAL_MS * 1000LL)) {
+            int changed = refreshChunkPeers();
+            lastRefresh = nowMicros();
+            refreshes++;
+            if (changed >= 0) {
+                changed = max(changed, applyPeerBitfields()); // Keep the bitfield peers, and meet new ones
+                startBitfieldSync();
+                cout << "Refreshed peers from tracker: " << changed << " chunks have new peer lists." << endl;
+            }
+        }
+
+        // Poll every transfer that is not paused by bandwidth shaping, waking up for the nearest deadline
+        ArrayList<pollfd> pollFds;
+        now = nowMicros();
+        int timeoutMs = 1000;
+        for (int i = 0; i < active.size(); ++i) {
+            ChunkTransfer* transfer = active.get(i);
+            timeoutMs = min(timeoutMs, (int)max(0LL, (transfer->deadline - now + 999) / 1000));
+            transfer->pollIndex = -1;
+            if (transfer->waiting) {
+                continue; // Woken by its deadline, which is the retry time
+            }
+            if (transfer->resumeAt > now) {
+                timeoutMs = min(timeoutMs, (int)((transfer->resumeAt - now + 999) / 1000));
+                continue;
+            }
+            pollfd pfd;
+            pfd.fd = transfer->sock;
+            bool writing = transfer->state == TransferState::CONNECTING || transfer->state == TransferState::SENDING_REQUEST;
+            pfd.events = writing ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+            transfer->pollIndex = pollFds.size();
+            pollFds.add(pfd);
+        }
+        pollControlExchanges(pollFds, now, timeoutMs);
+        if (poll(pollFds.isEmpty() ? NULL : &pollFds.get(0), pollFds.size(), timeoutMs) < 0 && errno != EINTR) {
+            alertPrompt("poll failed in download engine", true);
+            break;
+        }
+
+        // Bitfield replies change the peer lists that transfers fail over to or restart with. Peers
+        // learned by gossip are asked for bitfields right away, and put off the tracker re-query.
+        int learned = 0;
+        int bitfieldReplies = finishControlExchanges(pollFds, learned);
+        if (learned > 0) {
+            cout << "Peer exchange: learned " << learned << " new peers." << endl;
+            lastBitfieldPoll = 0;
+            lastRefresh = nowMicros();
+        }
+        if (bitfieldReplies > 0) {
+            int changed = applyPeerBitfields();
+            bitfieldPeers = countBitfieldPeers();
+            if (changed > 0) {
+                cout << "Have-updates from peers: " << changed << " chunks have new peer lists." << endl;
+            }
+        }
+
+        now = nowMicros();
+        for (int i = 0; i < active.size(); ++i) {
+            ChunkTransfer* transfer = active.get(i);
+            int result = 0;
+            bool timedOut = false;
+            if (transfer->waiting) {
+                // Backoff expired: start over with the (possibly refreshed) peer list
+                if (now < transfer->retryAt) continue;
+                transfer->waiting = false;
+                transfer->peerCursor = 0;
+                if (!startTransfer(transfer) && !scheduleRetry(transfer)) {
+                    chunkFailed(transfer->listIndex);
+                    transfer->listIndex = -1;
+                }
+                continue;
+            } else if (transfer->pollIndex >= 0 && pollFds.get(transfer->pollIndex).revents != 0) {
+                result = stepTransfer(transfer);
+            } else if (now > transfer->deadline) {
+                recordTimeout(transfer);
+                timedOut = true;
+                result = -1;
+            }
+            if (result == 1) {
+                if (completeTransfer(transfer)) {
+                    rememberSwarmPeer(downloadFileSha1, transfer->peer);
+                    closeTransfer(transfer);
+                    chunkArrived(transfer->listIndex);
+                    transfer->listIndex = -1; // Done
+                    fetchedChunks++;
+                    continue;
+                }
+                result = -1;
+            }
+            if (result == -1) {
+                // Fail over to the next peer that has this chunk; a peer that only choked us is not at fault
+                if (!timedOut && !transfer->peerChoked) {
+                    notePeerFailure(transfer->peer.userId, false);
+                }
+                closeTransfer(transfer);
+                transfer->peerCursor++;
+                if (!startTransfer(transfer) && !scheduleRetry(transfer)) {
+                    chunkFailed(transfer->listIndex);
+                    transfer->listIndex = -1;
+                }
+            }
+        }
+
+        // Erasure coding: stop fetching chunks of completed stripes, and once every data chunk is
+        // under way, race parity chunks against data chunks that are retrying. Closing a transfer
+        // mid-body only makes the serving peer's send fail with EPIPE, as SIGPIPE is ignored.
+        for (int i = 0; erasure && i < active.size(); ++i) {
+            ChunkTransfer* transfer = active.get(i);
+            if (transfer->listIndex < 0) continue;
+            int stripe = stripeOf(chunkInfoList.get(transfer->listIndex).chunkIndex);
+            if (stripeDone.get(stripe)) {
+                closeTransfer(transfer);
+                transfer->listIndex = -1;
+                skippedChunks++;
+            } else if (startedChunks == fileOrder.size() && (transfer->waiting || transfer->retries > 0 || transfer->peerCursor > 0)) {
+                requestParity(stripe);
+            }
+        }
+
+        // Drop finished transfers
+        for (int i = active.size() - 1; i >= 0; --i) {
+            if (active.get(i)->listIndex < 0) {
+                delete active.get(i);
+                active.removeAt(i);
+            }
+        }
+
+        if (streamVerify) {
+            long long hashStart = nowMicros();
+            hashContiguousChunks(fileOrder, hashCursor, fileHash);
+            hashMicros += nowMicros() - hashStart;
+        }
+        if (streamFd >= 0 && !streamWriteFailed) {
+            long previousWatermark = downloadWatermark;
+            streamWriteFailed = !writeContiguousChunks(fileOrder, writeCursor, streamFd);
+            if (downloadWatermark != previousWatermark) {
+                if (firstByteAt == 0) {
+                    firstByteAt = nowMicros();
+                    cout << "First " << downloadWatermark << " bytes available after " << (firstByteAt - engineStart) / 1000 << " ms." << endl;
+                }
+                publishWatermark();
+            }
+        }
+    }
+
+    for (int i = 0; i < active.size(); ++i) {
+        closeTransfer(active.get(i));
+        delete active.get(i);
+    }
+    closeControlExchanges();
+    cout << "Fetched " << fetchedChunks << " chunks (" << failedChunks << " failed) in "
+         << (nowMicros() - engineStart) / 1000 << " ms, peak " << peakInflight << " transfers in flight, "
+         << refreshes << " peer refreshes, " << peerExchanges << " peer exchanges." << endl;
+    sendHealthReportLocked(true);
+    if (erasure) {
+        cout << "Erasure coding: rebuilt " << rebuiltChunks << " data chunks from parity, skipped " << skippedChunks
+             << " chunks of completed stripes." << endl;
+    }
+
+    // Chunks taken from local files after the last poll round are hashed and written here
+    if (streamVerify) {
+        long long hashStart = nowMicros();
+        hashContiguousChunks(fileOrder, hashCursor, fileHash);
+        hashMicros += nowMicros() - hashStart;
+    }
+    if (streamFd >= 0 && !streamWriteFailed && writeContiguousChunks(fileOrder, writeCursor, streamFd)) {
+        publishWatermark();
+    }
+    if (!streamVerify) {
+        return "";
+    }
+    cout << "Hashed " << hashCursor << " of " << fileOrder.size() << " chunks in file order (" << hashMicros / 1000 << " ms)." << endl;
+    return hashCursor == fileOrder.size() ? fileHash.finish() : "";
+}
+
+// --- Share Registry Functions ---
+// Shared files are persisted in a binary registry per client listen port, memory-mapped at startup.
+// Layout (host byte order): RegistryHeader, then per file a RegistryEntry followed by the path,
+// owner and group strings, 20-byte chunk digests and, for cdc files, a uint32 length per chunk.
+#define REGISTRY_MAGIC 0x33474552u // "REG3"
+#define REGISTRY_MERKLE 1u
+#define REGISTRY_DIRECTORY 2u // Directory share; the packed layout is rebuilt from the tree on load
+
+struct RegistryHeader {
+    uint32_t magic;
+    uint32_t entryCount;
+};
+
+struct RegistryEntry {
+    uint32_t entryBytes; // Whole entry including the trailing strings and digests
+    uint16_t pathLength;
+    uint8_t ownerLength;
+    uint8_t groupLength;
+    int64_t fileSize;
+    int64_t mtimeNs;
+    uint64_t inode;
+    int64_t chunkSize;
+    int64_t cdcAverage;
+    uint32_t chunkCount;
+    uint32_t flags;
+    uint16_t dataShards;   // Erasure-coded shares: parity chunks follow the data chunks
+    uint16_t parityShards;
+    unsigned char fileDigest[DIGEST_SIZE];
+};
+
+string registryPath() {
+    return ".p2p_registry_" + to_string(clientListenPort);
+}
+
+int64_t statMtimeNs(const struct stat& st) {
+#ifdef __APPLE__
+    return (int64_t)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+void saveShareRegistry() {
+    RegistryHeader header = {REGISTRY_MAGIC, 0};
+    string image(sizeof(header), '\0');
+    for (auto it = ownedFilesInfo.begin(); it != ownedFilesInfo.end(); ++it) {
+        const OwnedFileInfo& info = it->second;
+        if (info.groupId.empty()) continue;
+        RegistryEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.pathLength = info.filePath.length();
+        entry.ownerLength = info.ownerId.length();
+        entry.groupLength = info.groupId.length();
+        entry.fileSize = info.fileSize;
+        entry.mtimeNs = info.mtimeNs;
+        entry.inode = info.inode;
+        entry.chunkSize = info.chunkSize;
+        entry.cdcAverage = info.cdcAverage;
+        entry.chunkCount = info.totalChunks;
+        entry.flags = (info.merkleLayers.isEmpty() ? 0 : REGISTRY_MERKLE) | (info.packedHeader.empty() ? 0 : REGISTRY_DIRECTORY);
+        entry.dataShards = info.dataShards;
+        entry.parityShards = info.parityShards;
+        memcpy(entry.fileDigest, hexToBytes(info.fileSHA1).data(), DIGEST_SIZE);
+        string body = info.filePath + info.ownerId + info.groupId;
+        for (int i = 0; i < info.chunkSHA1s.size(); ++i) {
+            body += hexToBytes(info.chunkSHA1s.get(i));
+        }
+        for (int i = 0; info.chunkSize == 0 && i < info.chunkLengths.size(); ++i) {
+            uint32_t length = info.chunkLengths.get(i);
+            body.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        }
+        entry.entryBytes = sizeof(entry) + body.length();
+        image.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        image += body;
+        header.entryCount++;
+    }
+    memcpy(&image[0], &header, sizeof(header));
+
+    string tempPath = registryPath() + ".tmp";
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        alertPrompt("Failed to write share registry " + tempPath, true);
+        return;
+    }
+    bool written = write(fd, image.data(), image.length()) == (ssize_t)image.length();
+    close(fd);
+    if (!written || rename(tempPath.c_str(), registryPath().c_str()) != 0) {
+        alertPrompt("Failed to replace share registry " + registryPath(), true);
+    }
+}
+
+// Rebuild ownedFilesInfo from the registry so the peer server can serve straight away. Entries are
+// checked only against stat metadata (size, mtime, inode); chunk hashes are still verified by downloaders.
+void loadShareRegistry() {
+    long long start = nowMicros();
+    int fd = open(registryPath().c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat registryStat;
+    if (fstat(fd, &registryStat) != 0 || registryStat.st_size < (off_t)sizeof(RegistryHeader)) {
+        close(fd);
+        return;
+    }
+    size_t mappedSize = registryStat.st_size;
+    const char* image = static_cast<const char*>(mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (image == MAP_FAILED) {
+        alertPrompt("Failed to map share registry " + registryPath(), true);
+        return;
+    }
+
+    RegistryHeader header;
+    memcpy(&header, image, sizeof(header));
+    if (header.magic != REGISTRY_MAGIC) {
+        alertPrompt("Ignoring share registry with unknown format: " + registryPath(), false);
+        munmap(const_cast<char*>(image), mappedSize);
+        return;
+    }
+
+    size_t pos = sizeof(header);
+    int loaded = 0;
+    int dropped = 0;
+    for (uint32_t e = 0; e < header.entryCount; ++e) {
+        RegistryEntry entry;
+        if (pos + sizeof(entry) > mappedSize) break;
+        memcpy(&entry, image + pos, sizeof(entry));
+        size_t lengthBytes = entry.chunkSize == 0 ? sizeof(uint32_t) : 0;
+        size_t expectedBytes = sizeof(entry) + entry.pathLength + entry.ownerLength + entry.groupLength +
+                               (size_t)entry.chunkCount * (DIGEST_SIZE + lengthBytes);
+        if (entry.entryBytes != expectedBytes || pos + expectedBytes > mappedSize) break;
+        const char* body = image + pos + sizeof(entry);
+        pos += expectedBytes;
+
+        OwnedFileInfo info;
+        info.filePath.assign(body, entry.pathLength);
+        body += entry.pathLength;
+        info.ownerId.assign(body, entry.ownerLength);
+        body += entry.ownerLength;
+        info.groupId.assign(body, entry.groupLength);
+        body += entry.groupLength;
+
+        // A directory must still pack to the same size; its own mtime covers entries added or removed
+        struct stat st;
+        bool directory = entry.flags & REGISTRY_DIRECTORY;
+        if (stat(info.filePath.c_str(), &st) != 0 || statMtimeNs(st) != entry.mtimeNs || st.st_ino != entry.inode ||
+            (directory ? !buildPackedDirectory(info.filePath, info) || info.fileSize != entry.fileSize : st.st_size != entry.fileSize)) {
+            cout << "Dropping changed or missing shared file " << info.filePath << endl;
+            dropped++;
+            continue;
+        }
+
+        info.fileSize = entry.fileSize;
+        info.mtimeNs = entry.mtimeNs;
+        info.inode = entry.inode;
+        info.chunkSize = entry.chunkSize;
+        info.cdcAverage = entry.cdcAverage;
+        info.totalChunks = entry.chunkCount;
+        info.fileSHA1 = bytesToHex(string(reinterpret_cast<const char*>(entry.fileDigest), DIGEST_SIZE));
+        info.dataShards = entry.dataShards;
+        info.parityShards = entry.parityShards;
+
+        // The parity sidecar must still hold every parity chunk
+        int parityFrom = firstParityChunk(info);
+        struct stat parityStat;
+        if (info.dataShards > 0 && (stat((info.filePath + PARITY_SUFFIX).c_str(), &parityStat) != 0 ||
+                                    parityStat.st_size != (off_t)(entry.chunkCount - parityFrom) * entry.chunkSize)) {
+            cout << "Dropping shared file with missing parity chunks " << info.filePath << endl;
+            dropped++;
+            continue;
+        }
+        const char* lengths = body + (size_t)entry.chunkCount * DIGEST_SIZE;
+        long offset = 0;
+        for (uint32_t i = 0; i < entry.chunkCount; ++i) {
+            if ((int)i == parityFrom) {
+                offset = 0; // Parity chunks are laid out from the start of the sidecar
+            }
+            long length = (int)i >= parityFrom ? entry.chunkSize : min<long>(entry.chunkSize, entry.fileSize - offset);
+            if (entry.chunkSize == 0) {
+                uint32_t packedLength;
+                memcpy(&packedLength, lengths + i * sizeof(uint32_t), sizeof(packedLength));
+                length = packedLength;
+            }
+            info.chunkSHA1s.add(bytesToHex(string(body + (size_t)i * DIGEST_SIZE, DIGEST_SIZE)));
+            info.chunkOffsets.add(offset);
+            info.chunkLengths.add(length);
+            offset += length;
+        }
+        if (entry.flags & REGISTRY_MERKLE) {
+            buildMerkleLayers(info.chunkSHA1s, info.merkleLayers);
+        }
+        if (!directory) {
+            indexFileChunks(info.filePath, info.chunkSHA1s, info.chunkOffsets, info.chunkLengths, parityFrom);
+        }
+        pthread_mutex_lock(&ownedFilesMutex);
+        ownedFilesInfo[getBaseName(info.filePath)] = info;
+        pthread_mutex_unlock(&ownedFilesMutex);
+        loaded++;
+    }
+    munmap(const_cast<char*>(image), mappedSize);
+
+    cout << "Loaded " << loaded << " shared files from " << registryPath() << " in " << (nowMicros() - start) / 1000 << " ms";
+    if (dropped > 0) {
+        cout << ", dropped " << dropped;
+        saveShareRegistry();
+    }
+    cout << "." << endl;
+}
+
+// Announce every registered file owned by the logged-in user with one announce_batch request
+void reannounceShares() {
+    long long start = nowMicros();
+    int fileCount = 0;
+    string payload;
+    for (auto it = ownedFilesInfo.begin(); it != ownedFilesInfo.end(); ++it) {
+        const OwnedFileInfo& info = it->second;
+        if (info.groupId.empty() || info.ownerId != currentUserId) continue;
+        payload += getBaseName(info.filePath) + " " + to_string(info.fileSize) + " " + info.fileSHA1 + " " + info.groupId + " " +
+                   (info.chunkSize > 0 ? to_string(info.chunkSize) : "cdc");
+        if (info.dataShards > 0) {
+            payload += " rs " + to_string(info.dataShards) + " " + to_string(info.parityShards);
+        }
+        if (!info.merkleLayers.isEmpty()) {
+            payload += " merkle " + merkleRoot(info.merkleLayers) + " " + to_string(info.totalChunks) + "\n";
+        } else {
+            string digests = packChunkDigests(info.chunkSHA1s, info.chunkSize, info.chunkLengths);
+            payload += " " + to_string(digests.length()) + "\n" + digests;
+        }
+        fileCount++;
+    }
+    if (fileCount == 0) return;
+
+    string command = "announce_batch " + to_string(fileCount) + " " + to_string(payload.length()) + "\n" + payload;
+    if (!sendAll(trackerSocket, command.c_str(), command.length())) {
+        alertPrompt("Failed to send announce_batch to tracker.", false);
+        return;
+    }
+    string response;
+    if (recvTrackerResponse(response) <= 0) {
+        alertPrompt("No response to announce_batch from tracker.", false);
+        return;
+    }
+    cout << response;
+    cout << "Re-announced " << fileCount << " shared files (" << command.length() << " bytes) in "
+         << (nowMicros() - start) / 1000 << " ms." << endl;
+}
+
+// --- Tracker Communication Function ---
+// Prepare the upload_file command; content-defined chunks carry their lengths, and a
+// Merkle manifest sends only the root of the tree over the chunk hashes. Erasure-coded
+// files always use the binary form, which carries their data and parity shard counts.
+string buildUploadCommand(const string& name, long fileSize, const string& fileSha1, const string& groupId, long chunkSize,
+                          const ArrayList<string>& chunkSha1s, const ArrayList<long>& chunkLengths, const ArrayList<string>& merkleLayers,
+                          int dataShards = 0, int parityShards = 0) {
+    bool merkleManifest = !merkleLayers.isEmpty();
+    string uploadCommand = "upload_file " + name + " " + to_string(fileSize) + " " + fileSha1 + " " + groupId + " " +
+                           (chunkSize > 0 ? to_string(chunkSize) : "cdc");
+    if (merkleManifest) {
+        uploadCommand += " merkle " + merkleRoot(merkleLayers) + " " + to_string(chunkSha1s.size());
+    }
+    if (dataShards > 0) {
+        uploadCommand += " rs " + to_string(dataShards) + " " + to_string(parityShards);
+    }
+    if ((binaryManifest || dataShards > 0) && !merkleManifest) {
+        string payload = packChunkDigests(chunkSha1s, chunkSize, chunkLengths);
+        uploadCommand.replace(0, 11, "upload_file_bin");
+        uploadCommand += " " + to_string(payload.length()) + "\n" + payload;
+    } else {
+        for (int i = 0; i < chunkSha1s.size() && !merkleManifest; ++i) {
+            uploadCommand += " " + chunkSha1s.get(i);
+            if (chunkSize == 0) {
+                uploadCommand += ":" + to_string(chunkLengths.get(i));
+            }
+        }
+        uploadCommand += "\n"; // Append newline
+    }
+    return uploadCommand;
+}
+
+void* trackerCommunication(void* arg) {
+    char buffer[BUFFER_SIZE];
+    int readSize;
+    bool holdingTracker = false; // trackerMutex is held while a command runs, so every path back here releases it
+
+    while (clientRunning) {
+        if (holdingTracker) {
+            pthread_mutex_unlock(&trackerMutex);
+            holdingTracker = false;
+        }
+        cout << ">> ";
+        cout.flush(); 
+        string command;
+        if (!getline(cin, command)) {
+            // EOF detected (e.g., Ctrl+D)
+            clientRunning = false;
+            break;
+        }
+
+        if (command.empty()) continue;
+
+        
+        ArrayList<string> tokens;       // Split the command into tokens
+        char* commandCStr = new char[command.length() + 1];
+        strcpy(commandCStr, command.c_str());
+        char* tokenPtr = strtok(commandCStr, " \n");
+        while (tokenPtr != NULL) {
+            tokens.add(string(tokenPtr));
+            tokenPtr = strtok(NULL, " \n");
+        }
+        delete[] commandCStr;
+
+        if (tokens.size() == 0) continue;
+
+        string cmd = tokens.get(0);
+        CommandType commandType = getCommandType(cmd);
+        pthread_mutex_lock(&trackerMutex);
+        holdingTracker = true;
+
+        switch (commandType) {
+            case CommandType::LOGIN: {
+                if (tokens.size() != 3) {
+                    cout << "Usage: login <user_id> <password>" << endl;
+                    continue;
+                }
+
+                string userId = tokens.get(1);
+                string password = tokens.get(2);
+
+                // Prepare login command with IP and port
+                // Register the same listen address that get_peers announces to other peers
+                string loginCommand = "login " + userId + " " + password + " " + clientListenIp + " " + to_string(clientListenPort) + "\n";
+
+                // Send login command to tracker
+                if (!sendAll(trackerSocket, loginCommand.c_str(), loginCommand.length())) {
+                    alertPrompt("Failed to send login command to tracker.", false);
+                    continue;
+                }
+
+                // Receive response
+                readSize = recv(trackerSocket, buffer, BUFFER_SIZE - 1, 0);
+                if (readSize > 0) {
+                    buffer[readSize] = '\0';
+                    cout << buffer;
+                    if (strstr(buffer, "Login successful") != NULL) {
+                        pthread_mutex_lock(&userMutex);
+                        currentUserId = userId;
+                        pthread_mutex_unlock(&userMutex);
+                        reannounceShares();
+                    }
+                } else if (readSize == 0) {
+                    alertPrompt("Tracker closed the connection.", false);
+                    clientRunning = false;
+                    break;
+                } else {
+                    alertPrompt("recv failed", true);
+                    clientRunning = false;
+                    break;
+                }
+                break;
+            }
+            case CommandType::UPLOAD_FILE: {
+                // Expected format: upload_file <file_path> <group_id> [chunk_size_KB|cdc] [merkle | rs <data> <parity>]
+                bool merkleManifest = tokens.size() > 3 && tokens.get(tokens.size() - 1) == "merkle";
+                if (merkleManifest) {
+                    tokens.removeAt(tokens.size() - 1);
+                }
+                int dataShards = 0, parityShards = 0;
+                if (tokens.size() > 5 && tokens.get(tokens.size() - 3) == "rs") {
+                    dataShards = myAtoi(tokens.get(tokens.size() - 2));
+                    parityShards = myAtoi(tokens.get(tokens.size() - 1));
+                    for (int i = 0; i < 3; ++i) tokens.removeAt(tokens.size() - 1);
+                    if (dataShards < 1 || parityShards < 1 || dataShards + parityShards > 255 || merkleManifest) {
+                        cout << "Erasure coding needs 1 <= data, 1 <= parity, data + parity <= 255, and no Merkle manifest." << endl;
+                        continue;
+                    }
+                }
+                if (tokens.size() != 3 && tokens.size() != 4) {
+                    cout << "Usage: upload_file <file_path> <group_id> [chunk_size_KB|cdc] [merkle | rs <data> <parity>]" << endl;
+                    continue;
+                }
+
+                string filePath = tokens.get(1);
+                string groupId = tokens.get(2);
+
+                // Check if the file exists using system calls
+                struct stat st;
+                if (stat(filePath.c_str(), &st) != 0) {
+                    alertPrompt("File does not exist: " + filePath, true);
+                    continue;
+                }
+
+                long fileSize = st.st_size;
+
+                // Chunk size is a per-file property: explicit, or picked from the file size.
+                // In cdc mode chunk boundaries follow the content, averaging the policy size.
+                long avgChunkSize = chooseChunkSize(fileSize);
+                long chunkSize = avgChunkSize;
+                if (tokens.size() == 4 && tokens.get(3) == "cdc") {
+                    chunkSize = 0;
+                    if (merkleManifest || dataShards > 0) {
+                        cout << (merkleManifest ? "Merkle manifests" : "Erasure coding") << " need fixed-size chunks." << endl;
+                        continue;
+                    }
+                } else if (tokens.size() == 4) {
+                    chunkSize = myAtol(tokens.get(3)) * 1024;
+                    if (chunkSize < MIN_CHUNK_SIZE || chunkSize > MAX_CHUNK_SIZE) {
+                        cout << "Chunk size must be between " << MIN_CHUNK_SIZE / 1024 << " and " << MAX_CHUNK_SIZE / 1024 << " KB." << endl;
+                        continue;
+                    }
+                }
+                long long hashStart = nowMicros();
+
+                // Compute file SHA1
+                string fileSha1 = computeFileSHA1(filePath);
+                if (fileSha1.empty()) {
+                    alertPrompt("Failed to compute SHA1 of the file.", false);
+                    continue;
+                }
+
+                // Split the file into chunks and compute chunk SHA1s
+                ArrayList<string> chunkSha1s;
+                ArrayList<long> chunkOffsets;
+                ArrayList<long> chunkLengths;
+                if (!hashFileChunks(filePath, chunkSize, avgChunkSize, chunkSha1s, chunkOffsets, chunkLengths)) {
+                    continue;
+                }
+                int dataChunksLocal = chunkSha1s.size();
+
+                // Erasure coding: parity chunks go to a sidecar file and are listed after the data chunks
+                if (dataShards > 0) {
+                    long long encodeStart = nowMicros();
+                    if (!writeParityFile(filePath, chunkSize, dataShards, parityShards, chunkSha1s, chunkOffsets, chunkLengths)) {
+                        continue;
+                    }
+                    long long encodeMicros = max(nowMicros() - encodeStart, 1LL);
+                    cout << "Encoded " << chunkSha1s.size() - dataChunksLocal << " parity chunks (rs " << dataShards << "+" << parityShards
+                         << ", " << (erasureSimd ? "ssse3" : "scalar") << ") in " << encodeMicros / 1000 << " ms, "
+                         << formatRate(fileSize * 1e6 / encodeMicros) << "." << endl;
+                }
+                int totalChunksLocal = chunkSha1s.size();
+
+                ArrayList<string> merkleLayers;
+                if (merkleManifest) {
+                    buildMerkleLayers(chunkSha1s, merkleLayers);
+                }
+                string uploadCommand = buildUploadCommand(getBaseName(filePath), fileSize, fileSha1, groupId, chunkSize,
+                                                          chunkSha1s, chunkLengths, merkleLayers, dataShards, parityShards);
+
+                cout << "Hashed " << dataChunksLocal << (chunkSize > 0 ? " chunks of " : " content-defined chunks averaging ")
+                     << (chunkSize > 0 ? chunkSize : avgChunkSize) / 1024 << " KB in " << (nowMicros() - hashStart) / 1000 << " ms, manifest "
+                     << uploadCommand.length() << " bytes." << endl;
+
+                // Send upload_file command to tracker
+                long long registerStart = nowMicros();
+                if (!sendAll(trackerSocket, uploadCommand.c_str(), uploadCommand.length())) {
+                    alertPrompt("Failed to send upload_file command to tracker.", false);
+                    continue;
+                }
+
+                // Receive response
+                readSize = recv(trackerSocket, buffer, BUFFER_SIZE - 1, 0);
+                if (readSize > 0) {
+                    buffer[readSize] = '\0';
+                    cout << buffer;
+                    cout << "Registered " << (merkleManifest ? "Merkle" : binaryManifest ? "binary" : "text")
+                         << " manifest with tracker in " << (nowMicros() - registerStart) / 1000 << " ms." << endl;
+
+                    // Optionally, add the file to ownedFilesInfo if upload is successful
+                    if (strstr(buffer, "success") != NULL || strstr(buffer, "created") != NULL || strstr(buffer, "File already exists. Added you as a sharer.") != NULL) {
+                        OwnedFileInfo ownedFile;
+                        ownedFile.filePath = filePath;
+                        ownedFile.ownerId = currentUserId;
+                        ownedFile.groupId = groupId;
+                        ownedFile.fileSize = fileSize;
+                        ownedFile.mtimeNs = statMtimeNs(st);
+                        ownedFile.inode = st.st_ino;
+                        ownedFile.fileSHA1 = fileSha1;
+                        ownedFile.chunkSHA1s = chunkSha1s;
+                        ownedFile.totalChunks = totalChunksLocal;
+                        ownedFile.chunkSize = chunkSize;
+                        ownedFile.cdcAverage = chunkSize == 0 ? avgChunkSize : 0;
+                        ownedFile.chunkOffsets = chunkOffsets;
+                        ownedFile.chunkLengths = chunkLengths;
+                        ownedFile.merkleLayers = merkleLayers;
+                        ownedFile.dataShards = dataShards;
+                        ownedFile.parityShards = parityShards;
+                        pthread_mutex_lock(&ownedFilesMutex);
+                        ownedFilesInfo[getBaseName(filePath)] = ownedFile;
+                        pthread_mutex_unlock(&ownedFilesMutex);
+                        indexFileChunks(filePath, chunkSha1s, chunkOffsets, chunkLengths, firstParityChunk(ownedFile));
+                        saveShareRegistry();
+                    }
+                } else if (readSize == 0) {
+                    alertPrompt("Tracker closed the connection.", false);
+                    clientRunning = false;
+                    break;
+                } else {
+                    alertPrompt("recv failed", true);
+                    clientRunning = false;
+                    break;
+                }
+                break;
+            }
+            case CommandType::DOWNLOAD_FILE: {
+                // Expected format: download_file <group_id> <file_name> <destination_path> [stream]
+                bool streaming = tokens.size() == 5 && tokens.get(4) == "stream";
+                if (tokens.size() != 4 && !streaming) {
+                    cout << "Usage: download_file <group_id> <file_name> <destination_path> [stream]" << endl;
+                    continue;
+                }
+
+                string groupId = tokens.get(1);
+                string fileName = tokens.get(2);
+                string destinationPath = tokens.get(3);
+                downloadGroupId = groupId;
+                downloadFileName = fileName;
+
+                // Prepare download_file command
+                string downloadCommand = "download_file " + groupId + " " + fileName + "\n";
+
+                // Send download_file command to tracker
+                if (!sendAll(trackerSocket, downloadCommand.c_str(), downloadCommand.length())) {
+                    alertPrompt("Failed to send download_file command to tracker.", false);
+                    continue;
+                }
+
+                // Receive response from tracker
+                string responseStr;
+                readSize = recvTrackerResponse(responseStr);
+                if (readSize > 0) {
+                    cout << responseStr;
+
+                    if (responseStr.find("Error:") == 0) {
+                        continue;
+                    }
+
+                    // Parse the download_info response
+                    if (!parseDownloadInfo(responseStr, downloadFileSize, downloadChunkSize, downloadFileSha1, downloadMerkleRoot, chunkInfoList, downloadErasure, downloadSwarmPeers)) {
+                        continue;
+                    }
+                    totalChunks = chunkInfoList.size();
+
+                    // Chunks are fetched rarest-first; the engine orders them once peers report their bitfields
+                    downloadFilePath = destinationPath + "/" + fileName;
+                    beginSwarmFile(fileName, downloadFileSha1, downloadFilePath);
+
+                    // Streaming downloads write the output file in place while chunks arrive
+                    int outfile_fd = -1;
+                    if (streaming) {
+                        // Read-write: erasure decoding reads back stripe chunks already written
+                        outfile_fd = open(downloadFilePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+                        if (outfile_fd < 0) {
+                            alertPrompt("Could not create output file: " + downloadFilePath, true);
+                            continue;
+                        }
+                    }
+
+                    // Fetch all chunks through the event-driven download engine
+                    bool streamVerify = verifyMode == "stream";
+                    string streamedSha1 = runDownloadEngine(streamVerify, outfile_fd);
+
+                    // Parity chunks are not part of the file; drop them before assembly
+                    pthread_mutex_lock(&downloadMutex);
+                    for (int i = chunkInfoList.size() - 1; i >= 0; --i) {
+                        if (chunkInfoList.get(i).parity) {
+                            chunkData.erase(chunkInfoList.get(i).chunkIndex);
+                            localChunkSources.erase(chunkInfoList.get(i).chunkIndex);
+                            chunkInfoList.removeAt(i);
+                        }
+                    }
+                    pthread_mutex_unlock(&downloadMutex);
+
+                    if (!streaming) {
+                        outfile_fd = open(downloadFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                        if (outfile_fd < 0) {
+                            alertPrompt("Could not create output file: " + downloadFilePath, true);
+                            continue;
+                        }
+                    }
+
+                    // Write each chunk at its offset, IO_BATCH_SIZE chunks per I/O batch; locally
+                    // available chunks are cloned or copied from disk
+                    long long writeStart = nowMicros();
+                    int clonedChunks = 0, copiedChunks = 0, writtenChunks = 0;
+                    bool assemblyFailed = false;
+                    ArrayList<IoRequest> writes;
+                    for (int listIndex = 0; listIndex < chunkInfoList.size() && !assemblyFailed; ++listIndex) {
+                        int i = chunkInfoList.get(listIndex).chunkIndex;
+                        off_t chunkOffset = chunkInfoList.get(listIndex).offset;
+                        pthread_mutex_lock(&downloadMutex);
+                        auto it = chunkData.find(i);
+                        auto localIt = localChunkSources.find(i);
+                        pthread_mutex_unlock(&downloadMutex);
+                        if (chunkOffset < downloadWatermark) {
+                            // Already written in place by a streaming download
+                        } else if (it != chunkData.end()) {
+                            IoRequest request;
+                            request.op = IoOp::WRITE;
+                            request.fd = outfile_fd;
+                            request.buffer = const_cast<char*>(it->second.data());
+                            request.length = it->second.length();
+                            request.offset = chunkOffset;
+                            writes.add(request);
+                        } else if (localIt != localChunkSources.end()) {
+                            int result = cloneOrCopyRange(localIt->second, outfile_fd, chunkOffset);
+                            if (result < 0) {
+                                alertPrompt("Failed to copy local chunk " + to_string(i) + " from " + localIt->second.filePath, true);
+                                assemblyFailed = true;
+                            }
+                            if (result >= 0) (result == 1 ? clonedChunks : copiedChunks)++;
+                        } else {
+                            alertPrompt("Missing chunk " + to_string(i), false);
+                            assemblyFailed = true;
+                        }
+
+                        if (writes.size() == IO_BATCH_SIZE || (listIndex == chunkInfoList.size() - 1 && !writes.isEmpty())) {
+                            writeIo.run(writes, ioUringEnabled);
+                            for (int w = 0; w < writes.size(); ++w) {
+                                if (writes.get(w).result != (ssize_t)writes.get(w).length) {
+                                    errno = writes.get(w).result < 0 ? -writes.get(w).result : EIO;
+                                    alertPrompt("Failed to write to output file: " + downloadFilePath, true);
+                                    assemblyFailed = true;
+                                    break;
+                                }
+                            }
+                            writtenChunks += writes.size();
+                            writes.clear();
+                        }
+                    }
+                    close(outfile_fd);
+                    cout << "Wrote " << writtenChunks << " chunks in " << (nowMicros() - writeStart) / 1000 << " ms ("
+                         << (ioUringEnabled ? "io_uring" : "blocking syscalls") << ")." << endl;
+                    if (clonedChunks + copiedChunks > 0) {
+                        cout << "Reused " << clonedChunks + copiedChunks << " chunks from local files ("
+                             << clonedChunks << " reflinked, " << copiedChunks << " copied)." << endl;
+                    }
+
+                    // Verify the downloaded file: the streamed hash already covers every byte written,
+                    // so the output file is only re-read in full verification mode
+                    string downloadedFileSha1;
+                    if (assemblyFailed) {
+                        downloadedFileSha1 = "";
+                    } else if (streamVerify) {
+                        downloadedFileSha1 = streamedSha1;
+                    } else {
+                        long long verifyStart = nowMicros();
+                        downloadedFileSha1 = computeFileSHA1(downloadFilePath);
+                        cout << "Re-read output file for verification in " << (nowMicros() - verifyStart) / 1000 << " ms." << endl;
+                    }
+                    if (downloadedFileSha1 == downloadFileSha1) {
+                        cout << "File downloaded and verified successfully." << endl;
+                        if (streaming) {
+                            unlink((downloadFilePath + ".watermark").c_str());
+                        }
+                        pthread_mutex_lock(&downloadMutex); // Peers now get our chunks from the output file
+                        swarmFile.downloading = false;
+                        swarmFile.complete = true;
+                        pthread_mutex_unlock(&downloadMutex);
+
+                        ArrayList<string> downloadedChunkSha1s;
+                        ArrayList<long> downloadedOffsets;
+                        ArrayList<long> downloadedLengths;
+                        for (int i = 0; i < chunkInfoList.size(); ++i) {
+                            downloadedChunkSha1s.add(chunkInfoList.get(i).expectedSha1);
+                            downloadedOffsets.add(chunkInfoList.get(i).offset);
+                            downloadedLengths.add(chunkInfoList.get(i).length);
+                        }
+                        indexFileChunks(downloadFilePath, downloadedChunkSha1s, downloadedOffsets, downloadedLengths);
+                    } else {
+                        alertPrompt("File verification failed for " + downloadFilePath, false);
+                        resetSwarmFile();
+                    }
+                } else if (readSize == 0) {
+                    alertPrompt("Tracker closed the connection.", false);
+                    clientRunning = false;
+                    break;
+                } else {
+                    alertPrompt("recv failed", true);
+                    clientRunning = false;
+                    break;
+                }
+                break;
+            }
+            case CommandType::DOWNLOAD_RANGE: {
+                // Expected format: download_range <group_id> <file_name> <offset> <length> <output_file>
+                if (tokens.size() != 6) {
+                    cout << "Usage: download_range <group_id> <file_name> <offset> <length> <output_file>" << endl;
+                    continue;
+                }
 
-        if (command.empty()) continue;
+                string groupId = tokens.get(1);
+                string fileName = tokens.get(2);
+                long rangeOffset = myAtol(tokens.get(3));
+                long rangeLength = myAtol(tokens.get(4));
+                string outputPath = tokens.get(5);
+                if (rangeOffset < 0 || rangeLength <= 0) {
+                    cout << "Offset must be non-negative and length positive." << endl;
+                    continue;
+                }
+                downloadGroupId = groupId;
+                downloadFileName = fileName;
 
-        
-        ArrayList<string> tokens;       // Split the command into tokens
-        char* commandCStr = new char[command.length() + 1];
-        strcpy(commandCStr, command.c_str());
-        char* tokenPtr = strtok(commandCStr, " \n");
-        while (tokenPtr != NULL) {
-            tokens.add(string(tokenPtr));
-            tokenPtr = strtok(NULL, " \n");
-        }
-        delete[] commandCStr;
+                string downloadCommand = "download_file " + groupId + " " + fileName + "\n";
+                if (!sendAll(trackerSocket, downloadCommand.c_str(), downloadCommand.length())) {
+                    alertPrompt("Failed to send download_file command to tracker.", false);
+                    continue;
+                }
 
-        if (tokens.size() == 0) continue;
+                string responseStr;
+                readSize = recvTrackerResponse(responseStr);
+                if (readSize > 0) {
+                    if (responseStr.find("Error:") == 0) {
+                        cout << responseStr;
+                        continue;
+                    }
+                    ArrayList<ChunkInfo> allChunks;
+                    if (!parseDownloadInfo(responseStr, downloadFileSize, downloadChunkSize, downloadFileSha1, downloadMerkleRoot, allChunks, downloadErasure, downloadSwarmPeers)) {
+                        continue;
+                    }
+                    if (rangeOffset >= downloadFileSize) {
+                        cout << "Offset is past the end of the file (" << downloadFileSize << " bytes)." << endl;
+                        continue;
+                    }
+                    rangeLength = min(rangeLength, downloadFileSize - rangeOffset); // Clip before adding so huge lengths cannot overflow
+                    long rangeEnd = rangeOffset + rangeLength;
 
-        string cmd = tokens.get(0);
-        CommandType commandType = getCommandType(cmd);
+                    // Keep only the data chunks overlapping the range; each is still verified on its own.
+                    // Without the rest of their stripes, erasure-coded chunks are fetched as plain chunks.
+                    totalChunks = allChunks.size();
+                    downloadErasure.dataShards = 0;
+                    chunkInfoList.clear();
+                    for (int i = 0; i < allChunks.size(); ++i) {
+                        const ChunkInfo& chunk = allChunks.get(i);
+                        if (!chunk.parity && chunk.offset < rangeEnd && chunk.offset + chunk.length > rangeOffset) {
+                            chunkInfoList.add(chunk);
+                        }
+                    }
+                    cout << "Range " << rangeOffset << "-" << rangeEnd << " spans " << chunkInfoList.size() << " of "
+                         << totalChunks << " chunks." << endl;
 
-        switch (commandType) {
-            case CommandType::LOGIN: {
-                if (tokens.size() != 3) {
-                    cout << "Usage: login <user_id> <password>" << endl;
+                    resetSwarmFile();
+                    chunkData.clear();
+                    localChunkSources.clear();
+                    downloadFilePath = outputPath;
+                    runDownloadEngine(false, -1);
+
+                    int outfile_fd = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                    if (outfile_fd < 0) {
+                        alertPrompt("Could not create output file: " + outputPath, true);
+                        continue;
+                    }
+                    // Copy the part of each chunk that falls inside the range
+                    bool rangeFailed = false;
+                    for (int listIndex = 0; listIndex < chunkInfoList.size() && !rangeFailed; ++listIndex) {
+                        const ChunkInfo& chunk = chunkInfoList.get(listIndex);
+                        string data;
+                        auto it = chunkData.find(chunk.chunkIndex);
+                        auto localIt = localChunkSources.find(chunk.chunkIndex);
+                        if (it != chunkData.end()) {
+                            data.swap(it->second);
+                        } else if (localIt == localChunkSources.end() || !readLocalChunk(localIt->second, chunk.expectedSha1, data)) {
+                            alertPrompt("Missing chunk " + to_string(chunk.chunkIndex), false);
+                            rangeFailed = true;
+                            break;
+                        }
+                        long start = max(rangeOffset, chunk.offset);
+                        long end = min(rangeEnd, chunk.offset + chunk.length);
+                        ssize_t written = pwrite(outfile_fd, data.data() + (start - chunk.offset), end - start, start - rangeOffset);
+                        if (written != end - start) {
+                            alertPrompt("Failed to write to output file: " + outputPath, true);
+                            rangeFailed = true;
+                        }
+                    }
+                    close(outfile_fd);
+                    if (rangeFailed) {
+                        alertPrompt("Range download failed for " + outputPath, false);
+                    } else {
+                        cout << "Wrote bytes " << rangeOffset << "-" << rangeEnd << " of " << fileName << " to " << outputPath
+                             << " (" << chunkInfoList.size() << " verified chunks fetched)." << endl;
+                    }
+                    chunkData.clear();
+                } else if (readSize == 0) {
+                    alertPrompt("Tracker closed the connection.", false);
+                    clientRunning = false;
+                    break;
+                } else {
+                    alertPrompt("recv failed", true);
+                    clientRunning = false;
+                    break;
+                }
+                break;
+            }
+            case CommandType::UPLOAD_DIR: {
+                // Expected format: upload_dir <dir_path> <group_id> [chunk_size_KB]
+                if (tokens.size() != 3 && tokens.size() != 4) {
+                    cout << "Usage: upload_dir <dir_path> <group_id> [chunk_size_KB]" << endl;
                     continue;
                 }
+                string dirPath = tokens.get(1);
+                while (dirPath.length() > 1 && dirPath[dirPath.length() - 1] == '/') {
+                    dirPath.erase(dirPath.length() - 1);
+                }
+                string groupId = tokens.get(2);
 
-                string userId = tokens.get(1);
-                string password = tokens.get(2);
-
-                // Prepare login command with IP and port
-                string loginCommand = "login " + userId + " " + password + " " + "127.0.0.1" + " " + to_string(clientListenPort) + "\n";
+                struct stat st;
+                if (stat(dirPath.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                    alertPrompt("Not a directory: " + dirPath, false);
+                    continue;
+                }
 
-                // Send login command to tracker
-                if (!sendAll(trackerSocket, loginCommand.c_str(), loginCommand.length())) {
-                    alertPrompt("Failed to send login command to tracker.", false);
+                long long hashStart = nowMicros();
+                OwnedFileInfo ownedDir;
+                if (!buildPackedDirectory(dirPath, ownedDir)) {
+                    continue;
+                }
+                long chunkSize = chooseChunkSize(ownedDir.fileSize);
+                if (tokens.size() == 4) {
+                    chunkSize = myAtol(tokens.get(3)) * 1024;
+                    if (chunkSize < MIN_CHUNK_SIZE || chunkSize > MAX_CHUNK_SIZE) {
+                        cout << "Chunk size must be between " << MIN_CHUNK_SIZE / 1024 << " and " << MAX_CHUNK_SIZE / 1024 << " KB." << endl;
+                        continue;
+                    }
+                }
+                ArrayList<string> chunkSha1s;
+                ArrayList<long> chunkOffsets;
+                ArrayList<long> chunkLengths;
+                string dirSha1;
+                if (!hashPackedChunks(ownedDir, chunkSize, chunkSha1s, chunkOffsets, chunkLengths, dirSha1)) {
                     continue;
                 }
 
-                // Receive response
+                ArrayList<string> noMerkleLayers;
+                string shareName = getBaseName(dirPath);
+                string uploadCommand = buildUploadCommand(shareName, ownedDir.fileSize, dirSha1, groupId, chunkSize,
+                                                          chunkSha1s, chunkLengths, noMerkleLayers);
+                cout << "Packed " << ownedDir.members.size() << " files (" << ownedDir.fileSize << " bytes) into " << chunkSha1s.size()
+                     << " chunks of " << chunkSize / 1024 << " KB in " << (nowMicros() - hashStart) / 1000 << " ms, manifest "
+                     << uploadCommand.length() << " bytes." << endl;
+
+                if (!sendAll(trackerSocket, uploadCommand.c_str(), uploadCommand.length())) {
+                    alertPrompt("Failed to send upload_file command to tracker.", false);
+                    continue;
+                }
                 readSize = recv(trackerSocket, buffer, BUFFER_SIZE - 1, 0);
                 if (readSize > 0) {
                     buffer[readSize] = '\0';
                     cout << buffer;
+                    if (strstr(buffer, "success") != NULL || strstr(buffer, "File already exists. Added you as a sharer.") != NULL) {
+                        ownedDir.ownerId = currentUserId;
+                        ownedDir.groupId = groupId;
+                        ownedDir.mtimeNs = statMtimeNs(st);
+                        ownedDir.inode = st.st_ino;
+                        ownedDir.fileSHA1 = dirSha1;
+                        ownedDir.chunkSHA1s = chunkSha1s;
+                        ownedDir.totalChunks = chunkSha1s.size();
+                        ownedDir.chunkSize = chunkSize;
+                        ownedDir.chunkOffsets = chunkOffsets;
+                        ownedDir.chunkLengths = chunkLengths;
+                        pthread_mutex_lock(&ownedFilesMutex);
+                        ownedFilesInfo[shareName] = ownedDir;
+                        pthread_mutex_unlock(&ownedFilesMutex);
+                        saveShareRegistry();
+                    }
                 } else if (readSize == 0) {
                     alertPrompt("Tracker closed the connection.", false);
                     clientRunning = false;
@@ -739,85 +5288,84 @@ void* trackerCommunication(void* arg) {
                 }
                 break;
             }
-            case CommandType::UPLOAD_FILE: {
-                // Expected format: upload_file <file_path> <group_id>
+            case CommandType::UPDATE_FILE: {
+                // Expected format: update_file <file_path> <group_id>
                 if (tokens.size() != 3) {
-                    cout << "Usage: upload_file <file_path> <group_id>" << endl;
+                    cout << "Usage: update_file <file_path> <group_id>" << endl;
                     continue;
                 }
-
                 string filePath = tokens.get(1);
                 string groupId = tokens.get(2);
+                auto ownedIt = ownedFilesInfo.find(getBaseName(filePath));
+                if (ownedIt == ownedFilesInfo.end() || ownedIt->second.groupId != groupId || ownedIt->second.filePath != filePath) {
+                    cout << "File is not shared in group " << groupId << " yet; use upload_file." << endl;
+                    continue;
+                }
+                const OwnedFileInfo& previous = ownedIt->second;
+                if (!previous.merkleLayers.isEmpty() || !previous.packedHeader.empty() || previous.dataShards > 0) {
+                    cout << "update_file supports plain file shares only; use upload_file." << endl;
+                    continue;
+                }
 
-                // Check if the file exists using system calls
                 struct stat st;
                 if (stat(filePath.c_str(), &st) != 0) {
                     alertPrompt("File does not exist: " + filePath, true);
                     continue;
                 }
-
-                long fileSize = st.st_size;
-
-                // Compute file SHA1
-                string fileSha1 = computeFileSHA1(filePath);
-                if (fileSha1.empty()) {
-                    alertPrompt("Failed to compute SHA1 of the file.", false);
+                if (st.st_size == previous.fileSize && statMtimeNs(st) == previous.mtimeNs) {
+                    cout << "File unchanged since it was shared." << endl;
                     continue;
                 }
 
-                // Split the file into chunks and compute chunk SHA1s
+                // Re-hash with the previous chunking so unchanged regions keep their chunk hashes
+                long long hashStart = nowMicros();
+                string fileSha1 = computeFileSHA1(filePath);
                 ArrayList<string> chunkSha1s;
-                int totalChunksLocal = 0;
-
-                int fd = open(filePath.c_str(), O_RDONLY);
-                if (fd < 0) {
-                    alertPrompt("Failed to open file for reading: " + filePath, true);
+                ArrayList<long> chunkOffsets;
+                ArrayList<long> chunkLengths;
+                if (fileSha1.empty() || !hashFileChunks(filePath, previous.chunkSize, previous.cdcAverage,
+                                                        chunkSha1s, chunkOffsets, chunkLengths)) {
                     continue;
                 }
-
-                char* chunkBuffer = new char[CHUNK_SIZE];
-                ssize_t bytesRead;
-                while ((bytesRead = read(fd, chunkBuffer, CHUNK_SIZE)) > 0) {
-                    string chunkSha1 = computeSHA1(chunkBuffer, bytesRead);
-                    chunkSha1s.add(chunkSha1);
-                    totalChunksLocal++;
-                }
-                if (bytesRead < 0) {
-                    alertPrompt("Failed to read file: " + filePath, true);
-                    delete[] chunkBuffer;
-                    close(fd);
-                    continue;
+                map<string, bool> previousChunks;
+                for (int i = 0; i < previous.chunkSHA1s.size(); ++i) {
+                    previousChunks[previous.chunkSHA1s.get(i)] = true;
                 }
-                delete[] chunkBuffer;
-                close(fd);
-
-                // Prepare upload_file command
-                string uploadCommand = "upload_file " + getBaseName(filePath) + " " + to_string(fileSize) + " " + fileSha1 + " " + groupId;
+                int changedChunks = 0;
                 for (int i = 0; i < chunkSha1s.size(); ++i) {
-                    uploadCommand += " " + chunkSha1s.get(i);
+                    changedChunks += previousChunks.count(chunkSha1s.get(i)) ? 0 : 1;
                 }
-                uploadCommand += "\n"; // Append newline
-
-                // Send upload_file command to tracker
-                if (!sendAll(trackerSocket, uploadCommand.c_str(), uploadCommand.length())) {
-                    alertPrompt("Failed to send upload_file command to tracker.", false);
+                cout << "Re-hashed in " << (nowMicros() - hashStart) / 1000 << " ms: " << changedChunks << " of "
+                     << chunkSha1s.size() << " chunks changed." << endl;
+
+                string payload = packChunkDigests(chunkSha1s, previous.chunkSize, chunkLengths);
+                string updateCommand = "update_file_bin " + getBaseName(filePath) + " " + to_string(st.st_size) + " " + fileSha1 + " " +
+                                       groupId + " " + (previous.chunkSize > 0 ? to_string(previous.chunkSize) : "cdc") + " " +
+                                       previous.fileSHA1 + " " + to_string(payload.length()) + "\n" + payload;
+                if (!sendAll(trackerSocket, updateCommand.c_str(), updateCommand.length())) {
+                    alertPrompt("Failed to send update_file_bin command to tracker.", false);
                     continue;
                 }
-
-                // Receive response
                 readSize = recv(trackerSocket, buffer, BUFFER_SIZE - 1, 0);
                 if (readSize > 0) {
                     buffer[readSize] = '\0';
                     cout << buffer;
-
-                    // Optionally, add the file to ownedFilesInfo if upload is successful
-                    if (strstr(buffer, "success") != NULL || strstr(buffer, "created") != NULL || strstr(buffer, "File already exists. Added you as a sharer.") != NULL) {
-                        OwnedFileInfo ownedFile;
-                        ownedFile.filePath = filePath;
-                        ownedFile.fileSHA1 = fileSha1;
-                        ownedFile.chunkSHA1s = chunkSha1s;
-                        ownedFile.totalChunks = totalChunksLocal;
-                        ownedFilesInfo[getBaseName(filePath)] = ownedFile;
+                    if (strstr(buffer, "File updated") != NULL) {
+                        // Build the new version aside; the peer server may be reading the old one
+                        OwnedFileInfo updated = previous;
+                        updated.fileSize = st.st_size;
+                        updated.mtimeNs = statMtimeNs(st);
+                        updated.inode = st.st_ino;
+                        updated.fileSHA1 = fileSha1;
+                        updated.chunkSHA1s = chunkSha1s;
+                        updated.totalChunks = chunkSha1s.size();
+                        updated.chunkOffsets = chunkOffsets;
+                        updated.chunkLengths = chunkLengths;
+                        pthread_mutex_lock(&ownedFilesMutex);
+                        ownedIt->second = updated;
+                        pthread_mutex_unlock(&ownedFilesMutex);
+                        indexFileChunks(filePath, chunkSha1s, chunkOffsets, chunkLengths);
+                        saveShareRegistry();
                     }
                 } else if (readSize == 0) {
                     alertPrompt("Tracker closed the connection.", false);
@@ -830,122 +5378,59 @@ void* trackerCommunication(void* arg) {
                 }
                 break;
             }
-            case CommandType::DOWNLOAD_FILE: {
-                // Expected format: download_file <group_id> <file_name> <destination_path>
+            case CommandType::DOWNLOAD_DIR: {
+                // Expected format: download_dir <group_id> <share_name> <destination_path>
                 if (tokens.size() != 4) {
-                    cout << "Usage: download_file <group_id> <file_name> <destination_path>" << endl;
+                    cout << "Usage: download_dir <group_id> <share_name> <destination_path>" << endl;
                     continue;
                 }
-
                 string groupId = tokens.get(1);
-                string fileName = tokens.get(2);
+                string shareName = tokens.get(2);
                 string destinationPath = tokens.get(3);
-                downloadFileName = fileName;
-
-                // Prepare download_file command
-                string downloadCommand = "download_file " + groupId + " " + fileName + "\n";
+                downloadGroupId = groupId;
+                downloadFileName = shareName;
 
-                // Send download_file command to tracker
+                string downloadCommand = "download_file " + groupId + " " + shareName + "\n";
                 if (!sendAll(trackerSocket, downloadCommand.c_str(), downloadCommand.length())) {
                     alertPrompt("Failed to send download_file command to tracker.", false);
                     continue;
                 }
-
-                // Receive response from tracker
-                readSize = recv(trackerSocket, buffer, BUFFER_SIZE - 1, 0);
+                string responseStr;
+                readSize = recvTrackerResponse(responseStr);
                 if (readSize > 0) {
-                    buffer[readSize] = '\0';
-                    string responseStr(buffer);
-                    cout << responseStr;
-
                     if (responseStr.find("Error:") == 0) {
+                        cout << responseStr;
                         continue;
                     }
-
-                    // Parse the download_info response
-                    istringstream responseStream(responseStr);
-                    string infoTag;
-                    responseStream >> infoTag;
-                    if (infoTag != "download_info") {
-                        alertPrompt("Invalid response from tracker.", false);
+                    if (!parseDownloadInfo(responseStr, downloadFileSize, downloadChunkSize, downloadFileSha1, downloadMerkleRoot, chunkInfoList, downloadErasure, downloadSwarmPeers)) {
                         continue;
                     }
-
-                    // Extract file metadata
-                    responseStream >> downloadFileSize >> totalChunks;
-                    int chunkSize;
-                    responseStream >> chunkSize;
-                    responseStream >> downloadFileSha1;
-
-                    // Extract chunk availability and peer info
-                    chunkInfoList.clear();
+                    totalChunks = chunkInfoList.size();
+                    resetSwarmFile();
                     chunkData.clear();
-                    for (int i = 0; i < totalChunks; ++i) {
-                        ChunkInfo chunk;
-                        responseStream >> chunk.chunkIndex >> chunk.availability >> chunk.expectedSha1;
-                        for (int j = 0; j < chunk.availability; ++j) {
-                            PeerInfo peer;
-                            responseStream >> peer.userId >> peer.ip >> peer.port;
-                            chunk.peersWithChunk.add(peer);
-                        }
-                        chunkInfoList.add(chunk);
-                    }
-
-                    // Implement the rarest first strategy by sorting the chunkInfoList
-                    chunkInfoList.sort([](const ChunkInfo& a, const ChunkInfo& b) -> bool {
-                        return a.availability < b.availability;
-                    });
-
-                    // Start downloading chunks using threads
-                    ArrayList<pthread_t> threads;
-                    for (int i = 0; i < chunkInfoList.size(); ++i) {
-                        pthread_t tid;
-                        int* arg = new int;
-                        *arg = i; // Index into chunkInfoList
-                        if (pthread_create(&tid, NULL, downloadChunk, arg) != 0) {
-                            alertPrompt("Failed to create thread for chunk " + to_string(chunkInfoList.get(i).chunkIndex), false);
-                            delete arg;
-                            continue;
-                        }
-                        threads.add(tid);
-                    }
-
-                    
-                    for (int i = 0; i < threads.size(); ++i) {
-                        pthread_join(threads.get(i), NULL);
-                    }
-
-                    
-                    downloadFilePath = destinationPath + "/" + fileName;
-                    int outfile_fd = open(downloadFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                    if (outfile_fd < 0) {
-                        alertPrompt("Could not create output file: " + downloadFilePath, true);
+                    localChunkSources.clear();
+
+                    // The packed space is streamed to a temporary file, so chunks leave memory as soon as
+                    // the written prefix reaches them, and verified before any file is written
+                    string rootPath = destinationPath + "/" + shareName;
+                    downloadFilePath = rootPath + PACKED_SUFFIX;
+                    int packedFd = open(downloadFilePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+                    if (packedFd < 0) {
+                        alertPrompt("Could not create temporary file: " + downloadFilePath, true);
                         continue;
                     }
-
-                    for (int i = 0; i < totalChunks; ++i) {
-                        pthread_mutex_lock(&downloadMutex);
-                        auto it = chunkData.find(i);
-                        pthread_mutex_unlock(&downloadMutex);
-                        if (it != chunkData.end()) {
-                            const string& data = it->second;
-                            if (write(outfile_fd, data.c_str(), data.length()) < 0) {
-                                alertPrompt("Failed to write to output file: " + downloadFilePath, true);
-                                break;
-                            }
-                        } else {
-                            alertPrompt("Missing chunk " + to_string(i), false);
-                        }
-                    }
-                    close(outfile_fd);
-
-                    
-                    string downloadedFileSha1 = computeFileSHA1(downloadFilePath);          // Verify the downloaded file
-                    if (downloadedFileSha1 == downloadFileSha1) {
-                        cout << "File downloaded and verified successfully." << endl;
-                    } else {
-                        alertPrompt("File verification failed for " + downloadFilePath, false);
+                    string streamedSha1 = runDownloadEngine(true, packedFd);
+                    int fileCount = 0;
+                    if (streamedSha1 != downloadFileSha1 || downloadWatermark != downloadFileSize) {
+                        alertPrompt("Directory share verification failed for " + shareName, false);
+                    } else if (unpackDirectory(rootPath, packedFd, downloadChunkSize, downloadFileSize, fileCount)) {
+                        cout << "Unpacked " << fileCount << " files into " << rootPath << " and verified successfully." << endl;
                     }
+                    close(packedFd);
+                    unlink(downloadFilePath.c_str());
+                    unlink((downloadFilePath + ".watermark").c_str());
+                    downloadFilePath = rootPath;
+                    chunkData.clear();
                 } else if (readSize == 0) {
                     alertPrompt("Tracker closed the connection.", false);
                     clientRunning = false;
@@ -957,6 +5442,152 @@ void* trackerCommunication(void* arg) {
                 }
                 break;
             }
+            case CommandType::SET_RATE: {
+                // Expected format: set_rate <upload|download> <global_KBps> [per_peer_KBps]
+                if (tokens.size() < 3 || tokens.size() > 4 || (tokens.get(1) != "upload" && tokens.get(1) != "download")) {
+                    cout << "Usage: set_rate <upload|download> <global_KBps> [per_peer_KBps] (0 = unlimited)" << endl;
+                    continue;
+                }
+
+                long globalRate = myAtol(tokens.get(2)) * 1024;
+                bool isUpload = tokens.get(1) == "upload";
+                (isUpload ? uploadBucket : downloadBucket).setRate(globalRate);
+                if (tokens.size() == 4) {
+                    long peerRate = myAtol(tokens.get(3)) * 1024;
+                    if (isUpload) {
+                        setPeerRates(uploadPeers, perPeerUploadRate, peerRate);
+                    } else {
+                        setPeerRates(downloadPeers, perPeerDownloadRate, peerRate);
+                    }
+                }
+                printRates();
+                break;
+            }
+            case CommandType::SHOW_RATES: {
+                printRates();
+                break;
+            }
+            case CommandType::BENCH_ERASURE: {
+                // Expected format: bench_erasure [data_shards parity_shards]
+                int k = tokens.size() == 3 ? myAtoi(tokens.get(1)) : 10;
+                int m = tokens.size() == 3 ? myAtoi(tokens.get(2)) : 4;
+                if ((tokens.size() != 1 && tokens.size() != 3) || k < 1 || m < 1 || k + m > 255) {
+                    cout << "Usage: bench_erasure [data_shards parity_shards]" << endl;
+                    continue;
+                }
+                benchErasure(k, m);
+                break;
+            }
+            case CommandType::SET_TIMEOUTS: {
+                // Expected format: set_timeouts <connect_ms> <first_byte_ms> <stall_ms>
+                if (tokens.size() != 4 || myAtol(tokens.get(1)) <= 0 || myAtol(tokens.get(2)) <= 0 || myAtol(tokens.get(3)) <= 0) {
+                    cout << "Usage: set_timeouts <connect_ms> <first_byte_ms> <stall_ms>" << endl;
+                    continue;
+                }
+                connectTimeoutMs = myAtol(tokens.get(1));
+                firstByteTimeoutMs = myAtol(tokens.get(2));
+                stallTimeoutMs = myAtol(tokens.get(3));
+                printTimeouts();
+                break;
+            }
+            case CommandType::SHOW_TIMEOUTS: {
+                printTimeouts();
+                break;
+            }
+            case CommandType::SET_SLOTS: {
+                // Expected format: set_slots <count>
+                if (tokens.size() != 2 || myAtoi(tokens.get(1)) < 0) {
+                    cout << "Usage: set_slots <count> (0 = serve every downloader in arrival order)" << endl;
+                    continue;
+                }
+                pthread_mutex_lock(&slotMutex);
+                uploadSlotCount = myAtoi(tokens.get(1));
+                lastChokeRound = 0; // Re-rank on the next request
+                pthread_mutex_unlock(&slotMutex);
+                printUploadSlots();
+                break;
+            }
+            case CommandType::SHOW_SLOTS: {
+                printUploadSlots();
+                break;
+            }
+            case CommandType::SUPER_SEED: {
+                // Expected format: super_seed <file_name> [on|off]
+                if ((tokens.size() != 2 && tokens.size() != 3) || (tokens.size() == 3 && tokens.get(2) != "on" && tokens.get(2) != "off")) {
+                    cout << "Usage: super_seed <file_name> [on|off]" << endl;
+                    continue;
+                }
+                auto ownedIt = ownedFilesInfo.find(tokens.get(1));
+                if (ownedIt == ownedFilesInfo.end()) {
+                    alertPrompt("Error: You are not sharing " + tokens.get(1) + ".", false);
+                    continue;
+                }
+                if (tokens.size() == 3 && tokens.get(2) == "on") {
+                    if (!ownedIt->second.merkleLayers.isEmpty()) {
+                        alertPrompt("Error: Merkle downloads do not exchange bitfields, so they cannot be super-seeded.", false);
+                        continue;
+                    }
+                    pthread_mutex_lock(&superSeedMutex);
+                    if (superSeeds.count(tokens.get(1)) == 0) superSeeds[tokens.get(1)] = SuperSeedState();
+                    pthread_mutex_unlock(&superSeedMutex);
+                } else if (tokens.size() == 3) {
+                    printSuperSeed(tokens.get(1));
+                    pthread_mutex_lock(&superSeedMutex);
+                    superSeeds.erase(tokens.get(1));
+                    pthread_mutex_unlock(&superSeedMutex);
+                    continue;
+                }
+                printSuperSeed(tokens.get(1));
+                break;
+            }
+            case CommandType::SET_VERIFY: {
+                // Expected format: set_verify <stream|full>
+                if (tokens.size() != 2 || (tokens.get(1) != "stream" && tokens.get(1) != "full")) {
+                    cout << "Usage: set_verify <stream|full>" << endl;
+                    continue;
+                }
+                verifyMode = tokens.get(1);
+                cout << "Downloads are verified by " << (verifyMode == "stream" ? "hashing chunks in order as they arrive" : "re-reading the whole file") << "." << endl;
+                break;
+            }
+            case CommandType::SET_MANIFEST: {
+                // Expected format: set_manifest <binary|text>
+                if (tokens.size() != 2 || (tokens.get(1) != "binary" && tokens.get(1) != "text")) {
+                    cout << "Usage: set_manifest <binary|text>" << endl;
+                    continue;
+                }
+                binaryManifest = tokens.get(1) == "binary";
+                cout << "Chunk hashes are uploaded as " << (binaryManifest ? "raw binary digests" : "hex text") << "." << endl;
+                break;
+            }
+            case CommandType::SET_IO: {
+                // Expected format: set_io <uring|sync>
+                if (tokens.size() != 2 || (tokens.get(1) != "uring" && tokens.get(1) != "sync")) {
+                    cout << "Usage: set_io <uring|sync>" << endl;
+                    continue;
+                }
+                if (tokens.get(1) == "uring" && !writeIo.start()) {
+                    cout << "io_uring is not available (compile with -DUSE_IO_URING on Linux 5.6 or newer)." << endl;
+                    continue;
+                }
+                ioUringEnabled = tokens.get(1) == "uring";
+                cout << "Chunk I/O now uses " << (ioUringEnabled ? "io_uring" : "blocking syscalls") << "." << endl;
+                break;
+            }
+            case CommandType::SET_COMPRESSION: {
+                // Expected format: set_compression <on|off>
+                if (tokens.size() != 2 || (tokens.get(1) != "on" && tokens.get(1) != "off")) {
+                    cout << "Usage: set_compression <on|off>" << endl;
+                    continue;
+                }
+                if (tokens.get(1) == "on" && localCodecs().empty()) {
+                    cout << "Compression is not available in this build (compile with -DUSE_ZLIB -lz)." << endl;
+                    continue;
+                }
+                compressionEnabled = tokens.get(1) == "on";
+                cout << "Chunk compression " << (compressionEnabled ? "enabled" : "disabled") << "." << endl;
+                break;
+            }
             case CommandType::QUIT: {
                 string quitCommand = "quit\n";
                 if (!sendAll(trackerSocket, quitCommand.c_str(), quitCommand.length())) {
@@ -971,6 +5602,34 @@ void* trackerCommunication(void* arg) {
                 clientRunning = false;
                 break;
             }
+            case CommandType::LOGOUT: {
+                string commandToSend = command + "\n";
+                if (!sendAll(trackerSocket, commandToSend.c_str(), commandToSend.length())) {
+                    alertPrompt("Failed to send command to tracker.", false);
+                    continue;
+                }
+
+                // Receive response
+                readSize = recv(trackerSocket, buffer, BUFFER_SIZE - 1, 0);
+                if (readSize > 0) {
+                    buffer[readSize] = '\0';
+                    cout << buffer;
+                    if (strstr(buffer, "Logout successful") != NULL) {
+                        pthread_mutex_lock(&userMutex);
+                        currentUserId.clear();
+                        pthread_mutex_unlock(&userMutex);
+                    }
+                } else if (readSize == 0) {
+                    alertPrompt("Tracker closed the connection.", false);
+                    clientRunning = false;
+                    break;
+                } else {
+                    alertPrompt("recv failed", true);
+                    clientRunning = false;
+                    break;
+                }
+                break;
+            }
             default: {
                 
                 string commandToSend = command + "\n";
@@ -997,6 +5656,9 @@ void* trackerCommunication(void* arg) {
             }
         }
     }
+    if (holdingTracker) {
+        pthread_mutex_unlock(&trackerMutex);
+    }
 
     pthread_exit(NULL);
 }
@@ -1005,9 +5667,15 @@ void* trackerCommunication(void* arg) {
 int main(int argc, char* argv[]) {
     
     signal(SIGINT, signalHandler);
+    // A downloader that gives up on a chunk closes its socket while we may still be sending it;
+    // the send then fails with EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
 
     // Initialize OpenSSL
     OpenSSL_add_all_digests();
+    initGearTable();
+    initErasureCoding();
+    srand(time(NULL) ^ getpid()); // Retry backoff jitter
 
     if (argc != 3) {
         alertPrompt("Usage: " + string(argv[0]) + " <clientIp:clientPort> <tracker_info.txt>", false);
@@ -1026,6 +5694,7 @@ int main(int argc, char* argv[]) {
     string clientIp = substring(clientIpPort, 0, colonPos);
     string portStr = substring(clientIpPort, colonPos + 1, clientIpPort.length() - colonPos - 1);
     clientListenPort = myAtoi(portStr);
+    clientListenIp = clientIp;
 
     // Read tracker IP and port from tracker_info.txt using system calls
     int trackerInfoFd = open(trackerInfoFile.c_str(), O_RDONLY);
@@ -1081,6 +5750,9 @@ int main(int argc, char* argv[]) {
 
     cout << "Connected to tracker at " << trackerIp << ":" << trackerPort << endl;
 
+    // Warm start: serve previously shared files without re-hashing them
+    loadShareRegistry();
+
     // Start peer server thread
     pthread_t peerServerThread;
     int* peerPortArg = new int(clientListenPort);
@@ -1101,11 +5773,21 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Periodic peer health and upload load reports to the tracker
+    pthread_t healthReporterThread;
+    bool healthReporterStarted = pthread_create(&healthReporterThread, NULL, healthReporter, NULL) == 0;
+    if (!healthReporterStarted) {
+        alertPrompt("Could not create health reporter thread; peer health will only be reported after downloads.", false);
+    }
+
     
     pthread_join(trackerCommThread, NULL);
 
     
     clientRunning = false;
+    if (healthReporterStarted) {
+        pthread_join(healthReporterThread, NULL);
+    }
     close(trackerSocket);
     pthread_cancel(peerServerThread);
     pthread_join(peerServerThread, NULL);
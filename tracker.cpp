@@ -16,16 +16,26 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 
 #define BUFFER_SIZE 1024
-#define CHUNK_SIZE (512 * 1024) // 512KB
+#define RECV_BUFFER_SIZE (64 * 1024) // Per-recv read size for client commands and manifests
+#define MAX_COMMAND_SIZE (64 * 1024 * 1024) // Largest command line accepted from a client
+#define DIGEST_SIZE 20                      // Raw SHA1 length
+#define SWARM_BOOTSTRAP_PEERS 32            // Recent downloaders listed in download_info for peer bitfield exchange
+#define DEFAULT_PEERS_PER_CHUNK 8           // Peers listed per chunk (and Merkle sharers) in download_info
+#define HEALTH_HALF_LIFE_MS 60000           // Reported transfer outcomes lose half their weight in this time
+#define HEALTH_EXCLUDE_BELOW 0.25           // Peers scoring lower are only listed when a chunk has no one else
+#define HEALTH_MAX_REPORTED 64              // Most transfers of each outcome one report may count for a peer
 
 // Enums for Command Types
 enum class CommandType {
     CREATE_USER,
     LOGIN,
+    LOGOUT,
     CREATE_GROUP,
     JOIN_GROUP,
     LEAVE_GROUP,
@@ -34,7 +44,11 @@ enum class CommandType {
     ACCEPT_REQUEST,
     LIST_FILES,
     UPLOAD_FILE,
+    UPLOAD_FILE_BIN,
+    ANNOUNCE_BATCH,
+    UPDATE_FILE_BIN,
     DOWNLOAD_FILE,
+    REPORT_HEALTH,
     SHUTDOWN,
     QUIT,
     UNKNOWN
@@ -44,6 +58,7 @@ enum class CommandType {
 CommandType getCommandType(const string& command) {
     if (command == "create_user") return CommandType::CREATE_USER;
     if (command == "login") return CommandType::LOGIN;
+    if (command == "logout") return CommandType::LOGOUT;
     if (command == "create_group") return CommandType::CREATE_GROUP;
     if (command == "join_group") return CommandType::JOIN_GROUP;
     if (command == "leave_group") return CommandType::LEAVE_GROUP;
@@ -52,7 +67,11 @@ CommandType getCommandType(const string& command) {
     if (command == "accept_request") return CommandType::ACCEPT_REQUEST;
     if (command == "list_files") return CommandType::LIST_FILES;
     if (command == "upload_file") return CommandType::UPLOAD_FILE;
+    if (command == "upload_file_bin") return CommandType::UPLOAD_FILE_BIN;
+    if (command == "announce_batch") return CommandType::ANNOUNCE_BATCH;
+    if (command == "update_file_bin") return CommandType::UPDATE_FILE_BIN;
     if (command == "download_file") return CommandType::DOWNLOAD_FILE;
+    if (command == "report_health") return CommandType::REPORT_HEALTH;
     if (command == "shutdown") return CommandType::SHUTDOWN;
     if (command == "quit") return CommandType::QUIT;
     return CommandType::UNKNOWN;
@@ -240,15 +259,78 @@ public:
     string fileName;
     string fileSize;
     string fileSha1;
-    ArrayList<string> chunkSha1s;
-    map<string, ArrayList<int>> userChunks; // userId -> list of chunk indices
+    long chunkSize; // Chosen by the uploader, in bytes; 0 for content-defined chunks
+    string chunkDigests;          // Raw 20-byte chunk SHA1s, concatenated
+    ArrayList<long> chunkOffsets; // Only for content-defined chunks
+    ArrayList<long> chunkLengths; // Only for content-defined chunks
+    int chunkCount;
+    string merkleRoot; // Set for Merkle manifests, which keep no per-chunk hashes
+    int version;       // Bumped by update_file_bin
+    int dataShards;    // Erasure coding: parity chunks follow the data chunks, parityShards per
+    int parityShards;  // stripe of dataShards data chunks; both 0 when the file has no parity
+    map<string, ArrayList<int>> userChunks; // userId -> list of chunk indices (empty list = whole file)
+    ArrayList<string> recentDownloaders;    // Most recent last; peers ask them for chunk bitfields
 
     // Default constructor
-    File() {}
+    File() : chunkSize(0), chunkCount(0), version(1), dataShards(0), parityShards(0) {}
 
     // Parameterized constructor
-    File(const string& name, const string& size, const string& sha1, const ArrayList<string>& chunks)
-        : fileName(name), fileSize(size), fileSha1(sha1), chunkSha1s(chunks) {}
+    File(const string& name, const string& size, const string& sha1, long chunkSz, const string& digests, int count)
+        : fileName(name), fileSize(size), fileSha1(sha1), chunkSize(chunkSz), chunkDigests(digests), chunkCount(count),
+          version(1), dataShards(0), parityShards(0) {}
+
+    // Hex SHA1 of one chunk
+    string chunkSha1(int index) const {
+        static const char* hexDigits = "0123456789abcdef";
+        string hex(2 * DIGEST_SIZE, '0');
+        for (int i = 0; i < DIGEST_SIZE; ++i) {
+            unsigned char byte = chunkDigests[index * DIGEST_SIZE + i];
+            hex[2 * i] = hexDigits[byte >> 4];
+            hex[2 * i + 1] = hexDigits[byte & 0x0F];
+        }
+        return hex;
+    }
+};
+
+// How download_info picks the peers listed for each chunk
+enum class PeerRanking {
+    RANDOM, // Shuffled
+    LRU,    // Least recently handed out first
+    LOAD,   // Lowest reported upload load first, then the healthiest
+    SUBNET  // Longest IPv4 prefix shared with the requester first
+};
+
+// What the tracker knows about a peer when ranking it
+struct PeerStats {
+    long long lastHandedOut; // Handout sequence number when last listed (0 = never)
+    long long handouts;      // Times listed in download_info
+    int load;                // Downloaders the peer was serving at its last report_health
+    double goodTransfers;    // Chunk transfers from the peer that others reported as successful,
+    double badTransfers;     // and as failed or timed out; both decay with HEALTH_HALF_LIFE_MS
+    double rateKBps;         // Smoothed transfer rate others reported from the peer
+    long long decayedAt;     // Time the transfer counts were last decayed (ms)
+    int reports;             // Health reports that mentioned the peer
+    string networkIp;        // Address compared by subnet ranking
+    map<string, long long> handedPeers; // Peers listed to this user since login -> handout sequence number;
+                                        // its health reports may only mention these
+};
+
+// A parsed upload_file or upload_file_bin request
+struct UploadManifest {
+    string fileName;
+    string fileSize;
+    string fileSha1;
+    string groupId;
+    long chunkSize; // 0 for content-defined chunks
+    string chunkDigests;
+    int chunkCount;
+    ArrayList<long> chunkOffsets;
+    ArrayList<long> chunkLengths;
+    string merkleRoot;
+    int dataShards;   // Erasure-coded uploads: data and parity chunks per stripe
+    int parityShards;
+
+    UploadManifest() : chunkSize(0), chunkCount(0), dataShards(0), parityShards(0) {}
 };
 
 // Global Variables
@@ -260,6 +342,12 @@ map<string, ArrayList<File>> groupFiles;      // groupId -> List of Files
 // Map of userId to their IP and port
 map<string, pair<string, int>> userIpPortMap; // userId -> (IP, port)
 
+// Peer ranking for download_info; guarded by usersMutex
+PeerRanking peerRanking = PeerRanking::LRU;
+int peersPerChunk = DEFAULT_PEERS_PER_CHUNK;
+map<string, PeerStats> peerStats; // userId -> ranking state
+long long handoutClock = 0;
+
 // Mutexes for thread safety
 pthread_mutex_t usersMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t groupsMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -288,6 +376,7 @@ void signalHandler(int signum);
 // Command Handlers
 void handleCreateUser(const ArrayList<string>& tokens, int clientSock, string& response);
 void handleLogin(const ArrayList<string>& tokens, int clientSock, string& response);
+void handleLogout(const ArrayList<string>& tokens, int clientSock, string& response);
 void handleCreateGroup(const ArrayList<string>& tokens, int clientSock, string& response);
 void handleJoinGroup(const ArrayList<string>& tokens, int clientSock, string& response);
 void handleLeaveGroup(const ArrayList<string>& tokens, int clientSock, string& response);
@@ -296,7 +385,18 @@ void handleListRequests(const ArrayList<string>& tokens, int clientSock, string&
 void handleAcceptRequest(const ArrayList<string>& tokens, int clientSock, string& response);
 void handleListFiles(const ArrayList<string>& tokens, int clientSock, string& response);
 void handleUploadFile(const ArrayList<string>& tokens, int clientSock, string& response);
+void handleUploadFileBinary(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response);
+bool appendHexDigest(const string& hex, string& digests);
+void registerUpload(const UploadManifest& manifest, int clientSock, string& response);
+bool validateManifest(const UploadManifest& manifest, string& response);
+bool isGroupMember(Group* group, const string& userId);
+bool parseBinaryDigests(const string& payload, size_t start, size_t length, UploadManifest& manifest, string& response);
+void handleAnnounceBatch(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response);
+void handleUpdateFileBinary(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response);
 void handleDownloadFile(const ArrayList<string>& tokens, int clientSock, string& response);
+void rankPeers(ArrayList<string>& peers, const string& requesterId);
+void handleReportHealth(const ArrayList<string>& tokens, int clientSock, string& response);
+bool parsePeerRanking(const string& name, PeerRanking& ranking);
 void handleShutdown(const ArrayList<string>& tokens, int clientSock, string& response);
 
 
@@ -324,6 +424,13 @@ long myAtol(const string& s) {
     }
 }
 
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
 
 void signalHandler(int signum) {
     cout << "\nInterrupt signal (" << signum << ") received. Shutting down tracker..." << endl;
@@ -337,7 +444,7 @@ void signalHandler(int signum) {
 }
 
 
-bool handleCommand(const ArrayList<string>& tokens, int clientSock, string& response) {
+bool handleCommand(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response) {
     if (tokens.size() == 0) {
         response = "Invalid command.";
         return true;
@@ -353,6 +460,9 @@ bool handleCommand(const ArrayList<string>& tokens, int clientSock, string& resp
         case CommandType::LOGIN:
             handleLogin(tokens, clientSock, response);
             break;
+        case CommandType::LOGOUT:
+            handleLogout(tokens, clientSock, response);
+            break;
         case CommandType::CREATE_GROUP:
             handleCreateGroup(tokens, clientSock, response);
             break;
@@ -377,9 +487,21 @@ bool handleCommand(const ArrayList<string>& tokens, int clientSock, string& resp
         case CommandType::UPLOAD_FILE:
             handleUploadFile(tokens, clientSock, response);
             break;
+        case CommandType::UPLOAD_FILE_BIN:
+            handleUploadFileBinary(tokens, payload, clientSock, response);
+            break;
+        case CommandType::ANNOUNCE_BATCH:
+            handleAnnounceBatch(tokens, payload, clientSock, response);
+            break;
+        case CommandType::UPDATE_FILE_BIN:
+            handleUpdateFileBinary(tokens, payload, clientSock, response);
+            break;
         case CommandType::DOWNLOAD_FILE:
             handleDownloadFile(tokens, clientSock, response);
             break;
+        case CommandType::REPORT_HEALTH:
+            handleReportHealth(tokens, clientSock, response);
+            break;
         case CommandType::SHUTDOWN:
             handleShutdown(tokens, clientSock, response);
             break;
@@ -446,11 +568,51 @@ void handleLogin(const ArrayList<string>& tokens, int clientSock, string& respon
         // Update userIpPortMap
         userIpPortMap[userId] = make_pair(ip, port);
 
+        // A peer that logs in again starts with a clean health record
+        PeerStats& stats = peerStats[userId];
+        stats.load = 0;
+        stats.goodTransfers = stats.badTransfers = stats.rateKBps = 0;
+        stats.handedPeers.clear();
+
+        // Subnet ranking compares the listen address, unless the peer listens on every interface,
+        // which tells nothing about where it is; the address its tracker connection comes from is used then
+        stats.networkIp = ip;
+        sockaddr_in connectionAddr;
+        socklen_t addrLength = sizeof(connectionAddr);
+        if (ip == "0.0.0.0" && getpeername(clientSock, (sockaddr*)&connectionAddr, &addrLength) == 0) {
+            stats.networkIp = inet_ntoa(connectionAddr.sin_addr);
+        }
+
         response = "Login successful.";
     }
     pthread_mutex_unlock(&usersMutex);
 }
 
+void handleLogout(const ArrayList<string>& tokens, int clientSock, string& response) {
+    if (tokens.size() != 1) {
+        response = "Usage: logout";
+        return;
+    }
+
+    pthread_mutex_lock(&usersMutex);
+    auto it = clientUserMap.find(clientSock);
+    if (it == clientUserMap.end()) {
+        response = "Error: Please login first.";
+    }
+    else {
+        string userId = it->second;
+        if (users.find(userId) != users.end()) {
+            users.at(userId)->setLoginStatus(false);
+            users.at(userId)->ip = "";
+            users.at(userId)->port = 0;
+        }
+        clientUserMap.erase(it);
+        userIpPortMap.erase(userId);
+        response = "Logout successful.";
+    }
+    pthread_mutex_unlock(&usersMutex);
+}
+
 void handleCreateGroup(const ArrayList<string>& tokens, int clientSock, string& response) {
     if (tokens.size() != 2) {
         response = "Usage: create_group <group_id>";
@@ -716,7 +878,11 @@ void handleListFiles(const ArrayList<string>& tokens, int clientSock, string& re
                     response = "Files in group " + groupId + ":\n";
                     ArrayList<File>& files = groupFiles[groupId];
                     for (int i = 0; i < files.size(); ++i) {
-                        response += files.get(i).fileName + "\n";
+                        response += files.get(i).fileName;
+                        if (files.get(i).version > 1) {
+                            response += " (version " + to_string(files.get(i).version) + ")";
+                        }
+                        response += "\n";
                     }
                 }
             }
@@ -727,61 +893,254 @@ void handleListFiles(const ArrayList<string>& tokens, int clientSock, string& re
 }
 
 void handleUploadFile(const ArrayList<string>& tokens, int clientSock, string& response) {
-    if (tokens.size() < 6) {
-        response = "Usage: upload_file <file_name> <file_size> <file_sha1> <group_id> <chunk_sha1s...>";
+    if (tokens.size() < 7) {
+        response = "Usage: upload_file <file_name> <file_size> <file_sha1> <group_id> <chunk_size|cdc> <chunk_sha1s...|merkle <root> <chunk_count>>";
         return;
     }
 
-    string fileName = tokens.get(1);
-    string fileSize = tokens.get(2);
-    string fileSha1 = tokens.get(3);
-    string groupId = tokens.get(4);
+    UploadManifest manifest;
+    manifest.fileName = tokens.get(1);
+    manifest.fileSize = tokens.get(2);
+    manifest.fileSha1 = tokens.get(3);
+    manifest.groupId = tokens.get(4);
+    bool contentDefined = tokens.get(5) == "cdc";
+    manifest.chunkSize = contentDefined ? 0 : myAtol(tokens.get(5));
 
-    // Collect chunk SHA1s
-    ArrayList<string> chunkSha1s;
-    for (int i = 5; i < tokens.size(); ++i) {
-        chunkSha1s.add(tokens.get(i));
+    // A Merkle manifest replaces the chunk list with its root hash and the chunk count
+    bool merkle = tokens.get(6) == "merkle";
+    if (merkle) {
+        if (contentDefined || tokens.size() != 9) {
+            response = "Error: Merkle manifests need a fixed chunk size, a root and a chunk count.";
+            return;
+        }
+        manifest.merkleRoot = tokens.get(7);
+        manifest.chunkCount = myAtoi(tokens.get(8));
+        registerUpload(manifest, clientSock, response);
+        return;
     }
 
-    pthread_mutex_lock(&groupsMutex);
-    if (groups.find(groupId) == groups.end()) {
-        response = "Error: Group does not exist.";
-        pthread_mutex_unlock(&groupsMutex);
+    // Collect chunk SHA1s; content-defined chunks are sent as <sha1>:<length>
+    long nextOffset = 0;
+    manifest.chunkDigests.reserve((tokens.size() - 6) * DIGEST_SIZE);
+    for (int i = 6; i < tokens.size(); ++i) {
+        const string& token = tokens.get(i);
+        size_t colonPos = contentDefined ? token.find(':') : token.length();
+        long length = contentDefined && colonPos != string::npos ? myAtol(token.substr(colonPos + 1)) : 0;
+        if (!appendHexDigest(token.substr(0, colonPos), manifest.chunkDigests) || (contentDefined && length <= 0)) {
+            response = "Error: Invalid chunk " + token + ".";
+            return;
+        }
+        if (contentDefined) {
+            manifest.chunkOffsets.add(nextOffset);
+            manifest.chunkLengths.add(length);
+            nextOffset += length;
+        }
+    }
+    manifest.chunkCount = tokens.size() - 6;
+    registerUpload(manifest, clientSock, response);
+}
+
+// upload_file_bin <file_name> <file_size> <file_sha1> <group_id> <chunk_size|cdc> <payload_bytes>
+// followed by the payload: 20 raw SHA1 bytes per chunk, each followed by a 4-byte big-endian
+// length for content-defined chunks. The digests are kept as received, with no string per chunk.
+void handleUploadFileBinary(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response) {
+    bool erasureCoded = tokens.size() == 10 && tokens.get(6) == "rs";
+    if (tokens.size() != 7 && !erasureCoded) {
+        response = "Usage: upload_file_bin <file_name> <file_size> <file_sha1> <group_id> <chunk_size|cdc> [rs <data> <parity>] <payload_bytes>";
+        return;
+    }
+
+    UploadManifest manifest;
+    manifest.fileName = tokens.get(1);
+    manifest.fileSize = tokens.get(2);
+    manifest.fileSha1 = tokens.get(3);
+    manifest.groupId = tokens.get(4);
+    bool contentDefined = tokens.get(5) == "cdc";
+    manifest.chunkSize = contentDefined ? 0 : myAtol(tokens.get(5));
+    if (erasureCoded) {
+        manifest.dataShards = myAtoi(tokens.get(7));
+        manifest.parityShards = myAtoi(tokens.get(8));
+    }
+
+    if (!parseBinaryDigests(payload, 0, payload.length(), manifest, response)) {
+        return;
+    }
+    registerUpload(manifest, clientSock, response);
+}
+
+// update_file_bin <file_name> <file_size> <file_sha1> <group_id> <chunk_size|cdc> <previous_sha1> <payload_bytes>
+// followed by the binary chunk digests. Replaces the previous version of the file in the group. Sharers
+// of the previous version stay listed for every chunk whose hash is unchanged at the same index, so
+// downloaders only need the uploader for the chunks that changed.
+void handleUpdateFileBinary(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response) {
+    if (tokens.size() != 8) {
+        response = "Usage: update_file_bin <file_name> <file_size> <file_sha1> <group_id> <chunk_size|cdc> <previous_sha1> <payload_bytes>";
         return;
     }
 
+    UploadManifest manifest;
+    manifest.fileName = tokens.get(1);
+    manifest.fileSize = tokens.get(2);
+    manifest.fileSha1 = tokens.get(3);
+    manifest.groupId = tokens.get(4);
+    manifest.chunkSize = tokens.get(5) == "cdc" ? 0 : myAtol(tokens.get(5));
+    string previousSha1 = tokens.get(6);
+    if (!parseBinaryDigests(payload, 0, payload.length(), manifest, response) || !validateManifest(manifest, response)) {
+        return;
+    }
+
+    pthread_mutex_lock(&groupsMutex);
     pthread_mutex_lock(&usersMutex);
+    auto groupIt = groups.find(manifest.groupId);
     if (clientUserMap.find(clientSock) == clientUserMap.end()) {
         response = "Error: Please login first.";
-        pthread_mutex_unlock(&usersMutex);
-        pthread_mutex_unlock(&groupsMutex);
-        return;
+    } else if (groupIt == groups.end()) {
+        response = "Error: Group does not exist.";
+    } else if (!isGroupMember(groupIt->second, clientUserMap[clientSock])) {
+        response = "Error: Not a member of the group.";
+    } else {
+        string userId = clientUserMap[clientSock];
+        ArrayList<File>& files = groupFiles[manifest.groupId];
+        int previousIndex = -1;
+        for (int i = 0; i < files.size(); ++i) {
+            if (files.get(i).fileName == manifest.fileName && files.get(i).fileSha1 == previousSha1) {
+                previousIndex = i;
+                break;
+            }
+        }
+        if (previousIndex < 0) {
+            response = "Error: Previous version not found.";
+        } else if (previousSha1 == manifest.fileSha1) {
+            response = "File unchanged.";
+        } else {
+            const File& previous = files.get(previousIndex);
+            File updated(manifest.fileName, manifest.fileSize, manifest.fileSha1, manifest.chunkSize, manifest.chunkDigests, manifest.chunkCount);
+            updated.chunkOffsets = manifest.chunkOffsets;
+            updated.chunkLengths = manifest.chunkLengths;
+            updated.version = previous.version + 1;
+            for (int i = 0; i < updated.chunkCount; ++i) {
+                updated.userChunks[userId].add(i);
+            }
+
+            // Carry over the previous sharers of every chunk that kept its hash and position
+            map<string, bool> previousDigests;
+            for (int i = 0; i < previous.chunkCount && previous.merkleRoot.empty(); ++i) {
+                previousDigests[previous.chunkDigests.substr(i * DIGEST_SIZE, DIGEST_SIZE)] = true;
+            }
+            int unchangedChunks = 0, carriedChunks = 0;
+            for (int i = 0; i < updated.chunkCount; ++i) {
+                unchangedChunks += previousDigests.count(updated.chunkDigests.substr(i * DIGEST_SIZE, DIGEST_SIZE));
+            }
+            for (int i = 0; i < updated.chunkCount && previous.merkleRoot.empty(); ++i) {
+                bool samePosition = manifest.chunkSize > 0 ? manifest.chunkSize == previous.chunkSize : (i < previous.chunkLengths.size() &&
+                                  previous.chunkOffsets.get(i) == updated.chunkOffsets.get(i) &&
+                                  previous.chunkLengths.get(i) == updated.chunkLengths.get(i));
+                if (i >= previous.chunkCount || !samePosition ||
+                    previous.chunkDigests.compare(i * DIGEST_SIZE, DIGEST_SIZE, updated.chunkDigests, i * DIGEST_SIZE, DIGEST_SIZE) != 0) {
+                    continue;
+                }
+                carriedChunks++;
+                for (auto& sharer : previous.userChunks) {
+                    if (sharer.first == userId) continue;
+                    for (int j = 0; j < sharer.second.size(); ++j) {
+                        if (sharer.second.get(j) == i) {
+                            updated.userChunks[sharer.first].add(i);
+                            break;
+                        }
+                    }
+                }
+            }
+            files.get(previousIndex) = updated;
+            response = "File updated to version " + to_string(updated.version) + ": " + to_string(unchangedChunks) + " of " +
+                       to_string(updated.chunkCount) + " chunks unchanged, " + to_string(carriedChunks) +
+                       " still listed for previous sharers.";
+        }
     }
+    pthread_mutex_unlock(&usersMutex);
+    pthread_mutex_unlock(&groupsMutex);
+}
 
-    string userId = clientUserMap[clientSock];
-    Group* group = groups[groupId];
+// Fill a manifest's chunks from `length` bytes of binary digest records starting at `start`
+bool parseBinaryDigests(const string& payload, size_t start, size_t length, UploadManifest& manifest, string& response) {
+    bool contentDefined = manifest.chunkSize == 0;
+    size_t recordSize = contentDefined ? DIGEST_SIZE + 4 : DIGEST_SIZE;
+    if (length % recordSize != 0 || start + length > payload.length()) {
+        response = "Error: Binary manifest has a partial chunk record.";
+        return false;
+    }
+    manifest.chunkCount = length / recordSize;
+    if (!contentDefined) {
+        manifest.chunkDigests.assign(payload, start, length);
+        return true;
+    }
+    manifest.chunkDigests.reserve(manifest.chunkCount * DIGEST_SIZE);
+    long nextOffset = 0;
+    for (size_t pos = start; pos < start + length; pos += recordSize) {
+        const unsigned char* lengthBytes = reinterpret_cast<const unsigned char*>(payload.data() + pos + DIGEST_SIZE);
+        long chunkLength = (static_cast<long>(lengthBytes[0]) << 24) | (lengthBytes[1] << 16) | (lengthBytes[2] << 8) | lengthBytes[3];
+        if (chunkLength <= 0) {
+            response = "Error: Invalid content-defined chunk length.";
+            return false;
+        }
+        manifest.chunkDigests.append(payload, pos, DIGEST_SIZE);
+        manifest.chunkOffsets.add(nextOffset);
+        manifest.chunkLengths.add(chunkLength);
+        nextOffset += chunkLength;
+    }
+    return true;
+}
 
-    // Check if user is a member
-    bool isMember = false;
+// Parse a hex SHA1 and append its 20 raw bytes to `digests`
+bool appendHexDigest(const string& hex, string& digests) {
+    if (hex.length() != 2 * DIGEST_SIZE) return false;
+    for (int i = 0; i < DIGEST_SIZE; ++i) {
+        int high = hexValue(hex[2 * i]);
+        int low = hexValue(hex[2 * i + 1]);
+        if (high < 0 || low < 0) return false;
+        digests += static_cast<char>(high * 16 + low);
+    }
+    return true;
+}
+
+// Check that a manifest's chunks cover the file exactly; returns false with an error response otherwise
+bool validateManifest(const UploadManifest& manifest, string& response) {
+    long size = myAtol(manifest.fileSize);
+    bool contentDefined = manifest.chunkSize == 0;
+    long coveredBytes = 0;
+    for (int i = 0; i < manifest.chunkLengths.size(); ++i) {
+        coveredBytes += manifest.chunkLengths.get(i);
+    }
+    if (manifest.dataShards > 0 && (contentDefined || manifest.parityShards < 1 || manifest.dataShards + manifest.parityShards > 255)) {
+        response = "Error: Invalid erasure coding parameters.";
+        return false;
+    }
+    // Erasure-coded files list parityShards parity chunks per stripe after the data chunks
+    long dataChunks = manifest.chunkSize > 0 ? (size + manifest.chunkSize - 1) / manifest.chunkSize : 0;
+    long parityChunks = manifest.dataShards > 0 ? (dataChunks + manifest.dataShards - 1) / manifest.dataShards * manifest.parityShards : 0;
+    if (contentDefined ? coveredBytes != size
+                       : (manifest.chunkSize < 0 || size < 0 || dataChunks + parityChunks != manifest.chunkCount)) {
+        response = "Error: Chunk list does not match file size and chunk size.";
+        return false;
+    }
+    return true;
+}
+
+bool isGroupMember(Group* group, const string& userId) {
     for (int i = 0; i < group->members.size(); ++i) {
         if (group->members.get(i) == userId) {
-            isMember = true;
-            break;
+            return true;
         }
     }
+    return false;
+}
 
-    if (!isMember) {
-        response = "Error: Not a member of the group.";
-        pthread_mutex_unlock(&usersMutex);
-        pthread_mutex_unlock(&groupsMutex);
-        return;
-    }
-
+// Add the file, or the user as a sharer of an existing copy. Caller holds groupsMutex and usersMutex.
+void addSharerLocked(const UploadManifest& manifest, const string& userId, string& response) {
     // Check if file already exists in the group
     File* existingFile = nullptr;
-    ArrayList<File>& files = groupFiles[groupId];
+    ArrayList<File>& files = groupFiles[manifest.groupId];
     for (int i = 0; i < files.size(); ++i) {
-        if (files.get(i).fileName == fileName && files.get(i).fileSha1 == fileSha1) {
+        if (files.get(i).fileName == manifest.fileName && files.get(i).fileSha1 == manifest.fileSha1) {
             existingFile = &files.get(i);
             break;
         }
@@ -791,7 +1150,7 @@ void handleUploadFile(const ArrayList<string>& tokens, int clientSock, string& r
         // File exists; add user to userChunks if not already present
         if (existingFile->userChunks.find(userId) == existingFile->userChunks.end()) {
             existingFile->userChunks[userId] = ArrayList<int>();
-            for (int i = 0; i < chunkSha1s.size(); ++i) {
+            for (int i = 0; existingFile->merkleRoot.empty() && i < existingFile->chunkCount; ++i) {
                 existingFile->userChunks[userId].add(i);
             }
             response = "File already exists. Added you as a sharer.";
@@ -800,17 +1159,276 @@ void handleUploadFile(const ArrayList<string>& tokens, int clientSock, string& r
         }
     } else {
         // File does not exist; add new file
-        File newFile(fileName, fileSize, fileSha1, chunkSha1s);
+        File newFile(manifest.fileName, manifest.fileSize, manifest.fileSha1, manifest.chunkSize, manifest.chunkDigests, manifest.chunkCount);
+        newFile.chunkOffsets = manifest.chunkOffsets;
+        newFile.chunkLengths = manifest.chunkLengths;
+        newFile.merkleRoot = manifest.merkleRoot;
+        newFile.dataShards = manifest.dataShards;
+        newFile.parityShards = manifest.parityShards;
         newFile.userChunks[userId] = ArrayList<int>();
-        for (int i = 0; i < chunkSha1s.size(); ++i) {
+        for (int i = 0; manifest.merkleRoot.empty() && i < manifest.chunkCount; ++i) {
             newFile.userChunks[userId].add(i);
         }
-        groupFiles[groupId].add(newFile);
+        files.add(newFile);
         response = "File uploaded successfully.";
     }
+}
+
+// Validate a manifest, then add it for the logged-in user if they belong to its group
+void registerUpload(const UploadManifest& manifest, int clientSock, string& response) {
+    if (!validateManifest(manifest, response)) {
+        return;
+    }
+
+    pthread_mutex_lock(&groupsMutex);
+    if (groups.find(manifest.groupId) == groups.end()) {
+        response = "Error: Group does not exist.";
+        pthread_mutex_unlock(&groupsMutex);
+        return;
+    }
 
+    pthread_mutex_lock(&usersMutex);
+    if (clientUserMap.find(clientSock) == clientUserMap.end()) {
+        response = "Error: Please login first.";
+        pthread_mutex_unlock(&usersMutex);
+        pthread_mutex_unlock(&groupsMutex);
+        return;
+    }
+
+    string userId = clientUserMap[clientSock];
+    if (!isGroupMember(groups[manifest.groupId], userId)) {
+        response = "Error: Not a member of the group.";
+    } else {
+        addSharerLocked(manifest, userId, response);
+    }
+
+    pthread_mutex_unlock(&usersMutex);
+    pthread_mutex_unlock(&groupsMutex);
+}
+
+// announce_batch <record_count> <payload_bytes> followed by the payload: one record per file,
+// each a line "<file_name> <file_size> <file_sha1> <group_id> <chunk_size|cdc> <digest_bytes>"
+// followed by that many binary digest bytes (as in upload_file_bin), or a line
+// "<file_name> <file_size> <file_sha1> <group_id> <chunk_size> merkle <root> <chunk_count>".
+// Records are parsed first; all of them are then applied under a single lock acquisition.
+void handleAnnounceBatch(const ArrayList<string>& tokens, const string& payload, int clientSock, string& response) {
+    if (tokens.size() != 3) {
+        response = "Usage: announce_batch <record_count> <payload_bytes>";
+        return;
+    }
+    int recordCount = myAtoi(tokens.get(1));
+
+    ArrayList<UploadManifest> manifests;
+    ArrayList<string> failures;
+    size_t pos = 0;
+    for (int r = 0; r < recordCount; ++r) {
+        size_t lineEnd = payload.find('\n', pos);
+        if (lineEnd == string::npos) {
+            response = "Error: Truncated announce_batch record " + to_string(r) + ".";
+            return;
+        }
+        istringstream lineStream(payload.substr(pos, lineEnd - pos));
+        pos = lineEnd + 1;
+
+        UploadManifest manifest;
+        string chunkSizeToken, lastToken;
+        lineStream >> manifest.fileName >> manifest.fileSize >> manifest.fileSha1 >> manifest.groupId >> chunkSizeToken >> lastToken;
+        manifest.chunkSize = chunkSizeToken == "cdc" ? 0 : myAtol(chunkSizeToken);
+        string error;
+        if (lastToken == "merkle") {
+            lineStream >> manifest.merkleRoot >> manifest.chunkCount;
+            if (!lineStream || manifest.chunkSize == 0) {
+                error = "Error: Invalid Merkle record.";
+            }
+        } else {
+            if (lastToken == "rs") {
+                lineStream >> manifest.dataShards >> manifest.parityShards >> lastToken;
+            }
+            size_t digestBytes = myAtol(lastToken);
+            if (!parseBinaryDigests(payload, pos, digestBytes, manifest, error)) {
+                response = error + " (record " + to_string(r) + ")";
+                return;
+            }
+            pos += digestBytes;
+        }
+        if (error.empty() && validateManifest(manifest, error)) {
+            manifests.add(manifest);
+        } else {
+            failures.add(manifest.fileName + ": " + error);
+        }
+    }
+
+    pthread_mutex_lock(&groupsMutex);
+    pthread_mutex_lock(&usersMutex);
+    if (clientUserMap.find(clientSock) == clientUserMap.end()) {
+        response = "Error: Please login first.";
+        pthread_mutex_unlock(&usersMutex);
+        pthread_mutex_unlock(&groupsMutex);
+        return;
+    }
+    string userId = clientUserMap[clientSock];
+    int added = 0;
+    for (int i = 0; i < manifests.size(); ++i) {
+        const UploadManifest& manifest = manifests.get(i);
+        auto groupIt = groups.find(manifest.groupId);
+        if (groupIt == groups.end() || !isGroupMember(groupIt->second, userId)) {
+            failures.add(manifest.fileName + ": Error: Not a member of group " + manifest.groupId + ".");
+            continue;
+        }
+        string result;
+        addSharerLocked(manifest, userId, result);
+        added++;
+    }
     pthread_mutex_unlock(&usersMutex);
     pthread_mutex_unlock(&groupsMutex);
+
+    response = "Announced " + to_string(added) + " of " + to_string(recordCount) + " files.";
+    for (int i = 0; i < failures.size() && i < 10; ++i) {
+        response += " " + failures.get(i);
+    }
+}
+
+bool parsePeerRanking(const string& name, PeerRanking& ranking) {
+    if (name == "random") ranking = PeerRanking::RANDOM;
+    else if (name == "lru") ranking = PeerRanking::LRU;
+    else if (name == "load") ranking = PeerRanking::LOAD;
+    else if (name == "subnet") ranking = PeerRanking::SUBNET;
+    else return false;
+    return true;
+}
+
+// Number of leading bits two IPv4 addresses share (0 if either does not parse)
+int commonPrefixBits(const string& ipA, const string& ipB) {
+    in_addr a, b;
+    if (inet_pton(AF_INET, ipA.c_str(), &a) <= 0 || inet_pton(AF_INET, ipB.c_str(), &b) <= 0) {
+        return 0;
+    }
+    uint32_t diff = ntohl(a.s_addr) ^ ntohl(b.s_addr);
+    int bits = 0;
+    while (bits < 32 && !(diff & (0x80000000u >> bits))) {
+        bits++;
+    }
+    return bits;
+}
+
+long long nowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Let old transfer outcomes fade so that a peer recovers once it works again
+void decayHealth(PeerStats& stats, long long now) {
+    if (stats.decayedAt > 0 && now > stats.decayedAt) {
+        double factor = pow(0.5, (double)(now - stats.decayedAt) / HEALTH_HALF_LIFE_MS);
+        stats.goodTransfers *= factor;
+        stats.badTransfers *= factor;
+    }
+    stats.decayedAt = now;
+}
+
+// Share of reported transfers from the peer that succeeded, starting from an even 0.5 prior
+double healthScore(const PeerStats& stats) {
+    return (stats.goodTransfers + 1.0) / (stats.goodTransfers + stats.badTransfers + 2.0);
+}
+
+// Order peers by the current ranking policy and keep the best peersPerChunk of them. Peers are
+// shuffled first so that ties are broken randomly, and each peer kept is marked as handed out,
+// which moves it back in LRU order for the next chunk and lets the requester report on it. Peers
+// whose health score is below HEALTH_EXCLUDE_BELOW are dropped unless nobody else has the chunk.
+// Caller holds usersMutex.
+void rankPeers(ArrayList<string>& peers, const string& requesterId) {
+    PeerStats& requester = peerStats[requesterId];
+    string requesterIp = requester.networkIp;
+    long long now = nowMillis();
+    ArrayList<string> healthy, unhealthy;
+    for (int i = 0; i < peers.size(); ++i) {
+        PeerStats& stats = peerStats[peers.get(i)];
+        decayHealth(stats, now);
+        (healthScore(stats) < HEALTH_EXCLUDE_BELOW ? unhealthy : healthy).add(peers.get(i));
+    }
+    peers = healthy.isEmpty() ? unhealthy : healthy;
+
+    for (int i = peers.size() - 1; i > 0; --i) {
+        int j = rand() % (i + 1);
+        string swapped = peers.get(i);
+        peers.get(i) = peers.get(j);
+        peers.get(j) = swapped;
+    }
+    if (peers.size() > 1 && peerRanking != PeerRanking::RANDOM) {
+        PeerRanking ranking = peerRanking;
+        std::stable_sort(&peers.get(0), &peers.get(0) + peers.size(), [&](const string& a, const string& b) {
+            const PeerStats& statsA = peerStats[a];
+            const PeerStats& statsB = peerStats[b];
+            if (ranking == PeerRanking::LOAD && statsA.load != statsB.load) {
+                return statsA.load < statsB.load;
+            }
+            if (ranking == PeerRanking::LOAD && healthScore(statsA) != healthScore(statsB)) {
+                return healthScore(statsA) > healthScore(statsB);
+            }
+            if (ranking == PeerRanking::SUBNET) {
+                int bitsA = commonPrefixBits(statsA.networkIp, requesterIp);
+                int bitsB = commonPrefixBits(statsB.networkIp, requesterIp);
+                if (bitsA != bitsB) return bitsA > bitsB;
+            }
+            return statsA.lastHandedOut < statsB.lastHandedOut;
+        });
+    }
+    while (peers.size() > peersPerChunk) {
+        peers.removeAt(peers.size() - 1);
+    }
+    for (int i = 0; i < peers.size(); ++i) {
+        PeerStats& stats = peerStats[peers.get(i)];
+        stats.lastHandedOut = ++handoutClock;
+        stats.handouts++;
+        requester.handedPeers[peers.get(i)] = stats.lastHandedOut;
+    }
+}
+
+// report_health <upload_load> <count> [<user_id> <succeeded> <failed> <timed_out> <KBps>]...
+// A client's batched report of its own upload load and of the chunk transfers it made from
+// other peers since its last report
+void handleReportHealth(const ArrayList<string>& tokens, int clientSock, string& response) {
+    int count = tokens.size() >= 3 ? myAtoi(tokens.get(2)) : -1;
+    if (count < 0 || tokens.size() != 3 + 5 * count) {
+        response = "Usage: report_health <upload_load> <count> [<user_id> <succeeded> <failed> <timed_out> <KBps>]...";
+        return;
+    }
+
+    pthread_mutex_lock(&usersMutex);
+    if (clientUserMap.find(clientSock) == clientUserMap.end()) {
+        response = "Error: Please login first.";
+        pthread_mutex_unlock(&usersMutex);
+        return;
+    }
+    string reporterId = clientUserMap[clientSock];
+    PeerStats& reporter = peerStats[reporterId];
+    reporter.load = max(0, myAtoi(tokens.get(1)));
+
+    long long now = nowMillis();
+    int recorded = 0;
+    for (int i = 0; i < count; ++i) {
+        const string& peerUserId = tokens.get(3 + 5 * i);
+        int succeeded = min(myAtoi(tokens.get(4 + 5 * i)), HEALTH_MAX_REPORTED);
+        int failed = min(myAtoi(tokens.get(5 + 5 * i)), HEALTH_MAX_REPORTED);
+        int timedOut = min(myAtoi(tokens.get(6 + 5 * i)), HEALTH_MAX_REPORTED);
+        int rateKBps = myAtoi(tokens.get(7 + 5 * i));
+        // Only peers this tracker listed to the reporter count, so nobody can report on arbitrary users
+        if (peerUserId == reporterId || reporter.handedPeers.count(peerUserId) == 0 || succeeded < 0 || failed < 0 || timedOut < 0) {
+            continue;
+        }
+        PeerStats& stats = peerStats[peerUserId];
+        decayHealth(stats, now);
+        stats.goodTransfers += succeeded;
+        stats.badTransfers += failed + timedOut;
+        if (succeeded > 0 && rateKBps > 0) {
+            stats.rateKBps = stats.rateKBps == 0 ? rateKBps : 0.7 * stats.rateKBps + 0.3 * rateKBps;
+        }
+        stats.reports++;
+        recorded++;
+    }
+    pthread_mutex_unlock(&usersMutex);
+    response = "Recorded health of " + to_string(recorded) + " peers.";
 }
 
 void handleDownloadFile(const ArrayList<string>& tokens, int clientSock, string& response) {
@@ -883,26 +1501,53 @@ void handleDownloadFile(const ArrayList<string>& tokens, int clientSock, string&
     stringstream ss;
     ss << "download_info ";
     ss << targetFile->fileSize << " ";
-    int totalChunks = targetFile->chunkSha1s.size();
+    int totalChunks = targetFile->chunkCount;
     ss << totalChunks << " ";
-    ss << CHUNK_SIZE << " "; // Defined at the top
+    ss << targetFile->chunkSize << " ";
     ss << targetFile->fileSha1 << " ";
+    if (targetFile->dataShards > 0) {
+        ss << "rs " << targetFile->dataShards << " " << targetFile->parityShards << " ";
+    }
 
-    for (int i = 0; i < totalChunks; ++i) {
-        int chunkIndex = i;
-        ArrayList<string> peersWithChunk;
-        for (auto& userChunksEntry : targetFile->userChunks) {
-            string peerUserId = userChunksEntry.first;
-            ArrayList<int>& chunksOwned = userChunksEntry.second;
-            for (int j = 0; j < chunksOwned.size(); ++j) {
-                if (chunksOwned.get(j) == chunkIndex) {
-                    peersWithChunk.add(peerUserId);
-                    break;
-                }
+    // Holders of each chunk among the sharers that are online; listed up to peersPerChunk
+    // per chunk in ranking order
+    ArrayList<ArrayList<string>> chunkHolders;
+    for (int i = 0; targetFile->merkleRoot.empty() && i < totalChunks; ++i) {
+        chunkHolders.add(ArrayList<string>());
+    }
+    ArrayList<string> onlineSharers;
+    for (auto& userChunksEntry : targetFile->userChunks) {
+        if (userIpPortMap.find(userChunksEntry.first) == userIpPortMap.end()) {
+            continue; // Logged out; its address is unknown
+        }
+        onlineSharers.add(userChunksEntry.first);
+        ArrayList<int>& chunksOwned = userChunksEntry.second;
+        for (int j = 0; targetFile->merkleRoot.empty() && j < chunksOwned.size(); ++j) {
+            if (chunksOwned.get(j) >= 0 && chunksOwned.get(j) < totalChunks) {
+                chunkHolders.get(chunksOwned.get(j)).add(userChunksEntry.first);
             }
         }
+    }
+
+    // Merkle manifests list the root and the sharers once instead of every chunk
+    if (!targetFile->merkleRoot.empty()) {
+        rankPeers(onlineSharers, userId);
+        ss << "merkle " << targetFile->merkleRoot << " " << onlineSharers.size() << " ";
+        for (int j = 0; j < onlineSharers.size(); ++j) {
+            pair<string, int> ipPort = userIpPortMap[onlineSharers.get(j)];
+            ss << onlineSharers.get(j) << " " << ipPort.first << " " << ipPort.second << " ";
+        }
+    }
 
-        ss << chunkIndex << " " << peersWithChunk.size() << " " << targetFile->chunkSha1s.get(i) << " ";
+    for (int i = 0; targetFile->merkleRoot.empty() && i < totalChunks; ++i) {
+        int chunkIndex = i;
+        ArrayList<string>& peersWithChunk = chunkHolders.get(i);
+        rankPeers(peersWithChunk, userId);
+
+        ss << chunkIndex << " " << peersWithChunk.size() << " " << targetFile->chunkSha1(i) << " ";
+        if (targetFile->chunkSize == 0) {
+            ss << targetFile->chunkOffsets.get(i) << " " << targetFile->chunkLengths.get(i) << " ";
+        }
         for (int j = 0; j < peersWithChunk.size(); ++j) {
             string peerUserId = peersWithChunk.get(j);
             pair<string, int> ipPort = userIpPortMap[peerUserId];
@@ -910,6 +1555,33 @@ void handleDownloadFile(const ArrayList<string>& tokens, int clientSock, string&
         }
     }
 
+    // Bootstrap peers for bitfield exchange: other recent downloaders, which may hold some chunks
+    // without having shared the file. The requester joins the list.
+    ArrayList<string> swarm;
+    for (int i = 0; i < targetFile->recentDownloaders.size(); ++i) {
+        const string& peerUserId = targetFile->recentDownloaders.get(i);
+        if (peerUserId != userId && targetFile->userChunks.find(peerUserId) == targetFile->userChunks.end() &&
+            userIpPortMap.find(peerUserId) != userIpPortMap.end()) {
+            swarm.add(peerUserId);
+            peerStats[userId].handedPeers[peerUserId] = handoutClock;
+        }
+    }
+    ss << "swarm " << swarm.size() << " ";
+    for (int i = 0; i < swarm.size(); ++i) {
+        pair<string, int> ipPort = userIpPortMap[swarm.get(i)];
+        ss << swarm.get(i) << " " << ipPort.first << " " << ipPort.second << " ";
+    }
+    for (int i = 0; i < targetFile->recentDownloaders.size(); ++i) {
+        if (targetFile->recentDownloaders.get(i) == userId) {
+            targetFile->recentDownloaders.removeAt(i);
+            break;
+        }
+    }
+    targetFile->recentDownloaders.add(userId);
+    if (targetFile->recentDownloaders.size() > SWARM_BOOTSTRAP_PEERS) {
+        targetFile->recentDownloaders.removeAt(0);
+    }
+
     response = ss.str();
 
     pthread_mutex_unlock(&usersMutex);
@@ -932,42 +1604,87 @@ void* clientHandler(void* socketDescPtr) {
     connectedClients.add(clientSock);
     pthread_mutex_unlock(&clientsMutex);
 
-    char buffer[BUFFER_SIZE];
+    char buffer[RECV_BUFFER_SIZE];
     int readSize;
+    string pending; // Bytes received but not yet terminated by a newline
+    size_t scanned = 0; // Bytes of `pending` already searched for a newline
+    bool disconnect = false;
+
+    while (!disconnect && (readSize = recv(clientSock, buffer, sizeof(buffer) - 1, 0)) > 0) {
+        pending.append(buffer, readSize);
+
+        // Commands may span several recv calls (large chunk lists), so process complete lines only.
+        // Binary manifest uploads and batch announces are followed by <payload_bytes> raw bytes, their last token.
+        // The command line and the payload are each limited to MAX_COMMAND_SIZE.
+        size_t newlinePos;
+        while (!disconnect && (newlinePos = pending.find('\n', scanned)) != string::npos) {
+            if (newlinePos > MAX_COMMAND_SIZE) {
+                alertPrompt("Command from client " + to_string(clientID) + " exceeds maximum size", false);
+                disconnect = true;
+                break;
+            }
+            size_t payloadLen = 0;
+            if (pending.compare(0, 16, "upload_file_bin ") == 0 || pending.compare(0, 15, "announce_batch ") == 0 ||
+                pending.compare(0, 16, "update_file_bin ") == 0) {
+                size_t lastSpace = pending.rfind(' ', newlinePos);
+                payloadLen = myAtol(pending.substr(lastSpace + 1, newlinePos - lastSpace - 1));
+                if (payloadLen > MAX_COMMAND_SIZE) {
+                    alertPrompt("Payload from client " + to_string(clientID) + " exceeds maximum size", false);
+                    disconnect = true;
+                    break;
+                }
+            }
+            if (pending.length() < newlinePos + 1 + payloadLen) {
+                scanned = newlinePos; // Wait for the rest of the payload
+                break;
+            }
+            string command = pending.substr(0, newlinePos + 1);
+            string payload = pending.substr(newlinePos + 1, payloadLen);
+            pending.erase(0, newlinePos + 1 + payloadLen);
+            scanned = 0;
+            cout << "\nReceived command from client " << clientID << ": " << command;
+            if (payloadLen > 0) {
+                cout << "(with " << payloadLen << " byte binary manifest)";
+            }
+            cout << endl;
+            cout.flush();  // Ensure immediate output
+
+            // Split the command into tokens
+            ArrayList<string> tokens;
+            char* commandCStr = new char[command.length() + 1];
+            strcpy(commandCStr, command.c_str());
+            char* tokenPtr = strtok(commandCStr, " \n");
+            while (tokenPtr != NULL) {
+                tokens.add(string(tokenPtr));
+                tokenPtr = strtok(NULL, " \n");
+            }
+            delete[] commandCStr;
 
-    while ((readSize = recv(clientSock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[readSize] = '\0';
-        string command(buffer);
-        cout << "\nReceived command from client " << clientID << ": " << command << endl;
-        cout.flush();  // Ensure immediate output
-
-        // Split the command into tokens
-        ArrayList<string> tokens;
-        char* commandCStr = new char[command.length() + 1];
-        strcpy(commandCStr, command.c_str());
-        char* tokenPtr = strtok(commandCStr, " \n");
-        while (tokenPtr != NULL) {
-            tokens.add(string(tokenPtr));
-            tokenPtr = strtok(NULL, " \n");
-        }
-        delete[] commandCStr;
+            string response;
+            bool continueRunning = handleCommand(tokens, payload, clientSock, response);
 
-        string response;
-        bool continueRunning = handleCommand(tokens, clientSock, response);
+            response += "\n";  // Ensure response ends with a newline
+            if (send(clientSock, response.c_str(), response.length(), 0) < 0) {
+                alertPrompt("send failed", true);
+                disconnect = true;
+                break;
+            }
 
-        response += "\n";  // Ensure response ends with a newline
-        if (send(clientSock, response.c_str(), response.length(), 0) < 0) {
-            alertPrompt("send failed", true);
-            break;
-        }
+            if (!continueRunning && tokens.get(0) == "quit") {
+                // Only disconnect the client, do not shut down the server
+                disconnect = true;
+            }
 
-        if (!continueRunning && tokens.get(0) == "quit") {
-            // Only disconnect the client, do not shut down the server
-            break;
+            if (!continueRunning && tokens.get(0) == "shutdown") {
+                disconnect = true;
+            }
         }
-
-        if (!continueRunning && tokens.get(0) == "shutdown") {
-            break;
+        if (newlinePos == string::npos) {
+            scanned = pending.length();
+            if (pending.length() > MAX_COMMAND_SIZE) {
+                alertPrompt("Command from client " + to_string(clientID) + " exceeds maximum size", false);
+                break;
+            }
         }
     }
 
@@ -1045,8 +1762,38 @@ void* serverCommandHandler(void* arg) {
             serverRunning = false;
             break;
         }
+        else if (command.compare(0, 12, "set_ranking ") == 0) {
+            // Expected format: set_ranking <random|lru|load|subnet> [peers_per_chunk]
+            istringstream commandStream(command.substr(12));
+            string policy;
+            int limit = 0;
+            commandStream >> policy;
+            bool hasLimit = static_cast<bool>(commandStream >> limit);
+            PeerRanking ranking;
+            if (!parsePeerRanking(policy, ranking) || (hasLimit && limit < 1)) {
+                cout << "Usage: set_ranking <random|lru|load|subnet> [peers_per_chunk]" << endl;
+                continue;
+            }
+            pthread_mutex_lock(&usersMutex);
+            peerRanking = ranking;
+            if (hasLimit) peersPerChunk = limit;
+            cout << "download_info lists up to " << peersPerChunk << " peers per chunk, ranked by " << policy << "." << endl;
+            pthread_mutex_unlock(&usersMutex);
+        }
+        else if (command == "show_peers") {
+            pthread_mutex_lock(&usersMutex);
+            long long now = nowMillis();
+            for (auto& entry : peerStats) {
+                decayHealth(entry.second, now);
+                cout << entry.first << (userIpPortMap.count(entry.first) > 0 ? " (online)" : " (offline)")
+                     << ": health " << healthScore(entry.second) << ", load " << entry.second.load << ", "
+                     << (long)entry.second.rateKBps << " KB/s, listed " << entry.second.handouts << " times, "
+                     << entry.second.reports << " reports" << endl;
+            }
+            pthread_mutex_unlock(&usersMutex);
+        }
         else if (!command.empty()) {
-            cout << "Unknown command. Type 'shutdown' to stop the server." << endl;
+            cout << "Unknown command. Type 'shutdown', 'show_peers' or 'set_ranking <random|lru|load|subnet> [peers_per_chunk]'." << endl;
         }
     }
     return NULL;
@@ -1056,6 +1803,7 @@ void* serverCommandHandler(void* arg) {
 
 int main(int argc, char* argv[]) {
     signal(SIGINT, signalHandler);
+    srand(time(NULL) ^ getpid()); // Tie-breaking in peer ranking
 
     if (argc != 3) {
         alertPrompt("Please follow correct usage: " + string(argv[0]) + " <tracker_info.txt> <tracker_no>", false);